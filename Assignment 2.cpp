@@ -3,7 +3,54 @@
 #include <algorithm>
 #include <unordered_map>
 #include <fstream>
+#include <sstream>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <latch>
+#include <functional>
+#include <string_view>
+#include <cstdio>
+#include <filesystem>
+#include <deque>
+#include <unordered_set>
+#include <array>
+#include <bit>
+#include <ranges>
+#include <typeinfo>
+#include <iomanip>
+#include <climits>
+#include <cmath>
+#include <charconv>
+#include <span>
+#include <limits>
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 // Output stream shortcut
 
@@ -83,6 +130,24 @@ public:
     }
 };
 
+class TargetOutOfRange: public std::exception
+{
+public:
+    const char *what()
+    {
+        return "Target is farther than the range of the attack or the cast";
+    }
+};
+
+class OutsideOfMap: public std::exception
+{
+public:
+    const char *what()
+    {
+        return "Square is not on the map";
+    }
+};
+
 // Forward Declarations of Classes
 
 class Character;
@@ -98,6 +163,178 @@ class Archer;
 class Wizard;
 class Game;
 
+// Pairs of an item and its copy made for a forked session
+using ItemCopies = std::vector<std::pair<std::shared_ptr<PhysicalItem>, std::shared_ptr<PhysicalItem>>>;
+
+// Numbers of the items of a character by kind: weapons, potions, spells
+using ItemCounts = std::array<int, 3>;
+
+// Output
+
+/// <summary>
+/// Class OutputBuffer represents the text output of the game assembled in a byte buffer.
+/// Numbers are written with std::to_chars and literals with the length known at compile time,
+/// so nothing goes through the locale and the sentries of the output streams.
+/// A discarding buffer drops its text when it is full instead of growing.
+/// </summary>
+class OutputBuffer
+{
+private:
+    // Bytes of the buffer, the first size of them hold the text
+    std::unique_ptr<char[]> bytes;
+
+    // Number of bytes of the text
+    std::size_t size;
+
+    // Number of bytes of the buffer
+    std::size_t capacity;
+
+    // States whether the text is dropped when the buffer is full
+    bool isDiscarding;
+
+    /// <summary>
+    /// Makes room for more bytes at the end of the text.
+    /// </summary>
+    /// <param name="length"> number of bytes to add </param>
+    void grow(std::size_t length)
+    {
+        if (isDiscarding) {
+            size = 0;
+            if (length <= capacity) {
+                return;
+            }
+        }
+
+        std::size_t newCapacity = std::max(2 * capacity, size + length);
+        auto newBytes = std::make_unique_for_overwrite<char[]>(newCapacity);
+        std::copy(bytes.get(), bytes.get() + size, newBytes.get());
+        bytes = std::move(newBytes);
+        capacity = newCapacity;
+    }
+
+    /// <summary>
+    /// Returns the place for more bytes at the end of the text.
+    /// </summary>
+    /// <param name="length"> number of bytes to add </param>
+    /// <returns> pointer to the end of the text </returns>
+    char *reserve(std::size_t length)
+    {
+        if (capacity - size < length) {
+            grow(length);
+        }
+        return bytes.get() + size;
+    }
+
+public:
+
+    /// <summary>
+    /// Constructor of the class.
+    /// </summary>
+    /// <param name="capacity"> initial number of bytes of the buffer </param>
+    /// <param name="isDiscarding"> true to drop the text </param>
+    explicit OutputBuffer(std::size_t capacity = 1 << 12, bool isDiscarding = false)
+        : bytes(std::make_unique_for_overwrite<char[]>(capacity)), size(0), capacity(capacity), isDiscarding(isDiscarding)
+    {}
+
+    /// <summary>
+    /// Appends bytes to the text.
+    /// </summary>
+    /// <param name="text"> pointer to the bytes </param>
+    /// <param name="length"> number of bytes </param>
+    /// <returns> reference to the buffer </returns>
+    OutputBuffer &write(const char *text, std::size_t length)
+    {
+        std::memcpy(reserve(length), text, length);
+        size += length;
+        return *this;
+    }
+
+    /// <summary>
+    /// Appends a literal, its length is known at compile time.
+    /// </summary>
+    /// <param name="literal"> string literal </param>
+    /// <returns> reference to the buffer </returns>
+    template<std::size_t N>
+    OutputBuffer &operator<<(const char (&literal)[N])
+    {
+        return write(literal, N - 1);
+    }
+
+    /// <summary>
+    /// Appends a string.
+    /// </summary>
+    /// <param name="text"> string to append </param>
+    /// <returns> reference to the buffer </returns>
+    OutputBuffer &operator<<(std::string_view text)
+    {
+        return write(text.data(), text.size());
+    }
+
+    /// <summary>
+    /// Appends a character.
+    /// </summary>
+    /// <param name="c"> character to append </param>
+    /// <returns> reference to the buffer </returns>
+    OutputBuffer &operator<<(char c)
+    {
+        *reserve(1) = c;
+        ++size;
+        return *this;
+    }
+
+    /// <summary>
+    /// Appends an integer in decimal.
+    /// </summary>
+    /// <param name="value"> integer to append </param>
+    /// <returns> reference to the buffer </returns>
+    template<std::integral T>
+    requires (!std::same_as<T, char> && !std::same_as<T, bool>)
+    OutputBuffer &operator<<(T value)
+    {
+        constexpr std::size_t maxLength = std::numeric_limits<T>::digits10 + 2;
+        char *end = reserve(maxLength);
+        size = std::to_chars(end, end + maxLength, value).ptr - bytes.get();
+        return *this;
+    }
+
+    /// <summary>
+    /// Getter for the length of the text.
+    /// </summary>
+    /// <returns> number of bytes of the text </returns>
+    std::size_t length() const
+    {
+        return size;
+    }
+
+    /// <summary>
+    /// Getter for the text.
+    /// </summary>
+    /// <returns> view of the text, valid until the next change </returns>
+    std::string_view view() const
+    {
+        return std::string_view(bytes.get(), size);
+    }
+
+    /// <summary>
+    /// Moves the text out of the buffer, keeping the buffer for the next text.
+    /// </summary>
+    /// <returns> the text </returns>
+    std::string take()
+    {
+        std::string text(bytes.get(), size);
+        size = 0;
+        return text;
+    }
+
+    /// <summary>
+    /// Drops the text.
+    /// </summary>
+    void clear()
+    {
+        size = 0;
+    }
+};
+
 // Concepts
 
 /// <summary>
@@ -111,7 +348,7 @@ concept DerivedFromPhysicalItem = std::derived_from<T, PhysicalItem>;
 /// </summary>
 template<typename T>
 concept Printable =
-    requires(std::ostream & os, T
+    requires(OutputBuffer & os, T
 
 x) {
 x.
@@ -146,6 +383,43 @@ x<y;
 template<typename T>
 concept ComparableAndPrintable = Printable<T> && Comparable<T>;
 
+// Views
+
+/// <summary>
+/// Visits the elements of a range in the ascending order.
+/// Pointers to the elements are sorted in a buffer kept by the calling thread,
+/// so no memory is allocated once the buffer has grown and the elements are not copied.
+/// </summary>
+/// <typeparam name="T"> type of the elements </typeparam>
+/// <param name="range"> range of references to the elements </param>
+/// <param name="visit"> procedure applied to an element </param>
+template<typename T, typename Range, typename Visit>
+void visitInAscendingOrder(Range &&range, Visit &&visit)
+{
+    // Nested visits use the buffer above the part of the enclosing one
+    static thread_local std::vector<T *> buffer;
+    std::size_t start = buffer.size();
+
+    for (T &element: range) {
+        buffer.push_back(&element);
+    }
+    std::sort(buffer.begin() + start, buffer.end(), [](const T *first, const T *second)
+    {
+        return (*first < *second);
+    });
+
+    try {
+        for (std::size_t i = start, end = buffer.size(); i < end; ++i) {
+            visit(*buffer[i]);
+        }
+    }
+    catch (...) {
+        buffer.resize(start);
+        throw;
+    }
+    buffer.resize(start);
+}
+
 // Classes
 
 /// <summary>
@@ -224,6 +498,15 @@ public:
         elements.push_back(newItem);
     }
 
+    /// <summary>
+    /// Reserves storage for the given number of elements.
+    /// </summary>
+    /// <param name="capacity"> number of elements </param>
+    void reserve(std::size_t capacity)
+    {
+        elements.reserve(capacity);
+    }
+
     /// <summary>
     /// Getter for the vector of elements.
     /// </summary>
@@ -232,6 +515,28 @@ public:
     {
         return elements;
     }
+
+    /// <summary>
+    /// View of the elements that neither copies the pointers nor changes their reference counts.
+    /// </summary>
+    /// <returns> range of references to the elements in the order of insertion </returns>
+    auto view() const
+    {
+        return elements | std::views::transform([](const std::shared_ptr<T> &element) -> T &
+        {
+            return *element;
+        });
+    }
+
+    /// <summary>
+    /// Visits the elements in the ascending order without copying the pointers.
+    /// </summary>
+    /// <param name="visit"> procedure applied to an element </param>
+    template<typename Visit>
+    void visitSorted(Visit &&visit) const
+    {
+        visitInAscendingOrder<T>(view(), visit);
+    }
 };
 
 /// <summary>
@@ -286,12 +591,31 @@ public:
     /// <returns> the pointer to the item instance </returns>
     std::shared_ptr<T> get(const std::string &itemName) const;
 
+    /// <summary>
+    /// Replaces every item with a copy belonging to a new owner.
+    /// </summary>
+    /// <param name="owner"> pointer to the new owner </param>
+    /// <param name="copiedItems"> receiver of the pairs of an item and its copy </param>
+    void rebind(const std::shared_ptr<Character> &owner, ItemCopies &copiedItems);
+
     /// <summary>
     /// Getter for the vector of elements.
     /// </summary>
     /// <returns> the vector of pointers to the items stored in the container </returns>
     std::vector<std::shared_ptr<T>> getElements() const;
 
+    /// <summary>
+    /// View of the items that neither copies the pointers nor changes their reference counts.
+    /// </summary>
+    /// <returns> range of references to the items in no particular order </returns>
+    auto view() const;
+
+    /// <summary>
+    /// Visits the items in the ascending order without copying the pointers.
+    /// </summary>
+    /// <param name="visit"> procedure applied to an item </param>
+    template<typename Visit>
+    void visitSorted(Visit &&visit) const;
 };
 
 /// <summary>
@@ -325,1456 +649,10351 @@ public:
 };
 
 /// <summary>
-/// Abstract class Character represents a player
-/// in the story.
-/// 
-/// The class enables creating shared pointers to an instance.
+/// Template class to represent an index shared by forked sessions. The sessions read the same index
+/// until one of them is about to change it, that session copies the index first.
 /// </summary>
-class Character: public std::enable_shared_from_this<Character>
+/// <typeparam name="T"> type of the index </typeparam>
+template<typename T>
+class SharedIndex
 {
 private:
-    // Name of a character
-    std::string name;
+    std::shared_ptr<T> index;
+public:
 
-    // Health points of a character
-    int healthPoints;
+    // Constructor
+    SharedIndex()
+        : index(std::make_shared<T>())
+    {}
 
-    /// <summary>
-    /// Manages taking damage to a character.
-    /// </summary>
-    /// <param name="damage"> damage value </param>
-    void takeDamage(int damage);
+    // Copy constructor, forks a session, both sessions keep the same index
+    SharedIndex(const SharedIndex &other) = default;
 
-    /// <summary>
-    /// Manages healing a character.
-    /// </summary>
-    /// <param name="healValue">heal value</param>
-    void heal(int healValue);
-protected:
+    // Move constructor, leaves the moved index without a value, used when the index is a part of a larger one
+    SharedIndex(SharedIndex &&other) = default;
+
+    // Assignment operators
+    SharedIndex &operator=(const SharedIndex &other) = default;
+
+    SharedIndex &operator=(SharedIndex &&other) = default;
+
+    T *operator->() const
+    {
+        return index.get();
+    }
+
+    T &operator*() const
+    {
+        return *index;
+    }
 
     /// <summary>
-    /// Abstract function that manages obtaining an item by a character.
+    /// Function to determine whether another session keeps the index.
     /// </summary>
-    /// <param name="item"> pointer to the item </param>
-    virtual void obtainItem(std::shared_ptr<PhysicalItem> item) = 0;
+    /// <returns> true if the index is shared else false </returns>
+    bool isShared() const
+    {
+        if (index.use_count() > 1) {
+            return true;
+        }
+        // The count is read without ordering, copying the pointer is an acquire on the count so
+        // the reads of a session that copied the index and let it go finish before a change in place
+        std::shared_ptr<T> owner = index;
+        return false;
+    }
 
     /// <summary>
-    /// Abstract function that manages losing an item by a character.
+    /// Copies the index if another session keeps it, the caller holds the lock guarding the index.
+    /// A session keeping the index alone changes it in place.
     /// </summary>
-    /// <param name="item"> pointer to the item </param>
-    virtual void loseItem(const std::shared_ptr<PhysicalItem> item) = 0;
-public:
+    void detach()
+    {
+        if (isShared()) {
+            index = std::make_shared<T>(*index);
+        }
+    }
+};
 
-    // Allows PhysicalItem and Game classes to access private and protected members of class Character
-    friend class PhysicalItem;
-    friend class Game;
+/// <summary>
+/// Template class to represent values by the ordinals of the characters. The values are kept in chunks
+/// of consecutive ordinals shared by forked sessions, a change copies only the chunk of its ordinal
+/// and, once per session, the list of the chunks.
+/// </summary>
+/// <typeparam name="T"> type of the values, a value-initialized one stands for no value </typeparam>
+template<typename T>
+class OrdinalTable
+{
+private:
+    // Number of ordinals of a chunk as a power of two
+    static constexpr std::size_t chunkShift = 5;
 
-    // Constructor
-    Character(const std::string nameString, int healthValue);
+    static constexpr std::size_t chunkSize = std::size_t(1) << chunkShift;
 
-    // Destructor
-    virtual ~Character();
+    using Chunk = std::array<T, chunkSize>;
 
-    /// <summary>
-    /// Getter for name.
-    /// </summary>
-    /// <returns> the name of the character </returns>
-    std::string getName() const;
+    // Chunks in the order of the ordinals
+    SharedIndex<std::vector<SharedIndex<Chunk>>> chunks;
+public:
 
     /// <summary>
-    /// Getter for health points.
+    /// Finds the value of an ordinal.
     /// </summary>
-    /// <returns>current health points of the character </returns>
-    int getHp() const;
+    /// <param name="ordinal"> ordinal of the character </param>
+    /// <returns> pointer to the value, nullptr if the ordinal lies beyond the chunks </returns>
+    const T *find(std::uint64_t ordinal) const
+    {
+        std::size_t chunk = ordinal >> chunkShift;
+        if (chunk >= chunks->size()) {
+            return nullptr;
+        }
+        return &(*(*chunks)[chunk])[ordinal & (chunkSize - 1)];
+    }
 
     /// <summary>
-    /// Operator to compare two Characters.
+    /// Getter for the value of an ordinal to change, the chunk is copied first if another session keeps it.
     /// </summary>
-    /// <param name="other"> comparing character </param>
-    /// <returns>true if compared character is bigger than comparing one</returns>
-    bool operator>(const Character &other) const;
+    /// <param name="ordinal"> ordinal of the character </param>
+    /// <returns> reference to the value </returns>
+    T &operator[](std::uint64_t ordinal)
+    {
+        std::size_t chunk = ordinal >> chunkShift;
+        chunks.detach();
+        if (chunk >= chunks->size()) {
+            chunks->resize(chunk + 1);
+        }
+        auto &values = (*chunks)[chunk];
+        values.detach();
+        return (*values)[ordinal & (chunkSize - 1)];
+    }
 
     /// <summary>
-    /// Operator to compare two Characters.
+    /// Reserves storage for the chunks of the given number of ordinals.
     /// </summary>
-    /// <param name="other"> comparing character </param>
-    /// <returns> true if the compared character is less than the comparing one </returns>
-    bool operator<(const Character &other) const;
+    /// <param name="ordinals"> number of ordinals </param>
+    void reserve(std::uint64_t ordinals)
+    {
+        chunks.detach();
+        chunks->reserve((ordinals + chunkSize - 1) >> chunkShift);
+    }
 
     /// <summary>
-    /// Abstract function to print information about a character to the output stream.
+    /// View of the values in the order of the ordinals, the value-initialized ones included.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    virtual void print(std::ostream &out) const = 0;
+    /// <returns> range of references to the values </returns>
+    auto view() const
+    {
+        return *chunks | std::views::transform([](const SharedIndex<Chunk> &chunk) -> const Chunk &
+        {
+            return *chunk;
+        }) | std::views::join;
+    }
 };
 
 /// <summary>
-/// Singleton class Game to represent a
-/// single game session.
+/// Template class to represent a hash map split into shards by the hash of the key. Forked sessions share
+/// the shards, a change copies only the shard of its key and, once per session, the list of the shards.
+/// The number of shards doubles as the map grows, so a shard keeps a few entries.
 /// </summary>
-class Game
+/// <typeparam name="Key"> type of the keys </typeparam>
+/// <typeparam name="Value"> type of the values </typeparam>
+/// <typeparam name="shardLoad"> mean number of entries of a shard above which the number of shards doubles,
+/// larger shards are found faster and smaller ones are copied faster </typeparam>
+template<typename Key, typename Value, std::size_t shardLoad = 16>
+class ShardedMap
 {
 private:
-    // Singleton instance
-    static std::shared_ptr<Game> game;
+    using Shard = std::unordered_map<Key, Value>;
 
-    // Container of alive characters
-    Container<Character> characters;
+    // Shards, their number is a power of two
+    SharedIndex<std::vector<SharedIndex<Shard>>> shards;
 
-    // Input stream
-    std::ifstream input;
+    // Binary logarithm of the number of shards
+    int shardBits;
 
-    // Output stream
-    std::ofstream output;
+    // Number of entries
+    std::size_t count;
 
     /// <summary>
-    /// Function to get Character instance from the container.
+    /// Finds the shard of a key by the top bits of the hash, multiplied first
+    /// to spread the hashes of integers, which are the integers themselves.
     /// </summary>
-    /// <param name="name"> name of the character </param>
-    /// <returns> pointer to the character instance </returns>
-    std::shared_ptr<Character> getCharacterByName(std::string name) const;
+    /// <param name="key"> key of the entry </param>
+    /// <returns> number of the shard </returns>
+    std::size_t shardOf(const Key &key) const
+    {
+        std::uint64_t hash = std::uint64_t(std::hash<Key>{}(key)) * 0x9E3779B97F4A7C15ull;
+        return (shardBits == 0) ? 0 : std::size_t(hash >> (64 - shardBits));
+    }
 
     /// <summary>
-    /// Displays information about alive characters in the lexicographical order of names.
+    /// Getter for a shard to change, the shard is copied first if another session keeps it.
     /// </summary>
-    void showCharacters();
+    /// <param name="shard"> number of the shard </param>
+    /// <returns> reference to the shard </returns>
+    Shard &writable(std::size_t shard)
+    {
+        shards.detach();
+        auto &entries = (*shards)[shard];
+        entries.detach();
+        return *entries;
+    }
 
-    // Private constructor
-    Game();
+    /// <summary>
+    /// Spreads the entries over a larger number of shards, the entries of the shards
+    /// no other session keeps are moved and the rest are copied.
+    /// </summary>
+    /// <param name="bits"> binary logarithm of the new number of shards </param>
+    void grow(int bits)
+    {
+        SharedIndex<std::vector<SharedIndex<Shard>>> regrown;
+        regrown->resize(std::size_t(1) << bits);
+        shardBits = bits;
+
+        // Shards of a shared list are kept by the other session as well
+        bool isShared = shards.isShared();
+        for (auto &shard: *shards) {
+            if (isShared || shard.isShared()) {
+                for (auto &entry: *shard) {
+                    (*regrown)[shardOf(entry.first)]->insert(entry);
+                }
+                continue;
+            }
+            while (!shard->empty()) {
+                auto node = shard->extract(shard->begin());
+                (*regrown)[shardOf(node.key())]->insert(std::move(node));
+            }
+        }
+        shards = std::move(regrown);
+    }
 public:
 
+    // Constructor
+    ShardedMap()
+        : shards(), shardBits(0), count(0)
+    {
+        shards->resize(1);
+    }
+
     /// <summary>
-    /// Entry point of the game.
-    /// Deals with reading input and processing commands.
+    /// Getter for the number of entries.
     /// </summary>
-    void startNewGame();
+    /// <returns> number of entries </returns>
+    std::size_t size() const
+    {
+        return count;
+    }
 
     /// <summary>
-    /// Instance getter.
+    /// Function to determine whether the map has no entries.
     /// </summary>
-    /// <returns> pointer to the Game instance </returns>
-    static std::shared_ptr<Game> currentGame();
+    /// <returns> true if the map is empty else false </returns>
+    bool empty() const
+    {
+        return (count == 0);
+    }
 
     /// <summary>
-    /// Procedure to remove a character from the game.
+    /// Finds the value of a key.
     /// </summary>
-    /// <param name="ptr"> pointer to the character instance </param>
-    void destroyCharacter(std::shared_ptr<Character> ptr);
+    /// <param name="key"> key of the entry </param>
+    /// <returns> pointer to the value, nullptr if there is no such entry </returns>
+    const Value *find(const Key &key) const
+    {
+        const Shard &shard = *(*shards)[shardOf(key)];
+        auto entry = shard.find(key);
+        return (entry != shard.end()) ? &entry->second : nullptr;
+    }
 
     /// <summary>
-    /// Getter for the output stream.
+    /// Finds the value of a key to change, the shard is copied first if another session keeps it.
     /// </summary>
-    /// <returns> the reference to the output stream </returns>
-    std::ofstream &getOutput();
-};
-
-// Container for Physical Items Methods
-
-template<DerivedFromPhysicalItem T>
-Container<T>::Container()
-    : map()
-{}
-
-template<DerivedFromPhysicalItem T>
-Container<T>::~Container()
-{
+    /// <param name="key"> key of the entry </param>
+    /// <returns> pointer to the value, nullptr if there is no such entry </returns>
+    Value *findWritable(const Key &key)
+    {
+        std::size_t shard = shardOf(key);
+        if (!(*shards)[shard]->contains(key)) {
+            return nullptr;
+        }
+        return &writable(shard).find(key)->second;
+    }
 
-    // Destroying elements stored in the container
-    for (auto it = map.begin(); it != map.end(); ++it) {
-        auto &itemPtr = it->second;
-        itemPtr.reset();
+    /// <summary>
+    /// Getter for the value of a key to change, a missing entry is inserted with a value-initialized value.
+    /// </summary>
+    /// <param name="key"> key of the entry </param>
+    /// <returns> reference to the value </returns>
+    Value &operator[](const Key &key)
+    {
+        std::size_t shard = shardOf(key);
+        if (!(*shards)[shard]->contains(key)) {
+            if (count + 1 > shards->size() * shardLoad) {
+                grow(shardBits + 1);
+                shard = shardOf(key);
+            }
+            ++count;
+        }
+        return writable(shard)[key];
     }
-}
 
-template<DerivedFromPhysicalItem T>
-int Container<T>::size() const
-{
-    return map.size();
-}
+    /// <summary>
+    /// Removes the entry of a key, nothing happens if there is no such entry.
+    /// </summary>
+    /// <param name="key"> key of the entry </param>
+    void erase(const Key &key)
+    {
+        std::size_t shard = shardOf(key);
+        if ((*shards)[shard]->contains(key)) {
+            writable(shard).erase(key);
+            --count;
+        }
+    }
 
-template<DerivedFromPhysicalItem T>
-void Container<T>::addItem(std::shared_ptr<T> newItem)
-{
-    map.insert(std::make_pair(newItem->getName(), newItem));
-}
+    /// <summary>
+    /// Reserves shards for the given number of entries.
+    /// </summary>
+    /// <param name="entries"> number of entries </param>
+    void reserve(std::size_t entries)
+    {
+        int bits = shardBits;
+        while ((std::size_t(1) << bits) * shardLoad < entries) {
+            ++bits;
+        }
+        if (bits != shardBits) {
+            grow(bits);
+        }
+    }
 
-template<DerivedFromPhysicalItem T>
-void Container<T>::removeItem(const std::string &itemName)
-{
-    if (map.erase(itemName) == 0) {
-        throw ElementNotFound();
+    /// <summary>
+    /// Visits the entries in no particular order.
+    /// </summary>
+    /// <param name="visit"> procedure applied to a key and its value </param>
+    template<typename Visit>
+    void visit(Visit &&visit) const
+    {
+        for (auto &shard: *shards) {
+            for (auto &[key, value]: *shard) {
+                visit(key, value);
+            }
+        }
     }
-}
+};
 
-template<DerivedFromPhysicalItem T>
-bool Container<T>::find(const std::string &itemName) const
+/// <summary>
+/// Abstract class Character represents a player
+/// in the story.
+/// 
+/// The class enables creating shared pointers to an instance.
+/// </summary>
+class Character: public std::enable_shared_from_this<Character>
 {
-    return map.contains(itemName);
-}
+private:
+    // Name of a character
+    std::string name;
 
-template<DerivedFromPhysicalItem T>
-std::shared_ptr<T> Container<T>::get(const std::string &itemName) const
-{
-    auto result = map.find(itemName);
-    if (result == map.end()) {
-        throw ElementNotFound();
-    }
-    return result->second;
-}
+    // Health points of a character
+    int healthPoints;
 
-template<DerivedFromPhysicalItem T>
-std::vector<std::shared_ptr<T>> Container<T>::getElements() const
-{
-    std::vector<std::shared_ptr<T>> result;
-    for (auto it = map.begin(); it != map.end(); ++it) {
-        result.push_back(it->second);
-    }
-    return result;
-}
+    // Number of changes of the inventory and of the presence in the game,
+    // used to validate commands executed speculatively
+    std::uint64_t version;
 
-// Container with Max Capacity Methods
+    // Position of the character in the order of creation, orders characters with equal names
+    // when they are printed and characters with equal health points and names in the health index
+    std::uint64_t ordinal;
 
-template<ComparableAndPrintable T>
-ContainerWithMaxCapacity<T>::ContainerWithMaxCapacity(int maxCapacity)
-    : Container<T>(), maxCapacity(maxCapacity)
-{}
+    // States whether the character is still in the game
+    bool isAlive;
 
-template<ComparableAndPrintable T>
-ContainerWithMaxCapacity<T>::~ContainerWithMaxCapacity() = default;
+    // Damage added to the weapons of the character by active buffs
+    int damageBonus;
 
-template<ComparableAndPrintable T>
-void ContainerWithMaxCapacity<T>::addItem(std::shared_ptr<T> newItem)
-{
+    // Position of the character on the grid
+    int x;
+    int y;
 
-    // Additional check for available space
-    if (this->size() == maxCapacity) {
-        throw FullContainer();
-    }
-    this->Container<T>::addItem(newItem);
-}
+    // Generation of the session that changes the character in place, a character of another generation
+    // is shared with a forked session and copied before a change
+    std::uint64_t generation;
 
-template<ComparableAndPrintable T>
-void ContainerWithMaxCapacity<T>::show() const
-{
+    /// <summary>
+    /// Manages taking damage to a character.
+    /// </summary>
+    /// <param name="damage"> damage value </param>
+    void takeDamage(int damage);
+
+    /// <summary>
+    /// Manages healing a character.
+    /// </summary>
+    /// <param name="healValue">heal value</param>
+    void heal(int healValue);
+protected:
 
-    // Vector of the elements
-    auto v = this->getElements();
+    /// <summary>
+    /// Abstract function that manages obtaining an item by a character.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    virtual void obtainItem(std::shared_ptr<PhysicalItem> item) = 0;
 
-    // Instance of the game
-    auto game = Game::currentGame();
+    /// <summary>
+    /// Abstract function that manages losing an item by a character.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    virtual void loseItem(const std::shared_ptr<PhysicalItem> item) = 0;
 
-    // Sorting elements
-    std::sort(v.begin(), v.end(), [](const std::shared_ptr<T> first, const std::shared_ptr<T> second)
-    {
-        return (*first < *second);
-    });
+    /// <summary>
+    /// Abstract function that lists the items of a character.
+    /// </summary>
+    /// <returns> pointers to the items </returns>
+    virtual std::vector<std::shared_ptr<PhysicalItem>> getItems() const = 0;
 
-    // Printing elements
-    for (auto &element: v) {
-        element->print(sysout);
-    }
-    sysout << std::endl;
-}
+    /// <summary>
+    /// Abstract function that counts the items of a character by kind.
+    /// </summary>
+    /// <returns> numbers of the weapons, the potions and the spells </returns>
+    virtual ItemCounts countItems() const = 0;
 
-// Character Methods
+    /// <summary>
+    /// Abstract function that tells the class of a character.
+    /// </summary>
+    /// <returns> 0 for a fighter, 1 for an archer, 2 for a wizard </returns>
+    virtual int getClass() const = 0;
 
-void Character::takeDamage(int damage)
-{
-    healthPoints -= damage;
+    /// <summary>
+    /// Abstract function that copies a character together with its items, the copies of the items belong to the copy.
+    /// </summary>
+    /// <param name="copiedItems"> receiver of the pairs of an item and its copy </param>
+    /// <returns> pointer to the copy </returns>
+    virtual std::shared_ptr<Character> clone(ItemCopies &copiedItems) const = 0;
+public:
 
-    // Check whether a character is alive
-    if (healthPoints <= 0) {
-        auto game = Game::currentGame();
+    // Allows PhysicalItem, Game, Roster, HealthIndex, SpatialHash and ItemIndex classes to access private and protected members of class Character
+    friend class PhysicalItem;
+    friend class Game;
+    friend class Roster;
+    friend class HealthIndex;
+    friend class SpatialHash;
+    friend class ItemIndex;
 
-        // Remove dead character from the game
-        game->destroyCharacter(this->shared_from_this());
-    }
-}
+    // Constructor
+    Character(const std::string nameString, int healthValue);
 
-void Character::heal(int healValue)
-{
-    healthPoints += healValue;
-}
+    // Destructor
+    virtual ~Character();
 
-Character::Character(const std::string nameString, int healthValue)
-    : name(nameString), healthPoints(healthValue)
-{}
+    /// <summary>
+    /// Getter for name.
+    /// </summary>
+    /// <returns> the name of the character </returns>
+    const std::string &getName() const;
 
-Character::~Character() = default;
+    /// <summary>
+    /// Getter for health points.
+    /// </summary>
+    /// <returns>current health points of the character </returns>
+    int getHp() const;
 
-std::string Character::getName() const
-{
-    return name;
-}
+    /// <summary>
+    /// Getter for the damage added by active buffs.
+    /// </summary>
+    /// <returns> damage bonus of the character </returns>
+    int getDamageBonus() const;
 
-int Character::getHp() const
-{
-    return healthPoints;
-}
+    /// <summary>
+    /// Operator to compare two Characters.
+    /// </summary>
+    /// <param name="other"> comparing character </param>
+    /// <returns>true if compared character is bigger than comparing one</returns>
+    bool operator>(const Character &other) const;
 
-bool Character::operator>(const Character &other) const
-{
-    // Lexicographical comparison
-    return (name.compare(other.getName()) > 0);
-}
+    /// <summary>
+    /// Operator to compare two Characters.
+    /// </summary>
+    /// <param name="other"> comparing character </param>
+    /// <returns> true if the compared character is less than the comparing one </returns>
+    bool operator<(const Character &other) const;
 
-bool Character::operator<(const Character &other) const
-{
-    // Lexicographical comparison
-    return (name.compare(other.getName()) < 0);
-}
+    /// <summary>
+    /// Abstract function to print information about a character to the output stream.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    virtual void print(OutputBuffer &out) const = 0;
+};
 
 /// <summary>
-/// Abstract class PhysicalItem represents an item that
-/// a character can store or use during the game session.
-/// 
-/// The class enables creating shared pointers from an instance.
+/// Class Roster represents the alive characters by the order of creation. The characters are kept
+/// in an ordinal table, so a character is found, replaced with a copy or removed in constant time
+/// and forked sessions share the chunks of the table they do not change.
 /// </summary>
-class PhysicalItem: public std::enable_shared_from_this<PhysicalItem>
+class Roster
 {
 private:
-    // States whether an item cannot be used more than once
-    bool isUsableOnce;
+    // Characters by ordinal, nullptr for the dead ones
+    OrdinalTable<std::shared_ptr<Character>> characters;
 
-    // Name of an item
-    std::string name;
-protected:
+    // Number of alive characters
+    std::size_t count;
+public:
 
-    // The owner of an item
-    std::shared_ptr<Character> owner;
+    // Constructor
+    Roster()
+        : characters(), count(0)
+    {}
 
     /// <summary>
-    /// Getter for the owner.
+    /// Getter for size.
     /// </summary>
-    /// <returns> pointer to the character instance </returns>
-    std::shared_ptr<Character> getOwner() const
+    /// <returns> number of alive characters </returns>
+    std::size_t size() const
     {
-        return owner;
+        return count;
     }
 
     /// <summary>
-    /// Handles checks for the use of an item.
+    /// Inserts a new character at its ordinal.
     /// </summary>
-    /// <param name="user"> owner of the item </param>
-    /// <param name="target"> target to use item on </param>
-    void useCondition(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target)
+    /// <param name="character"> pointer to the character </param>
+    void insert(std::shared_ptr<Character> character)
     {
+        characters[character->ordinal] = std::move(character);
+        ++count;
+    }
 
-        // Owner check
-        if (user != owner) {
-            throw CharacterDoesNotOwnItem();
-        }
-
-        // Applying item
-        useLogic(user, target);
+    /// <summary>
+    /// Removes a character.
+    /// </summary>
+    /// <param name="character"> reference to the character </param>
+    void erase(const Character &character)
+    {
+        characters[character.ordinal].reset();
+        --count;
+    }
 
-        // Destroying an item after use
-        if (isUsableOnce) {
-            afterUse();
-        }
+    /// <summary>
+    /// Puts a copy of a character in its place.
+    /// </summary>
+    /// <param name="copy"> pointer to the copy, it has the ordinal of the character </param>
+    void replace(std::shared_ptr<Character> copy)
+    {
+        characters[copy->ordinal] = std::move(copy);
     }
 
     /// <summary>
-    /// Abstract function to apply element of a user on a target.
+    /// Finds a character by its ordinal.
     /// </summary>
-    /// <param name="user">owner of the item</param>
-    /// <param name="target">target to use item on</param>
-    virtual void useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const = 0;
+    /// <param name="ordinal"> ordinal of the character </param>
+    /// <returns> pointer to the character, nullptr if the character is dead </returns>
+    std::shared_ptr<Character> find(std::uint64_t ordinal) const
+    {
+        auto character = characters.find(ordinal);
+        return (character != nullptr) ? *character : nullptr;
+    }
 
     /// <summary>
-    /// Deals with item destruction after use.
+    /// Reserves storage for the given number of ordinals.
     /// </summary>
-    void afterUse()
+    /// <param name="ordinals"> number of ordinals </param>
+    void reserve(std::uint64_t ordinals)
     {
-        owner->loseItem(this->shared_from_this());
+        characters.reserve(ordinals);
     }
 
     /// <summary>
-    /// Deals with giving damage to a given character.
+    /// View of the characters that neither copies the pointers nor changes their reference counts.
     /// </summary>
-    /// <param name="to"> receiver of damage </param>
-    /// <param name="damage"> damage value </param>
-    void giveDamageTo(const std::shared_ptr<Character> to, int damage) const
+    /// <returns> range of references to the characters in the order of creation </returns>
+    auto view() const
     {
-        to->takeDamage(damage);
+        return characters.view() | std::views::filter([](const std::shared_ptr<Character> &character)
+        {
+            return character != nullptr;
+        }) | std::views::transform([](const std::shared_ptr<Character> &character) -> Character &
+        {
+            return *character;
+        });
     }
 
     /// <summary>
-    /// Deals with healing a given character.
+    /// Visits the characters in the ascending order without copying the pointers.
     /// </summary>
-    /// <param name="to"> receiver of heal</param>
-    /// <param name="heal"> heal value </param>
-    void giveHealTo(const std::shared_ptr<Character> to, int heal) const
+    /// <param name="visit"> procedure applied to a character </param>
+    template<typename Visit>
+    void visitSorted(Visit &&visit) const
     {
-        to->heal(heal);
+        visitInAscendingOrder<Character>(view(), visit);
     }
-public:
+};
 
-    // Constructor
-    PhysicalItem(bool isUsableOnce, const std::shared_ptr<Character> owner, const std::string name)
-        : isUsableOnce(isUsableOnce), name(name), owner(owner)
-    {}
+/// <summary>
+/// Class HealthIndex represents the alive characters ordered by health points.
+/// It is updated on every change of health, so the weakest, the strongest and the characters
+/// below a threshold are found in logarithmic time plus the size of the answer.
+/// </summary>
+class HealthIndex
+{
+private:
 
-    // Destructor
-    virtual ~PhysicalItem() = default;
+    /// <summary>
+    /// Structure to represent a character at its indexed health points.
+    /// </summary>
+    struct Entry
+    {
+        // Health points the character is ordered by
+        int healthPoints;
+
+        // Indexed character
+        const Character *character;
+
+        /// <summary>
+        /// Operator to order entries by health points, then by name, then by the order of creation.
+        /// </summary>
+        /// <param name="other"> comparing entry </param>
+        /// <returns> true if the compared entry goes before the comparing one </returns>
+        bool operator<(const Entry &other) const
+        {
+            if (healthPoints != other.healthPoints) {
+                return healthPoints < other.healthPoints;
+            }
+            int order = character->name.compare(other.character->name);
+            if (order != 0) {
+                return order < 0;
+            }
+            return character->ordinal < other.character->ordinal;
+        }
+    };
+
+    // Largest number of entries of a chunk, a fuller chunk is split in halves
+    static constexpr std::size_t chunkCapacity = 64;
 
     /// <summary>
-    /// Function that provides the use of an item.
+    /// Structure to represent a chunk of consecutive entries.
     /// </summary>
-    /// <param name="user"> owner of the item </param>
-    /// <param name="target"> target to use item on </param>
-    void use(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target)
+    struct Chunk
     {
-        useCondition(user, target);
-    }
+        // First entry of the chunk, kept next to the other chunks so a chunk is located without reading them
+        Entry front;
+
+        // Entries in the ascending order
+        SharedIndex<std::vector<Entry>> entries;
+    };
+
+    // Characters in the ascending order of health points in chunks of consecutive entries, forked sessions
+    // share the chunks and a change copies only the chunk it falls into, empty chunks are removed
+    SharedIndex<std::vector<Chunk>> chunks;
+
+    // Guards the entries when commands are executed concurrently
+    mutable std::mutex mutex;
 
     /// <summary>
-    /// Getter for the name.
+    /// Finds the chunk an entry belongs to, the last one not starting after the entry, the caller holds the lock.
     /// </summary>
-    /// <returns> name of the item </returns>
-    std::string getName() const
+    /// <param name="entry"> entry to look for </param>
+    /// <returns> number of the chunk </returns>
+    std::size_t locate(const Entry &entry) const
     {
-        return name;
+        auto next = std::upper_bound(chunks->begin(), chunks->end(), entry,
+                                     [](const Entry &entry, const Chunk &chunk)
+                                     {
+                                         return entry < chunk.front;
+                                     });
+        return (next == chunks->begin()) ? 0 : (next - chunks->begin() - 1);
     }
 
     /// <summary>
-    /// Operator to compare two PhysicalItems.
+    /// Finds the place of an indexed entry, the caller holds the lock.
     /// </summary>
-    /// <param name="other">comparing item</param>
-    /// <returns> true if the compared item is bigger than the comparing item </returns>
-    bool operator>(const PhysicalItem &other) const
+    /// <param name="entry"> entry to look for </param>
+    /// <returns> numbers of the chunk and of the entry in it, the number of chunks if the entry is absent </returns>
+    std::pair<std::size_t, std::size_t> search(const Entry &entry) const
     {
-        return (name.compare(other.getName()) > 0);
+        if (!chunks->empty()) {
+            std::size_t chunk = locate(entry);
+            const std::vector<Entry> &entries = *(*chunks)[chunk].entries;
+            auto found = std::lower_bound(entries.begin(), entries.end(), entry);
+            if (found != entries.end() && !(entry < *found)) {
+                return {chunk, found - entries.begin()};
+            }
+        }
+        return {chunks->size(), 0};
     }
 
     /// <summary>
-    /// Operator to compare two PhysicalItems.
+    /// Getter for a chunk to change, the chunk is copied first if another session keeps it.
     /// </summary>
-    /// <param name="other">comparing item</param>
-    /// <returns> true if the compared item is less than the comparing item </returns>
-    bool operator<(const PhysicalItem &other) const
+    /// <param name="chunk"> number of the chunk </param>
+    /// <returns> reference to the entries of the chunk </returns>
+    std::vector<Entry> &writable(std::size_t chunk)
     {
-        return (name.compare(other.getName()) < 0);
+        chunks.detach();
+        auto &entries = (*chunks)[chunk].entries;
+        entries.detach();
+        return *entries;
     }
 
     /// <summary>
-    /// Abstract function to print information about an item
-    /// to the output stream.
+    /// Inserts an entry into its chunk, the caller holds the lock.
     /// </summary>
-    /// <param name="out"> reference to the output stream</param>
-    virtual void print(std::ostream &out) const = 0;
-};
+    /// <param name="entry"> new entry </param>
+    void add(const Entry &entry)
+    {
+        if (chunks->empty()) {
+            chunks.detach();
+            chunks->push_back({entry, {}});
+            chunks->back().entries->push_back(entry);
+            return;
+        }
 
-/// <summary>
-/// Class Weapon inherits from PhysicalItem and
-/// represents an item that can give damage to
-/// characters.
-/// </summary>
-class Weapon: public PhysicalItem
-{
-private:
-    int damage;
+        std::size_t chunk = locate(entry);
+        std::vector<Entry> &entries = writable(chunk);
+        entries.insert(std::upper_bound(entries.begin(), entries.end(), entry), entry);
+        (*chunks)[chunk].front = entries.front();
+        if (entries.size() > chunkCapacity) {
+            SharedIndex<std::vector<Entry>> half;
+            half->assign(entries.begin() + entries.size() / 2, entries.end());
+            entries.resize(entries.size() / 2);
+            chunks->insert(chunks->begin() + chunk + 1, {half->front(), std::move(half)});
+        }
+    }
 
     /// <summary>
-    /// Implementation of the abstract function that
-    /// gives damage to target.
+    /// Removes an entry from its chunk, the caller holds the lock.
     /// </summary>
-    /// <param name="user"> attacker</param>
-    /// <param name="target"> receiver of damage </param>
-    void useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
+    /// <param name="place"> numbers of the chunk and of the entry in it </param>
+    void remove(std::pair<std::size_t, std::size_t> place)
     {
-        auto game = Game::currentGame();
-        sysout << user->getName() << " attacks " << target->getName() << " with their " << getName() << "!\n";
-        giveDamageTo(target, getDamage());
+        std::vector<Entry> &entries = writable(place.first);
+        entries.erase(entries.begin() + place.second);
+        if (entries.empty()) {
+            chunks->erase(chunks->begin() + place.first);
+        }
+        else {
+            (*chunks)[place.first].front = entries.front();
+        }
     }
 public:
 
     // Constructor
-    Weapon(const std::shared_ptr<Character> owner, const std::string name, int damage)
-        : PhysicalItem(false, owner, name), damage(damage)
+    HealthIndex()
+        : chunks()
+    {}
+
+    // Copy constructor, forks a session, both sessions keep the same chunks
+    HealthIndex(const HealthIndex &other)
+        : chunks()
     {
+        std::lock_guard<std::mutex> lock(other.mutex);
+        chunks = other.chunks;
+    }
 
-        // Check for legal damage value
-        if (damage <= 0) {
-            throw IllegalDamageValue();
+    /// <summary>
+    /// Inserts a character at its current health points.
+    /// </summary>
+    /// <param name="character"> new character </param>
+    void insert(const Character &character)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        add({character.healthPoints, &character});
+    }
+
+    /// <summary>
+    /// Moves a character from its previous health points to the current ones.
+    /// </summary>
+    /// <param name="character"> indexed character </param>
+    /// <param name="previousHealth"> health points the character is indexed by </param>
+    void update(const Character &character, int previousHealth)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto place = search({previousHealth, &character});
+        if (place.first < chunks->size()) {
+            remove(place);
+            add({character.healthPoints, &character});
         }
     }
 
-    // Destructor
-    ~Weapon() = default;
+    /// <summary>
+    /// Removes a character at its current health points.
+    /// </summary>
+    /// <param name="character"> indexed character </param>
+    void erase(const Character &character)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto place = search({character.healthPoints, &character});
+        if (place.first < chunks->size()) {
+            remove(place);
+        }
+    }
 
     /// <summary>
-    /// Getter for damage value.
+    /// Puts a copy of a character in its place.
     /// </summary>
-    /// <returns> damage value </returns>
-    int getDamage() const
+    /// <param name="character"> indexed character </param>
+    /// <param name="copy"> copy of the character </param>
+    void replace(const Character &character, const Character &copy)
     {
-        return damage;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto place = search({character.healthPoints, &character});
+        if (place.first < chunks->size()) {
+            writable(place.first)[place.second].character = &copy;
+            if (place.second == 0) {
+                (*chunks)[place.first].front.character = &copy;
+            }
+        }
     }
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Visits the characters with the least health points in the ascending order.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <param name="count"> largest number of characters to visit </param>
+    /// <param name="visit"> procedure applied to a character </param>
+    void visitWeakest(std::size_t count, const std::function<void(const Character &)> &visit) const
     {
-        out << getName() << ":" << getDamage() << " ";
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto chunk = chunks->begin(); chunk != chunks->end() && count > 0; ++chunk) {
+            for (auto entry = chunk->entries->begin(); entry != chunk->entries->end() && count > 0; ++entry, --count) {
+                visit(*entry->character);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Visits the characters with the most health points in the descending order.
+    /// </summary>
+    /// <param name="count"> largest number of characters to visit </param>
+    /// <param name="visit"> procedure applied to a character </param>
+    void visitStrongest(std::size_t count, const std::function<void(const Character &)> &visit) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto chunk = chunks->rbegin(); chunk != chunks->rend() && count > 0; ++chunk) {
+            for (auto entry = chunk->entries->rbegin(); entry != chunk->entries->rend() && count > 0; ++entry, --count) {
+                visit(*entry->character);
+            }
+        }
     }
 
+    /// <summary>
+    /// Visits the characters with health points below the threshold in the ascending order.
+    /// </summary>
+    /// <param name="threshold"> health points excluded from the answer </param>
+    /// <param name="visit"> procedure applied to a character </param>
+    void visitBelow(int threshold, const std::function<void(const Character &)> &visit) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &chunk: *chunks) {
+            for (auto &entry: *chunk.entries) {
+                if (entry.healthPoints >= threshold) {
+                    return;
+                }
+                visit(*entry.character);
+            }
+        }
+    }
 };
 
 /// <summary>
-/// Class Potion inherits from PhysicalItem and
-/// represents an item that can heal characters.
+/// Class RosterStatistics represents aggregates of the alive characters and their items: the number of
+/// characters and the sum of their health points by class, and the number of items by kind.
+/// They are updated with every change, so a query takes constant time whatever the size of the roster.
 /// </summary>
-class Potion: public PhysicalItem
+class RosterStatistics
 {
 private:
-    int healValue;
+    // Number of alive characters by class: fighters, archers, wizards
+    std::array<std::atomic<std::int64_t>, 3> characters;
 
-    /// <summary>
-    /// Implementation of the abstract function that
-    /// heals target.
-    /// </summary>
-    /// <param name="user">healer</param>
-    /// <param name="target">receiver of heal</param>
-    void useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
-    {
-        auto game = Game::currentGame();
-        sysout << target->getName() << " drinks " << getName() << " from " << user->getName() << ".\n";
-        giveHealTo(target, getHealValue());
-    }
+    // Sum of the health points of alive characters by class
+    std::array<std::atomic<std::int64_t>, 3> healthPoints;
+
+    // Number of items kept by alive characters by kind: weapons, potions, spells
+    std::array<std::atomic<std::int64_t>, 3> items;
 public:
 
     // Constructor
-    Potion(const std::shared_ptr<Character> owner, const std::string name, int healValue)
-        : PhysicalItem(true, owner, name), healValue(healValue)
+    RosterStatistics()
+        : characters(), healthPoints(), items()
+    {}
+
+    // Copy constructor, forks a session
+    RosterStatistics(const RosterStatistics &other)
+        : characters(), healthPoints(), items()
     {
-        if (healValue <= 0) {
-            throw IllegalHealthValue();
+        for (std::size_t i = 0; i < 3; ++i) {
+            characters[i].store(other.characters[i].load());
+            healthPoints[i].store(other.healthPoints[i].load());
+            items[i].store(other.items[i].load());
         }
     }
 
-    // Destructor
-    ~Potion() = default;
-
     /// <summary>
-    /// Getter for health value.
+    /// Counts a new character.
     /// </summary>
-    /// <returns> heal value </returns>
-    int getHealValue() const
+    /// <param name="type"> class of the character </param>
+    /// <param name="health"> health points of the character </param>
+    void insert(int type, int health)
     {
-        return healValue;
+        characters[type].fetch_add(1, std::memory_order_relaxed);
+        healthPoints[type].fetch_add(health, std::memory_order_relaxed);
     }
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Stops counting a dead character.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <param name="type"> class of the character </param>
+    /// <param name="health"> health points the character is counted with </param>
+    void erase(int type, int health)
     {
-        out << getName() << ":" << getHealValue() << " ";
+        characters[type].fetch_sub(1, std::memory_order_relaxed);
+        healthPoints[type].fetch_sub(health, std::memory_order_relaxed);
     }
-};
-
-/// <summary>
-/// Class Spell inherits from PhysicalItem and
-/// represents an item that kill characters.
-/// </summary>
-class Spell: public PhysicalItem
-{
-private:
 
-    // List of instances that a spell can be cast on
-    std::vector<std::shared_ptr<Character>> allowedTargets;
+    /// <summary>
+    /// Counts a change of the health points of a character.
+    /// </summary>
+    /// <param name="type"> class of the character </param>
+    /// <param name="change"> health points gained, negative if lost </param>
+    void updateHealth(int type, int change)
+    {
+        healthPoints[type].fetch_add(change, std::memory_order_relaxed);
+    }
 
     /// <summary>
-    /// Implementation of the abstract function that
-    /// casts a spell on target.
+    /// Counts a change of the items of a character.
     /// </summary>
-    /// <param name="user"> caster </param>
-    /// <param name="target"> target to cast spell on</param>
-    void useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
+    /// <param name="before"> numbers of the items of the character before the change </param>
+    /// <param name="after"> numbers of the items of the character after the change </param>
+    void updateItems(const ItemCounts &before, const ItemCounts &after)
     {
-        for (auto &allowedTarget: allowedTargets) {
-            if (allowedTarget == target) {
-                auto game = Game::currentGame();
-                sysout << user->getName() << " casts " << getName() << " on " << target->getName() << "!\n";
-                giveDamageTo(target, target->getHp());
-                return;
+        for (std::size_t kind = 0; kind < 3; ++kind) {
+            if (after[kind] != before[kind]) {
+                items[kind].fetch_add(after[kind] - before[kind], std::memory_order_relaxed);
             }
         }
-
-        throw NotAllowedTarget();
     }
-public:
-
-    // Constructor
-    Spell(const std::shared_ptr<Character> owner,
-          const std::string name,
-          const std::vector<std::shared_ptr<Character>> &allowedTargets)
-        : PhysicalItem(true, owner, name), allowedTargets(allowedTargets)
-    {}
 
-    // Destructor
-    ~Spell() = default;
+    /// <summary>
+    /// Getter for the number of alive characters of a class.
+    /// </summary>
+    /// <param name="type"> class of the characters </param>
+    /// <returns> number of characters </returns>
+    std::int64_t getCharacters(int type) const
+    {
+        return characters[type].load(std::memory_order_relaxed);
+    }
 
     /// <summary>
-    /// Getter for the number of allowed targets.
+    /// Getter for the sum of the health points of alive characters of a class.
     /// </summary>
-    /// <returns> number of allowed targets </returns>
-    int getNumAllowedTargets() const
+    /// <param name="type"> class of the characters </param>
+    /// <returns> sum of the health points </returns>
+    std::int64_t getHealthPoints(int type) const
     {
-        return allowedTargets.size();
+        return healthPoints[type].load(std::memory_order_relaxed);
     }
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Getter for the number of items of a kind.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <param name="kind"> kind of the items </param>
+    /// <returns> number of items </returns>
+    std::int64_t getItems(int kind) const
     {
-        out << getName() << ":" << getNumAllowedTargets() << " ";
+        return items[kind].load(std::memory_order_relaxed);
     }
 };
 
-// Bindings of the Containers
-
-using Arsenal = ContainerWithMaxCapacity<Weapon>;
-using MedicalBag = ContainerWithMaxCapacity<Potion>;
-using SpellBook = ContainerWithMaxCapacity<Spell>;
-
 /// <summary>
-/// Class WeaponUser represents a character that is
-/// able to use weapons.
+/// Class SpatialHash represents the alive characters by the square cell of the grid they stand in.
+/// A move touches only the cells it leaves and enters, and the characters within a radius
+/// are found among the cells the circle overlaps.
 /// </summary>
-class WeaponUser: virtual public Character
+class SpatialHash
 {
-protected:
+private:
+    // Side of a cell as a power of two
+    static constexpr int cellShift = 4;
 
-    // Arsenal of weapons
-    Arsenal arsenal;
-public:
+    /// <summary>
+    /// Structure to represent a character in a cell, the position is kept next to the ordinal
+    /// so the range checks of a query do not visit the characters that are out of range.
+    /// </summary>
+    struct Occupant
+    {
+        // Position of the character
+        int x;
+        int y;
 
-    // Constructor
-    WeaponUser(const std::string nameString, int healthValue, int capacity)
-        : Character(nameString, healthValue), arsenal(capacity)
-    {}
+        // Ordinal of the character
+        std::uint64_t ordinal;
+    };
 
-    // Destructor
-    ~WeaponUser() = default;
+    // Characters by cell, the key packs the coordinates of the cell, cells without characters are removed.
+    // Characters are kept by ordinal, so a copy made for a forked session takes the place of the character without a change
+    ShardedMap<std::uint64_t, std::vector<Occupant>, 64> cells;
+
+    // Places of the characters in their cells by ordinal, the place of a removed character is left behind
+    OrdinalTable<std::uint32_t> slots;
+
+    // Guards the cells when commands are executed concurrently
+    mutable std::mutex mutex;
 
     /// <summary>
-    /// The function implements attack on the given character.
+    /// Computes the key of the cell containing a point.
     /// </summary>
-    /// <param name="target">receiver of damage</param>
-    /// <param name="weaponName">name of the weapon</param>
-    void attack(std::shared_ptr<Character> target, const std::string &weaponName)
+    /// <param name="x"> horizontal coordinate </param>
+    /// <param name="y"> vertical coordinate </param>
+    /// <returns> key of the cell </returns>
+    static std::uint64_t cellKey(long long x, long long y)
     {
-        try {
-            auto item = arsenal.get(weaponName);
-            item->use(this->shared_from_this(), target);
-        }
-        catch (const ElementNotFound &) {
-            throw CharacterDoesNotOwnItem();
-        }
+        return (std::uint64_t(std::uint32_t(x >> cellShift)) << 32) | std::uint32_t(y >> cellShift);
     }
 
     /// <summary>
-    /// Displays all weapons in the arsenal.
+    /// Puts a character into the cell of its position, the caller holds the lock.
     /// </summary>
-    void showWeapons() const
+    /// <param name="character"> character to insert </param>
+    void link(const Character &character)
     {
-        arsenal.show();
+        auto &members = cells[cellKey(character.x, character.y)];
+        slots[character.ordinal] = std::uint32_t(members.size());
+        members.push_back({character.x, character.y, character.ordinal});
     }
-};
-
-/// <summary>
-/// Class PotionUser represents a character that is
-/// able to use potions.
-/// </summary>
-class PotionUser: virtual public Character
-{
-protected:
 
-    // Container of potions
-    MedicalBag medicalBag;
+    /// <summary>
+    /// Removes a character from the cell of its position by moving the last character of the cell
+    /// into its place, the caller holds the lock.
+    /// </summary>
+    /// <param name="character"> character to remove </param>
+    void unlink(const Character &character)
+    {
+        std::uint64_t key = cellKey(character.x, character.y);
+        auto members = cells.findWritable(key);
+        std::uint32_t slot = *slots.find(character.ordinal);
+        (*members)[slot] = members->back();
+        members->pop_back();
+        if (slot < members->size()) {
+            slots[(*members)[slot].ordinal] = slot;
+        }
+        if (members->empty()) {
+            cells.erase(key);
+        }
+    }
 public:
 
     // Constructor
-    PotionUser(const std::string nameString, int healthValue, int capacity)
-        : Character(nameString, healthValue), medicalBag(capacity)
+    SpatialHash()
+        : cells(), slots()
     {}
 
-    // Destructor
-    ~PotionUser() = default;
+    // Copy constructor, forks a session, both sessions keep the same cells
+    SpatialHash(const SpatialHash &other)
+        : cells(), slots()
+    {
+        std::lock_guard<std::mutex> lock(other.mutex);
+        cells = other.cells;
+        slots = other.slots;
+    }
 
     /// <summary>
-    /// The function implements drinking of a potion by a target.
+    /// Determines whether a character stands within a radius of a point.
     /// </summary>
-    /// <param name="target">receiver of heal</param>
-    /// <param name="potionName">name of the potion</param>
-    void drink(std::shared_ptr<Character> target, const std::string &potionName)
+    /// <param name="character"> character to check </param>
+    /// <param name="x"> horizontal coordinate of the center </param>
+    /// <param name="y"> vertical coordinate of the center </param>
+    /// <param name="radius"> radius of the circle </param>
+    /// <returns> true if the distance to the center does not exceed the radius </returns>
+    static bool isWithin(const Character &character, int x, int y, int radius)
     {
-        try {
-            auto item = medicalBag.get(potionName);
-            item->use(this->shared_from_this(), target);
-        }
-        catch (const ElementNotFound &) {
-            throw CharacterDoesNotOwnItem();
-        }
+        long long dx = (long long) character.x - x;
+        long long dy = (long long) character.y - y;
+        return (radius >= 0 && dx * dx + dy * dy <= (long long) radius * radius);
     }
 
     /// <summary>
-    /// Displays all potions in the medicalBag.
+    /// Inserts a character at its current position.
     /// </summary>
-    void showPotions() const
+    /// <param name="character"> new character </param>
+    void insert(const Character &character)
     {
-        medicalBag.show();
+        std::lock_guard<std::mutex> lock(mutex);
+        link(character);
     }
-};
-
-/// <summary>
-/// Class SpellUser represents a character that is
-/// able to cast spells.
-/// </summary>
-class SpellUser: virtual public Character
-{
-protected:
-
-    // Container of spells
-    SpellBook spellBook;
-public:
-
-    // Constructor
-    SpellUser(const std::string nameString, int healthValue, int capacity)
-        : Character(nameString, healthValue), spellBook(capacity)
-    {}
-
-    // Destructor
-    ~SpellUser() = default;
 
     /// <summary>
-    /// The function implements cast on a target.
+    /// Moves a character to a new position, changing cells only if it crosses a border.
     /// </summary>
-    /// <param name="target"> target to cast spell on</param>
-    /// <param name="spellName"> name of the spell</param>
-    void cast(std::shared_ptr<Character> target, const std::string &spellName)
+    /// <param name="character"> indexed character </param>
+    /// <param name="x"> new horizontal coordinate </param>
+    /// <param name="y"> new vertical coordinate </param>
+    void move(Character &character, int x, int y)
     {
-        try {
-            auto item = spellBook.get(spellName);
-            item->use(this->shared_from_this(), target);
-        }
-        catch (const ElementNotFound &) {
-            throw CharacterDoesNotOwnItem();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cellKey(x, y) == cellKey(character.x, character.y)) {
+            character.x = x;
+            character.y = y;
+            (*cells.findWritable(cellKey(x, y)))[*slots.find(character.ordinal)] = {x, y, character.ordinal};
+            return;
         }
+        unlink(character);
+        character.x = x;
+        character.y = y;
+        link(character);
     }
 
     /// <summary>
-    /// Displays all spells from the spellBook.
+    /// Removes a character at its current position.
     /// </summary>
-    void showSpells() const
+    /// <param name="character"> indexed character </param>
+    void erase(const Character &character)
     {
-        spellBook.show();
+        std::lock_guard<std::mutex> lock(mutex);
+        unlink(character);
+    }
+
+    /// <summary>
+    /// Visits the characters within a radius of a point in no particular order.
+    /// </summary>
+    /// <param name="x"> horizontal coordinate of the center </param>
+    /// <param name="y"> vertical coordinate of the center </param>
+    /// <param name="radius"> radius of the circle </param>
+    /// <param name="visit"> procedure applied to the ordinal of a character </param>
+    void visitWithin(int x, int y, int radius, const std::function<void(std::uint64_t)> &visit) const
+    {
+        if (radius < 0) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto visitCell = [&](std::uint64_t, const std::vector<Occupant> &members)
+        {
+            for (const Occupant &member: members) {
+                long long dx = (long long) member.x - x;
+                long long dy = (long long) member.y - y;
+                if (dx * dx + dy * dy <= (long long) radius * radius) {
+                    visit(member.ordinal);
+                }
+            }
+        };
+
+        // A circle overlapping more cells than there are occupied ones is served by scanning the occupied cells
+        long long firstX = ((long long) x - radius) >> cellShift;
+        long long lastX = ((long long) x + radius) >> cellShift;
+        long long firstY = ((long long) y - radius) >> cellShift;
+        long long lastY = ((long long) y + radius) >> cellShift;
+        if ((lastX - firstX + 1) * (lastY - firstY + 1) > (long long) cells.size()) {
+            cells.visit(visitCell);
+            return;
+        }
+
+        for (long long cellX = firstX; cellX <= lastX; ++cellX) {
+            for (long long cellY = firstY; cellY <= lastY; ++cellY) {
+                std::uint64_t key = cellKey(cellX << cellShift, cellY << cellShift);
+                auto members = cells.find(key);
+                if (members != nullptr) {
+                    visitCell(key, *members);
+                }
+            }
+        }
     }
 };
 
 /// <summary>
-/// Class Fighter represents a character that can
-/// use weapons and potions.
+/// Class PathFinder represents the map of the grid with its obstacles and finds the shortest routes
+/// between squares with A* search. The nodes of the search and the open list are reused by every search,
+/// and the lengths of the routes found since the last change of the obstacles are cached.
 /// </summary>
-class Fighter: public WeaponUser, public PotionUser
+class PathFinder
 {
-protected:
+private:
 
     /// <summary>
-    /// Implementation of the abstract function that inserts the item
-    /// into either the arsenal or the medicalBag.
+    /// Structure to represent the state of a square in the searches.
     /// </summary>
-    /// <param name="item"> pointer to the item </param>
-    void obtainItem(std::shared_ptr<PhysicalItem> item) override
+    struct Node
     {
+        // Number of the search that reached the square, the cost is stale for other searches
+        std::uint32_t reached;
 
-        // Cast of item to Weapon
-        if (dynamic_cast<Weapon *>(item.get())) {
-            auto weapon = std::dynamic_pointer_cast<Weapon>(item);
-            arsenal.addItem(weapon);
+        // Number of the search that settled the square
+        std::uint32_t settled;
+
+        // Number of steps from the origin
+        std::uint32_t cost;
+    };
+
+    /// <summary>
+    /// Structure to represent a square waiting in the open list.
+    /// </summary>
+    struct OpenEntry
+    {
+        // Cost from the origin plus the estimate of the remaining steps
+        std::uint32_t estimate;
+
+        // Cost from the origin
+        std::uint32_t cost;
+
+        // Number of the square
+        std::uint32_t square;
+
+        /// <summary>
+        /// Operator to order the entries of the heap, the least estimate is on the top
+        /// and the entry closer to the destination wins a tie.
+        /// </summary>
+        /// <param name="other"> comparing entry </param>
+        /// <returns> true if the compared entry goes below the comparing one in the heap </returns>
+        bool operator<(const OpenEntry &other) const
+        {
+            if (estimate != other.estimate) {
+                return estimate > other.estimate;
+            }
+            return cost < other.cost;
         }
-            // Cast of item to Potion
-        else if (dynamic_cast<Potion *>(item.get())) {
-            auto potion = std::dynamic_pointer_cast<Potion>(item);
-            medicalBag.addItem(potion);
+    };
+
+    // Largest number of squares of a map
+    static constexpr std::int64_t maxSquares = std::int64_t(1) << 24;
+
+    // Largest number of cached routes, the cache starts over when it is full
+    static constexpr std::size_t maxCachedRoutes = 1 << 16;
+
+    // Size of the map, zero if there is no map
+    int width;
+    int height;
+
+    // States whether a square is blocked by an obstacle, shared with forked sessions until one of them changes it
+    SharedIndex<std::vector<std::uint8_t>> blocked;
+
+    // Nodes of the squares, allocated by the first search on the map
+    std::vector<Node> nodes;
+
+    // Open list of the search as a heap, its storage is kept between searches
+    std::vector<OpenEntry> open;
+
+    // Number of the current search
+    std::uint32_t search;
+
+    // Lengths of the routes by the numbers of their origin and destination squares, -1 if there is no route,
+    // shared with forked sessions until one of them caches a route
+    SharedIndex<std::unordered_map<std::uint64_t, int>> cachedRoutes;
+
+    // Number of routes found in the cache
+    std::size_t cacheHits;
+
+    // Guards the searches and the cache when commands are executed concurrently
+    mutable std::mutex mutex;
+
+    /// <summary>
+    /// Runs A* search from a square to a square, the caller holds the lock.
+    /// </summary>
+    /// <param name="origin"> number of the origin square </param>
+    /// <param name="destination"> number of the destination square </param>
+    /// <returns> number of steps of the shortest route, -1 if there is no route </returns>
+    int findRoute(std::uint32_t origin, std::uint32_t destination)
+    {
+        const std::vector<std::uint8_t> &obstacles = *blocked;
+        if (nodes.empty()) {
+            nodes.assign(obstacles.size(), Node{0, 0, 0});
         }
-            // Element cannot be used by a fighter
-        else {
-            throw IllegalItemType();
+
+        // Stamps of the nodes start over when the number of the search wraps around
+        if (++search == 0) {
+            std::fill(nodes.begin(), nodes.end(), Node{0, 0, 0});
+            search = 1;
+        }
+
+        int destinationX = destination % width;
+        int destinationY = destination / width;
+        auto remaining = [&](std::uint32_t square) -> std::uint32_t
+        {
+            return std::abs(int(square % width) - destinationX) + std::abs(int(square / width) - destinationY);
+        };
+
+        open.clear();
+        nodes[origin] = {search, 0, 0};
+        open.push_back({remaining(origin), 0, origin});
+
+        while (!open.empty()) {
+            std::pop_heap(open.begin(), open.end());
+            OpenEntry entry = open.back();
+            open.pop_back();
+
+            // Squares reached again with a lower cost leave stale entries behind
+            Node &node = nodes[entry.square];
+            if (node.settled == search) {
+                continue;
+            }
+            node.settled = search;
+            if (entry.square == destination) {
+                return node.cost;
+            }
+
+            int x = entry.square % width;
+            int y = entry.square / width;
+            std::uint32_t neighbors[4];
+            int count = 0;
+            if (x > 0) {
+                neighbors[count++] = entry.square - 1;
+            }
+            if (x + 1 < width) {
+                neighbors[count++] = entry.square + 1;
+            }
+            if (y > 0) {
+                neighbors[count++] = entry.square - width;
+            }
+            if (y + 1 < height) {
+                neighbors[count++] = entry.square + width;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                std::uint32_t square = neighbors[i];
+                Node &next = nodes[square];
+                std::uint32_t cost = node.cost + 1;
+                if (obstacles[square] || (next.reached == search && next.cost <= cost)) {
+                    continue;
+                }
+                next = {search, 0, cost};
+                open.push_back({cost + remaining(square), cost, square});
+                std::push_heap(open.begin(), open.end());
+            }
         }
+        return -1;
     }
 
     /// <summary>
-    /// Implementation of the abstract function that removes the item
-    /// from either the arsenal or the medicalBag.
+    /// Drops the cached routes, a cache kept by a forked session as well is left to that session.
     /// </summary>
-    /// <param name="item"> pointer to the item</param>
-    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    void dropCachedRoutes()
     {
-
-        // Find the item in the arsenal
-        if (arsenal.find(item->getName())) {
-            arsenal.removeItem(item->getName());
+        if (cachedRoutes.isShared()) {
+            cachedRoutes = SharedIndex<std::unordered_map<std::uint64_t, int>>();
         }
-            // Find the item in the medicalBag
         else {
-            medicalBag.removeItem(item->getName());
+            cachedRoutes->clear();
         }
-
-        // Release data
-        item.reset();
     }
 public:
 
     // Constructor
-    Fighter(const std::string nameString, int healthValue)
-        : Character(nameString, healthValue), WeaponUser(nameString, healthValue, maxAllowedWeapons),
-          PotionUser(nameString, healthValue, maxAllowedPotions)
+    PathFinder()
+        : width(0), height(0), search(0), cacheHits(0)
     {}
 
-    // Destructor
-    ~Fighter() = default;
+    // Copy constructor, forks a session, both sessions keep the same map and cache,
+    // the nodes are allocated again by the first search
+    PathFinder(const PathFinder &other)
+        : width(0), height(0), search(0), cacheHits(0)
+    {
+        std::lock_guard<std::mutex> lock(other.mutex);
+        width = other.width;
+        height = other.height;
+        blocked = other.blocked;
+        cachedRoutes = other.cachedRoutes;
+        cacheHits = other.cacheHits;
+    }
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Replaces the map with an empty one of the given size.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <param name="newWidth"> number of columns </param>
+    /// <param name="newHeight"> number of rows </param>
+    /// <returns> true if the size is allowed </returns>
+    bool reset(int newWidth, int newHeight)
     {
-        out << getName() << ":fighter:" << getHp() << " ";
-    }
-
-    // Maximum allowed number of weapons
-    static int maxAllowedWeapons;
-
-    // Maximum allowed number of potions
-    static int maxAllowedPotions;
-};
+        if (newWidth <= 0 || newHeight <= 0 || std::int64_t(newWidth) * newHeight > maxSquares) {
+            return false;
+        }
 
-/// <summary>
-/// Class Archer represents a character that can
-/// use weapons, potions, and spells.
-/// </summary>
-class Archer: public WeaponUser, public PotionUser, public SpellUser
-{
-protected:
+        std::lock_guard<std::mutex> lock(mutex);
+        width = newWidth;
+        height = newHeight;
+        blocked = SharedIndex<std::vector<std::uint8_t>>();
+        blocked->assign(std::size_t(width) * height, 0);
+        nodes.clear();
+        nodes.shrink_to_fit();
+        search = 0;
+        dropCachedRoutes();
+        return true;
+    }
 
     /// <summary>
-    /// Implementation of the abstract function that inserts the item
-    /// into either the arsenal, the medicalBag, or the spellBook.
+    /// Blocks or frees the squares of a rectangle, the part outside of the map is ignored.
+    /// Cached routes are dropped, since a new obstacle may cut them and a removed one may shorten them.
     /// </summary>
-    /// <param name="item">pointer to the item </param>
-    void obtainItem(std::shared_ptr<PhysicalItem> item) override
+    /// <param name="x"> column of the corner </param>
+    /// <param name="y"> row of the corner </param>
+    /// <param name="rectangleWidth"> number of columns </param>
+    /// <param name="rectangleHeight"> number of rows </param>
+    /// <param name="isBlocked"> true to block, false to free </param>
+    /// <returns> true if there is a map </returns>
+    bool setBlocked(int x, int y, int rectangleWidth, int rectangleHeight, bool isBlocked)
     {
-
-        // Cast the item to the Weapon
-        if (dynamic_cast<Weapon *>(item.get())) {
-            auto weapon = std::dynamic_pointer_cast<Weapon>(item);
-            arsenal.addItem(weapon);
-        }
-            // Cast the item to the Potion
-        else if (dynamic_cast<Potion *>(item.get())) {
-            auto potion = std::dynamic_pointer_cast<Potion>(item);
-            medicalBag.addItem(potion);
-        }
-            // Cast the item to the Spell
-        else if (dynamic_cast<Spell *>(item.get())) {
-            auto spell = std::dynamic_pointer_cast<Spell>(item);
-            spellBook.addItem(spell);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (width == 0) {
+            return false;
         }
-        else {
-            throw IllegalItemType();
+
+        long long firstX = std::max<long long>(x, 0);
+        long long lastX = std::min<long long>((long long) x + rectangleWidth, width);
+        long long firstY = std::max<long long>(y, 0);
+        long long lastY = std::min<long long>((long long) y + rectangleHeight, height);
+        blocked.detach();
+        for (long long row = firstY; row < lastY; ++row) {
+            for (long long column = firstX; column < lastX; ++column) {
+                (*blocked)[row * width + column] = isBlocked;
+            }
         }
+        dropCachedRoutes();
+        return true;
     }
 
     /// <summary>
-    /// Implementation of the abstract function that removes the item
-    /// from either the arsenal, the medicalBag, or the spellBook.
+    /// Determines whether a square lies on the map.
     /// </summary>
-    /// <param name="item"> pointer to the item </param>
-    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    /// <param name="x"> column of the square </param>
+    /// <param name="y"> row of the square </param>
+    /// <returns> true if the square is on the map </returns>
+    bool contains(int x, int y) const
     {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (x >= 0 && y >= 0 && x < width && y < height);
+    }
 
-        // Find the item in the arsenal
-        if (arsenal.find(item->getName())) {
-            arsenal.removeItem(item->getName());
-        }
-            // Find the item in the medicalBag
-        else if (medicalBag.find(item->getName())) {
-            medicalBag.removeItem(item->getName());
+    /// <summary>
+    /// Finds the length of the shortest route between two squares of the map moving
+    /// to the four neighbor squares, from the cache if the route was asked for before.
+    /// The origin itself may be blocked, the character leaves it.
+    /// </summary>
+    /// <param name="fromX"> column of the origin </param>
+    /// <param name="fromY"> row of the origin </param>
+    /// <param name="toX"> column of the destination </param>
+    /// <param name="toY"> row of the destination </param>
+    /// <returns> number of steps, -1 if the destination is blocked or cannot be reached </returns>
+    int route(int fromX, int fromY, int toX, int toY)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint32_t origin = std::uint32_t(fromY) * width + fromX;
+        std::uint32_t destination = std::uint32_t(toY) * width + toX;
+        if ((*blocked)[destination]) {
+            return -1;
         }
-            // Find the item in the spellBook
-        else {
-            spellBook.removeItem(item->getName());
+
+        // Routes between free squares are as long in both directions
+        std::uint64_t key = (*blocked)[origin] ? (std::uint64_t(origin) << 32) | destination :
+                            (std::uint64_t(std::min(origin, destination)) << 32) | std::max(origin, destination);
+        auto cached = cachedRoutes->find(key);
+        if (cached != cachedRoutes->end()) {
+            ++cacheHits;
+            return cached->second;
         }
 
-        item.reset();
+        int steps = findRoute(origin, destination);
+        if (cachedRoutes->size() >= maxCachedRoutes) {
+            dropCachedRoutes();
+        }
+        cachedRoutes.detach();
+        cachedRoutes->emplace(key, steps);
+        return steps;
     }
-public:
-
-    // Constructor
-    Archer(const std::string nameString, int healthValue)
-        : Character(nameString, healthValue), WeaponUser(nameString, healthValue, maxAllowedWeapons),
-          PotionUser(nameString, healthValue, maxAllowedPotions), SpellUser(nameString, healthValue, maxAllowedSpells)
-    {}
-
-    // Destructor
-    ~Archer() = default;
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Getter for the number of routes found in the cache.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <returns> number of cache hits </returns>
+    std::size_t getCacheHits() const
     {
-        out << getName() << ":archer:" << getHp() << " ";
+        std::lock_guard<std::mutex> lock(mutex);
+        return cacheHits;
     }
-
-    // Maximum allowed number of weapons
-    static int maxAllowedWeapons;
-
-    // Maximum allowed number of potions
-    static int maxAllowedPotions;
-
-    // Maximum allowed number of spells
-    static int maxAllowedSpells;
 };
 
 /// <summary>
-/// Class Wizard represents a character that can
-/// use potions and spells.
+/// Enumeration of the columns of a roster export, in the order they follow each other in the file.
 /// </summary>
-class Wizard: public PotionUser, public SpellUser
+enum class RosterColumn
 {
-protected:
+    // Number of the name of a character in the string dictionary, 32-bit unsigned per character
+    CharacterName,
 
-    /// <summary>
-    /// Implementation of the abstract function that inserts the item
-    /// into either the medicalBag or the spellBook.
-    /// </summary>
-    /// <param name="item"></param>
+    // Class of a character: 0 for a fighter, 1 for an archer, 2 for a wizard, 8-bit unsigned per character
+    CharacterClass,
+
+    // Health points, 32-bit signed per character
+    HealthPoints,
+
+    // Number of the first item of a character, 32-bit unsigned per character and one more for the end
+    // of the items of the last character, the items of a character follow each other
+    FirstItem,
+
+    // Number of the name of an item in the string dictionary, 32-bit unsigned per item
+    ItemName,
+
+    // Kind of an item: 0 for a weapon, 1 for a potion, 2 for a spell, 8-bit unsigned per item
+    ItemKind,
+
+    // Damage of a weapon, heal value of a potion, number of allowed targets of a spell, 32-bit signed per item
+    ItemValue,
+
+    // Number of the owner of an item, 32-bit unsigned per item
+    ItemOwner,
+
+    // Offset of a string in the string bytes, 64-bit unsigned per string and one more for the end of the last one
+    StringOffsets,
+
+    // Characters of the strings one after another without terminators
+    StringBytes,
+
+    // Number of the columns
+    Count
+};
+
+/// <summary>
+/// Structure to represent the beginning of a roster export. Every column is an array of fixed-size
+/// values in the byte order of the machine, starting at an offset aligned to 8 bytes, so the file
+/// can be mapped into memory and the columns read in place.
+/// </summary>
+struct RosterExportHeader
+{
+    // Format and its version, "ROSTER01"
+    char magic[8];
+
+    // Number of the alive characters, in the order of creation
+    std::uint64_t characters;
+
+    // Number of the items kept by the characters
+    std::uint64_t items;
+
+    // Number of the distinct names in the string dictionary
+    std::uint64_t strings;
+
+    // Offsets of the columns from the beginning of the file
+    std::uint64_t offsets[std::size_t(RosterColumn::Count)];
+
+    // Sizes of the columns in bytes
+    std::uint64_t sizes[std::size_t(RosterColumn::Count)];
+};
+
+/// <summary>
+/// Class ItemIndex represents the items of all alive characters by name,
+/// to find the owners of an item and to hand items over without searching the characters.
+/// </summary>
+class ItemIndex
+{
+private:
+    // Items by name, then by the ordinal of the owner, a name is shared by the items of different owners.
+    // Owners are kept by ordinal, so a copy of an owner made for a forked session changes only its own entries
+    ShardedMap<std::string, ShardedMap<std::uint64_t, std::vector<std::shared_ptr<PhysicalItem>>>> items;
+
+    // Names an owner has given to items of several kinds, losing one of them may remove another
+    // from the containers, which then stays in the index without being kept in a container
+    SharedIndex<std::unordered_set<std::string>> sharedNames;
+
+    // Guards the items when commands are executed concurrently
+    mutable std::mutex mutex;
+public:
+
+    // Constructor
+    ItemIndex()
+        : items()
+    {}
+
+    // Copy constructor, forks a session
+    ItemIndex(const ItemIndex &other);
+
+    /// <summary>
+    /// Inserts an item obtained by its owner, unless the owner already keeps
+    /// an item of the same kind with the same name, the containers keep the first one then.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    void insert(std::shared_ptr<PhysicalItem> item);
+
+    /// <summary>
+    /// Removes an item, nothing happens if the item is not indexed.
+    /// </summary>
+    /// <param name="item"> reference to the item </param>
+    void erase(const PhysicalItem &item);
+
+    /// <summary>
+    /// Finds the item of an owner by the name.
+    /// </summary>
+    /// <param name="itemName"> name of the item </param>
+    /// <param name="owner"> owner of the item </param>
+    /// <returns> pointer to the item, nullptr if the owner keeps none or several items with the name </returns>
+    std::shared_ptr<PhysicalItem> find(const std::string &itemName, const Character &owner) const;
+
+    /// <summary>
+    /// Function to determine whether a character keeps an item with the name.
+    /// </summary>
+    /// <param name="itemName"> name of the item </param>
+    /// <param name="owner"> possible owner of the item </param>
+    /// <returns> true if the character keeps such an item else false </returns>
+    bool owns(const std::string &itemName, const Character &owner) const;
+
+    /// <summary>
+    /// Puts the items of a copy of an owner in the places of the items of the owner,
+    /// the indexed items that are not kept in the containers of the owner are copied as well.
+    /// </summary>
+    /// <param name="owner"> indexed owner </param>
+    /// <param name="copy"> pointer to the copy of the owner, it has the ordinal of the owner </param>
+    /// <param name="copiedItems"> pairs of an item of the containers of the owner and its copy </param>
+    void replaceOwner(const Character &owner, const std::shared_ptr<Character> &copy, const ItemCopies &copiedItems);
+
+    /// <summary>
+    /// Hands an indexed item over to a new owner.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    /// <param name="newOwner"> pointer to the new owner </param>
+    void transfer(const std::shared_ptr<PhysicalItem> &item, std::shared_ptr<Character> newOwner);
+
+    /// <summary>
+    /// Getter for the owners of the items with the name.
+    /// </summary>
+    /// <param name="itemName"> name of the item </param>
+    /// <returns> pointers to the owners in no particular order, each owner once </returns>
+    std::vector<std::shared_ptr<Character>> getOwners(const std::string &itemName) const;
+
+    /// <summary>
+    /// Reserves storage for the given number of further items with the name.
+    /// </summary>
+    /// <param name="itemName"> name of the items </param>
+    /// <param name="count"> number of items </param>
+    void reserve(const std::string &itemName, std::size_t count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &named = items[itemName];
+        named.reserve(named.size() + count);
+    }
+};
+
+/// <summary>
+/// Class TimerWheel represents a hierarchical timing wheel of timers identified by numbers.
+/// Each level divides the span of a slot of the level above into 64 slots, a timer waits
+/// in the coarsest slot that does not cover the current tick and moves down as the time comes closer.
+/// Advancing the time costs in proportion to the timers that fire and move, empty ticks are skipped.
+/// </summary>
+class TimerWheel
+{
+private:
+
+    /// <summary>
+    /// Structure to represent a scheduled timer.
+    /// </summary>
+    struct Timer
+    {
+        // Tick at which the timer fires
+        std::uint64_t tick;
+
+        // Number of the timer
+        std::uint32_t id;
+    };
+
+    // Number of bits of the tick resolved by a level
+    static constexpr int levelBits = 6;
+
+    // Number of slots in a level
+    static constexpr int levelSlots = 1 << levelBits;
+
+    // Number of levels, timers beyond the span of the top level wait among the distant ones
+    static constexpr int levels = 6;
+
+    // Slots of the levels
+    std::array<std::array<std::vector<Timer>, levelSlots>, levels> slots;
+
+    // Bit masks of the non-empty slots of the levels
+    std::array<std::uint64_t, levels> occupied;
+
+    // Timers beyond the span of the top level
+    std::vector<Timer> distant;
+
+    // Current tick
+    std::uint64_t current;
+
+    // Number of scheduled timers
+    std::size_t scheduled;
+
+    // Buffer receiving the timers of a slot that is processed
+    std::vector<Timer> taken;
+
+    // Buffer receiving the numbers of the timers that fire at a tick
+    std::vector<std::uint32_t> due;
+
+    /// <summary>
+    /// Puts a timer into the coarsest slot that does not cover the current tick.
+    /// </summary>
+    /// <param name="timer"> scheduled timer </param>
+    void place(const Timer &timer)
+    {
+        for (int level = 0; level < levels; ++level) {
+            int shift = levelBits * (level + 1);
+            if ((timer.tick >> shift) == (current >> shift)) {
+                int slot = (timer.tick >> (levelBits * level)) & (levelSlots - 1);
+                slots[level][slot].push_back(timer);
+                occupied[level] |= std::uint64_t(1) << slot;
+                return;
+            }
+        }
+        distant.push_back(timer);
+    }
+
+    /// <summary>
+    /// Moves the timers of a slot into the buffer of taken timers.
+    /// </summary>
+    /// <param name="level"> level of the slot </param>
+    /// <param name="slot"> index of the slot </param>
+    void take(int level, int slot)
+    {
+        taken.clear();
+        std::swap(taken, slots[level][slot]);
+        occupied[level] &= ~(std::uint64_t(1) << slot);
+    }
+public:
+
+    // Constructor
+    TimerWheel()
+        : slots(), occupied(), distant(), current(0), scheduled(0), taken(), due()
+    {}
+
+    /// <summary>
+    /// Getter for the current tick.
+    /// </summary>
+    /// <returns> number of ticks passed </returns>
+    std::uint64_t now() const
+    {
+        return current;
+    }
+
+    /// <summary>
+    /// Getter for the number of scheduled timers.
+    /// </summary>
+    /// <returns> number of timers </returns>
+    std::size_t size() const
+    {
+        return scheduled;
+    }
+
+    /// <summary>
+    /// Schedules a timer.
+    /// </summary>
+    /// <param name="id"> number of the timer </param>
+    /// <param name="tick"> tick at which the timer fires, later than the current one </param>
+    void schedule(std::uint32_t id, std::uint64_t tick)
+    {
+        place({tick, id});
+        ++scheduled;
+    }
+
+    /// <summary>
+    /// Advances the time, firing the timers that come due in the order of their ticks.
+    /// Timers may be scheduled while firing.
+    /// </summary>
+    /// <param name="ticks"> number of ticks to pass </param>
+    /// <param name="fire"> procedure receiving the tick and the numbers of the timers due at it </param>
+    template<typename Fire>
+    void advance(std::uint64_t ticks, Fire &&fire)
+    {
+        std::uint64_t target = current + ticks;
+
+        while (scheduled > 0) {
+
+            // Finding the next slot to fire or to move down
+            int level = 0;
+            while (level < levels && occupied[level] == 0) {
+                ++level;
+            }
+
+            std::uint64_t next;
+            int slot = 0;
+            if (level < levels) {
+                int shift = levelBits * level;
+                slot = std::countr_zero(occupied[level]);
+                next = ((current >> (shift + levelBits)) << (shift + levelBits)) | (std::uint64_t(slot) << shift);
+            }
+            else {
+                int shift = levelBits * levels;
+                next = ((current >> shift) + 1) << shift;
+            }
+            if (next > target) {
+                break;
+            }
+            current = next;
+
+            if (level == 0) {
+                take(0, slot);
+                due.clear();
+                for (auto &timer: taken) {
+                    due.push_back(timer.id);
+                }
+                scheduled -= due.size();
+                fire(current, due);
+            }
+            else if (level < levels) {
+                take(level, slot);
+                for (auto &timer: taken) {
+                    place(timer);
+                }
+            }
+            else {
+                taken.clear();
+                std::swap(taken, distant);
+                for (auto &timer: taken) {
+                    place(timer);
+                }
+            }
+        }
+
+        current = target;
+    }
+};
+
+/// <summary>
+/// Template class to represent a bounded lock-free ring buffer
+/// connecting a single producer thread with a single consumer thread.
+/// </summary>
+/// <typeparam name="T"> template parameter </typeparam>
+template<typename T>
+class SpscRing
+{
+private:
+    // Storage of the elements, its size is a power of two
+    std::vector<T> slots;
+
+    // Mask to wrap positions into the storage
+    std::size_t mask;
+
+    // Position of the next element to pop, written only by the consumer
+    alignas(64) std::atomic<std::size_t> head;
+
+    // Consumer's copy of the tail to avoid touching the producer's cache line
+    std::size_t cachedTail;
+
+    // Position of the next element to push, written only by the producer
+    alignas(64) std::atomic<std::size_t> tail;
+
+    // Producer's copy of the head to avoid touching the consumer's cache line
+    std::size_t cachedHead;
+
+    // Number of failed attempts before a waiting side goes to sleep
+    static constexpr int spinLimit = 256;
+public:
+
+    // Constructor
+    SpscRing(std::size_t capacity)
+        : slots(), mask(0), head(0), cachedTail(0), tail(0), cachedHead(0)
+    {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Destructor
+    ~SpscRing() = default;
+
+    /// <summary>
+    /// Tries to insert an element without waiting.
+    /// </summary>
+    /// <param name="value"> element, moved from on success </param>
+    /// <returns> true if the element was inserted else false </returns>
+    bool tryPush(T &value)
+    {
+        std::size_t position = tail.load(std::memory_order_relaxed);
+        if (position - cachedHead == slots.size()) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (position - cachedHead == slots.size()) {
+                return false;
+            }
+        }
+        slots[position & mask] = std::move(value);
+        tail.store(position + 1, std::memory_order_release);
+        tail.notify_one();
+        return true;
+    }
+
+    /// <summary>
+    /// Tries to extract an element without waiting.
+    /// </summary>
+    /// <param name="value"> receiver of the element </param>
+    /// <returns> true if an element was extracted else false </returns>
+    bool tryPop(T &value)
+    {
+        std::size_t position = head.load(std::memory_order_relaxed);
+        if (position == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (position == cachedTail) {
+                return false;
+            }
+        }
+        value = std::move(slots[position & mask]);
+        head.store(position + 1, std::memory_order_release);
+        head.notify_one();
+        return true;
+    }
+
+    /// <summary>
+    /// Inserts an element, waiting while the ring is full.
+    /// </summary>
+    /// <param name="value"> element </param>
+    void push(T value)
+    {
+        for (int attempt = 1; !tryPush(value); ++attempt) {
+
+            // Sleeping until the consumer frees a slot
+            if (attempt >= spinLimit) {
+                head.wait(tail.load(std::memory_order_relaxed) - slots.size(), std::memory_order_acquire);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Extracts an element, waiting while the ring is empty.
+    /// </summary>
+    /// <returns> the extracted element </returns>
+    T pop()
+    {
+        T value;
+        for (int attempt = 1; !tryPop(value); ++attempt) {
+
+            // Sleeping until the producer inserts an element
+            if (attempt >= spinLimit) {
+                tail.wait(head.load(std::memory_order_relaxed), std::memory_order_acquire);
+            }
+        }
+        return value;
+    }
+};
+
+/// <summary>
+/// Template class to represent a bounded lock-free queue connecting many producer threads
+/// with a single consumer thread. Every slot carries a sequence number telling whose turn it is,
+/// so producers only compete for the tail position and the elements of a producer keep their order.
+/// </summary>
+/// <typeparam name="T"> template parameter </typeparam>
+template<typename T>
+class MpscQueue
+{
+private:
+
+    /// <summary>
+    /// Structure to represent a slot of the ring.
+    /// </summary>
+    struct Slot
+    {
+        // Position the slot waits to be pushed at, or one past the position it holds an element for
+        std::atomic<std::size_t> sequence;
+
+        // Element of the slot
+        T value;
+    };
+
+    // Storage of the slots, its size is a power of two
+    std::unique_ptr<Slot[]> slots;
+
+    // Number of slots
+    std::size_t capacity;
+
+    // Mask to wrap positions into the storage
+    std::size_t mask;
+
+    // Position of the next element to push, claimed by the producers
+    alignas(64) std::atomic<std::size_t> tail;
+
+    // Position of the next element to pop, used only by the consumer
+    alignas(64) std::size_t head;
+
+    // Number of failed attempts before a waiting side goes to sleep
+    static constexpr int spinLimit = 256;
+public:
+
+    // Constructor
+    MpscQueue(std::size_t requestedCapacity)
+        : slots(), capacity(2), mask(0), tail(0), head(0)
+    {
+        while (capacity < requestedCapacity) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        slots.reset(new Slot[capacity]);
+        for (std::size_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Destructor
+    ~MpscQueue() = default;
+
+    /// <summary>
+    /// Tries to insert an element without waiting, may be called by many threads at once.
+    /// </summary>
+    /// <param name="value"> element, moved from on success </param>
+    /// <returns> true if the element was inserted else false </returns>
+    bool tryPush(T &value)
+    {
+        std::size_t position = tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[position & mask];
+            std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto lag = static_cast<std::ptrdiff_t>(sequence - position);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (lag < 0) {
+
+                // The consumer has not freed the slot of the previous round yet
+                return false;
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->value = std::move(value);
+        slot->sequence.store(position + 1, std::memory_order_release);
+        slot->sequence.notify_one();
+        return true;
+    }
+
+    /// <summary>
+    /// Tries to extract an element without waiting, called only by the consumer thread.
+    /// </summary>
+    /// <param name="value"> receiver of the element </param>
+    /// <returns> true if an element was extracted else false </returns>
+    bool tryPop(T &value)
+    {
+        Slot &slot = slots[head & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        value = std::move(slot.value);
+        slot.sequence.store(head + capacity, std::memory_order_release);
+        slot.sequence.notify_all();
+        ++head;
+        return true;
+    }
+
+    /// <summary>
+    /// Inserts an element, waiting while the queue is full.
+    /// </summary>
+    /// <param name="value"> element </param>
+    void push(T value)
+    {
+        for (int attempt = 1; !tryPush(value); ++attempt) {
+
+            // Sleeping until the consumer frees the slot at the tail
+            if (attempt >= spinLimit) {
+                std::size_t position = tail.load(std::memory_order_relaxed);
+                Slot &slot = slots[position & mask];
+                std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                if (static_cast<std::ptrdiff_t>(sequence - position) < 0) {
+                    slot.sequence.wait(sequence, std::memory_order_acquire);
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Extracts an element, waiting while the queue is empty.
+    /// </summary>
+    /// <returns> the extracted element </returns>
+    T pop()
+    {
+        T value;
+        for (int attempt = 1; !tryPop(value); ++attempt) {
+
+            // Sleeping until a producer fills the slot at the head
+            if (attempt >= spinLimit) {
+                slots[head & mask].sequence.wait(head, std::memory_order_acquire);
+            }
+        }
+        return value;
+    }
+};
+
+/// <summary>
+/// Class WorkerPool represents a fixed set of threads that run
+/// the independent tasks of a job together with the calling thread.
+/// </summary>
+class WorkerPool
+{
+private:
+    // Worker threads
+    std::vector<std::thread> workers;
+
+    // Guards the job description and the counters below
+    std::mutex mutex;
+
+    // Signals the workers about a new job or the shutdown
+    std::condition_variable jobStarted;
+
+    // Signals the calling thread that every worker left the job
+    std::condition_variable jobFinished;
+
+    // Task of the current job applied to the indices of the job
+    const std::function<void(std::size_t)> *task;
+
+    // Number of indices in the current job
+    std::size_t jobSize;
+
+    // Next index to process
+    std::atomic<std::size_t> nextIndex;
+
+    // Number of workers still processing the current job
+    std::size_t busyWorkers;
+
+    // Number of jobs started so far
+    std::uint64_t generation;
+
+    // States whether the workers have to exit
+    bool stopping;
+
+    // First exception thrown by a task of the current job
+    std::exception_ptr failure;
+
+    /// <summary>
+    /// Processes indices of the current job until none are left.
+    /// </summary>
+    void runTasks()
+    {
+        for (std::size_t i = nextIndex.fetch_add(1); i < jobSize; i = nextIndex.fetch_add(1)) {
+            try {
+                (*task)(i);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Main loop of a worker thread.
+    /// </summary>
+    void work()
+    {
+        std::uint64_t seenGeneration = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobStarted.wait(lock, [&]()
+                {
+                    return stopping || generation != seenGeneration;
+                });
+                if (stopping) {
+                    return;
+                }
+                seenGeneration = generation;
+            }
+
+            runTasks();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busyWorkers == 0) {
+                jobFinished.notify_one();
+            }
+        }
+    }
+public:
+
+    // Constructor
+    WorkerPool(std::size_t threads)
+        : workers(), task(nullptr), jobSize(0), nextIndex(0), busyWorkers(0), generation(0), stopping(false)
+    {
+        for (std::size_t i = 0; i < threads; ++i) {
+            workers.emplace_back(&WorkerPool::work, this);
+        }
+    }
+
+    // Destructor
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobStarted.notify_all();
+
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    /// <summary>
+    /// Getter for the number of threads, including the calling one.
+    /// </summary>
+    /// <returns> number of threads running a job </returns>
+    std::size_t size() const
+    {
+        return workers.size() + 1;
+    }
+
+    /// <summary>
+    /// Applies the task to every index from zero to the size of the job
+    /// and waits for the completion.
+    /// </summary>
+    /// <param name="size"> number of indices </param>
+    /// <param name="job"> task to apply to an index </param>
+    void run(std::size_t size, const std::function<void(std::size_t)> &job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &job;
+            jobSize = size;
+            nextIndex.store(0);
+            busyWorkers = workers.size();
+            failure = nullptr;
+            ++generation;
+        }
+        jobStarted.notify_all();
+
+        runTasks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        jobFinished.wait(lock, [&]()
+        {
+            return busyWorkers == 0;
+        });
+
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+    }
+
+    /// <summary>
+    /// Applies a task once on every thread, the calling thread included, and waits for the completion.
+    /// </summary>
+    /// <param name="job"> task to apply on a thread, it does not throw </param>
+    void runOnEveryThread(const std::function<void()> &job)
+    {
+        // A thread waits for the others after its task, so no thread takes two of them
+        std::latch arrived(size());
+        run(size(), [&](std::size_t)
+        {
+            job();
+            arrived.arrive_and_wait();
+        });
+    }
+};
+
+/// <summary>
+/// Class Tracer writes the spans of the execution as a timeline in the trace event format read by
+/// the trace viewers of Chrome and Perfetto. Every thread collects its spans in a buffer of its own
+/// and writes them to the file when the buffer fills up, so the memory stays bounded whatever the
+/// length of the script.
+/// </summary>
+class Tracer
+{
+private:
+
+    /// <summary>
+    /// Structure to represent a finished span.
+    /// </summary>
+    struct Span
+    {
+        // Name of the span, a literal
+        const char *name = nullptr;
+
+        // Names of the characters taking part, empty when there is none
+        std::string actor;
+        std::string target;
+
+        // Start and duration in nanoseconds since the tracer was opened
+        std::int64_t start = 0;
+        std::int64_t duration = 0;
+    };
+
+    /// <summary>
+    /// Structure to represent the spans of one thread waiting to be written.
+    /// </summary>
+    struct Buffer
+    {
+        // Slots of the spans, reused after every write to keep the names allocated
+        std::vector<Span> spans;
+
+        // Number of filled slots
+        std::size_t size = 0;
+
+        // Identifier of the thread in the trace
+        int thread = 0;
+
+        Buffer();
+
+        ~Buffer();
+    };
+
+    // Number of spans a thread buffers before writing them
+    static constexpr std::size_t bufferedSpans = 1 << 14;
+
+    // States whether spans are recorded
+    static std::atomic<bool> enabled;
+
+    // Guards the file and the registered buffers
+    static std::mutex fileMutex;
+
+    // Trace file
+    static std::ofstream file;
+
+    // States whether no event has been written yet, the events are separated by commas
+    static bool isFirstEvent;
+
+    // Moment the tracer was opened
+    static std::chrono::steady_clock::time_point origin;
+
+    // Buffers of the running threads
+    static std::vector<Buffer *> buffers;
+
+    // Identifier of the next thread to record a span
+    static std::atomic<int> nextThread;
+
+    /// <summary>
+    /// Returns the buffer of the calling thread.
+    /// </summary>
+    /// <returns> reference to the buffer </returns>
+    static Buffer &threadBuffer()
+    {
+        static thread_local Buffer buffer;
+        return buffer;
+    }
+
+    /// <summary>
+    /// Writes a string as a JSON string literal.
+    /// </summary>
+    /// <param name="text"> text to write </param>
+    static void writeString(std::string_view text)
+    {
+        file << '"';
+        for (char c: text) {
+            if (c == '"' || c == '\\') {
+                file << '\\' << c;
+            }
+            else if ((unsigned char) c < 0x20) {
+                file << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+            }
+            else {
+                file << c;
+            }
+        }
+        file << '"';
+    }
+
+    /// <summary>
+    /// Writes the buffered spans of a thread and empties its buffer. The file mutex has to be held.
+    /// </summary>
+    /// <param name="buffer"> buffer of the thread </param>
+    static void flush(Buffer &buffer)
+    {
+        for (std::size_t i = 0; i < buffer.size; ++i) {
+            const Span &span = buffer.spans[i];
+            file << (isFirstEvent ? "\n" : ",\n") << "{\"name\":";
+            writeString(span.name);
+            file << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.thread << ",\"ts\":" << span.start / 1000 << '.'
+                 << std::setw(3) << std::setfill('0') << span.start % 1000 << ",\"dur\":" << span.duration / 1000 << '.'
+                 << std::setw(3) << span.duration % 1000 << std::setfill(' ');
+            if (!span.actor.empty() || !span.target.empty()) {
+                file << ",\"args\":{";
+                if (!span.actor.empty()) {
+                    file << "\"actor\":";
+                    writeString(span.actor);
+                }
+                if (!span.target.empty()) {
+                    file << (span.actor.empty() ? "\"target\":" : ",\"target\":");
+                    writeString(span.target);
+                }
+                file << '}';
+            }
+            file << '}';
+            isFirstEvent = false;
+        }
+        buffer.size = 0;
+    }
+
+public:
+
+    /// <summary>
+    /// Starts recording spans into a new trace file.
+    /// </summary>
+    /// <param name="path"> path of the trace file </param>
+    /// <returns> true if the file could be created </returns>
+    static bool open(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        isFirstEvent = true;
+        origin = std::chrono::steady_clock::now();
+        enabled.store(true);
+        return true;
+    }
+
+    /// <summary>
+    /// Stops recording, writes the spans still buffered and completes the trace file.
+    /// The threads recording spans have to be finished or idle.
+    /// </summary>
+    static void close()
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        if (!enabled.exchange(false)) {
+            return;
+        }
+        for (Buffer *buffer: buffers) {
+            flush(*buffer);
+        }
+        file << "\n]}\n";
+        file.close();
+    }
+
+    /// <summary>
+    /// States whether spans are recorded.
+    /// </summary>
+    /// <returns> true if a trace file is open </returns>
+    static bool isEnabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Makes the buffer of the calling thread while spans are recorded, ahead of its first span.
+    /// </summary>
+    static void prepareThread()
+    {
+        if (isEnabled()) {
+            threadBuffer();
+        }
+    }
+
+    /// <summary>
+    /// Returns the current moment of the trace.
+    /// </summary>
+    /// <returns> nanoseconds since the tracer was opened </returns>
+    static std::int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    /// <summary>
+    /// Records a span that ends now in the buffer of the calling thread.
+    /// </summary>
+    /// <param name="name"> name of the span, a literal </param>
+    /// <param name="actor"> name of the acting character or empty </param>
+    /// <param name="target"> name of the target character or empty </param>
+    /// <param name="start"> moment the span started </param>
+    static void record(const char *name, std::string_view actor, std::string_view target, std::int64_t start)
+    {
+        std::int64_t end = now();
+        Buffer &buffer = threadBuffer();
+        if (buffer.size == buffer.spans.size()) {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            if (enabled.load()) {
+                flush(buffer);
+            }
+            buffer.size = 0;
+        }
+
+        Span &span = buffer.spans[buffer.size++];
+        span.name = name;
+        span.actor.assign(actor);
+        span.target.assign(target);
+        span.start = start;
+        span.duration = end - start;
+    }
+};
+
+/// <summary>
+/// Class TraceSpan represents a span of the trace from its construction to its destruction.
+/// It records nothing while the tracer is closed.
+/// </summary>
+class TraceSpan
+{
+private:
+    // Name of the span, a literal
+    const char *name;
+
+    // Names of the characters taking part, they have to outlive the span
+    std::string_view actor;
+    std::string_view target;
+
+    // Moment the span started, negative when the tracer is closed
+    std::int64_t start;
+
+public:
+    /// <summary>
+    /// Constructor starting a span.
+    /// </summary>
+    /// <param name="name"> name of the span, a literal </param>
+    /// <param name="actor"> name of the acting character </param>
+    /// <param name="target"> name of the target character </param>
+    explicit TraceSpan(const char *name, std::string_view actor = {}, std::string_view target = {})
+        : name(name), actor(actor), target(target), start(Tracer::isEnabled() ? Tracer::now() : -1)
+    {}
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    /// <summary>
+    /// Destructor ending the span.
+    /// </summary>
+    ~TraceSpan()
+    {
+        if (start >= 0) {
+            Tracer::record(name, actor, target, start);
+        }
+    }
+};
+
+std::atomic<bool> Tracer::enabled{false};
+
+std::mutex Tracer::fileMutex;
+
+std::ofstream Tracer::file;
+
+bool Tracer::isFirstEvent{true};
+
+std::chrono::steady_clock::time_point Tracer::origin;
+
+std::vector<Tracer::Buffer *> Tracer::buffers;
+
+std::atomic<int> Tracer::nextThread{1};
+
+Tracer::Buffer::Buffer(): spans(bufferedSpans), thread(nextThread++)
+{
+    std::lock_guard<std::mutex> lock(fileMutex);
+    buffers.push_back(this);
+}
+
+Tracer::Buffer::~Buffer()
+{
+    // The spans of a finishing thread are written before its buffer goes away
+    std::lock_guard<std::mutex> lock(fileMutex);
+    if (enabled.load()) {
+        flush(*this);
+    }
+    buffers.erase(std::find(buffers.begin(), buffers.end(), this));
+}
+
+/// <summary>
+/// Prints the elements in the ascending order with the threads of a pool. Every thread sorts a shard of the range,
+/// the sorted shards are split by names sampled from them into parts of about the same size, and every part is
+/// merged from its pieces of the shards and formatted into a buffer of its own. The buffers are written out in
+/// the order of the parts, so the output is the same as that of one thread.
+/// </summary>
+/// <typeparam name="T"> type of the elements ordered by operator less </typeparam>
+/// <param name="range"> random access range of references to the elements </param>
+/// <param name="out"> output buffer receiving the printed elements </param>
+/// <param name="workers"> pool of threads running the shards and the parts </param>
+template<typename T, std::ranges::random_access_range Range>
+void printInAscendingOrder(Range &&range, OutputBuffer &out, WorkerPool &workers)
+{
+    auto less = [](const T *first, const T *second)
+    {
+        return (*first < *second);
+    };
+
+    std::size_t size = std::ranges::size(range);
+    std::size_t shards = std::max<std::size_t>(1, std::min(workers.size(), size / 1024));
+    std::vector<T *> elements(size);
+    auto bound = [&](std::size_t shard)
+    {
+        return size * shard / shards;
+    };
+
+    // Sorting the shards
+    auto first = std::ranges::begin(range);
+    workers.run(shards, [&](std::size_t shard)
+    {
+        TraceSpan span("sort shard");
+        for (std::size_t i = bound(shard); i < bound(shard + 1); ++i) {
+            elements[i] = &first[i];
+        }
+        std::sort(elements.begin() + bound(shard), elements.begin() + bound(shard + 1), less);
+    });
+
+    // Splitters of the parts are taken from evenly spaced samples of the sorted shards
+    const std::size_t samplesPerShard = 32;
+    std::vector<T *> samples;
+    samples.reserve(shards * samplesPerShard);
+    for (std::size_t shard = 0; shard < shards; ++shard) {
+        std::size_t length = bound(shard + 1) - bound(shard);
+        for (std::size_t j = 1; j <= samplesPerShard && length > 0; ++j) {
+            samples.push_back(elements[bound(shard) + length * j / (samplesPerShard + 1)]);
+        }
+    }
+    std::sort(samples.begin(), samples.end(), less);
+
+    // A part takes the elements from its splitter up to the splitter of the next part out of every shard
+    std::size_t parts = shards;
+    std::vector<std::size_t> cuts(shards * (parts + 1));
+    for (std::size_t shard = 0; shard < shards; ++shard) {
+        auto begin = elements.begin() + bound(shard);
+        auto end = elements.begin() + bound(shard + 1);
+        cuts[shard * (parts + 1)] = bound(shard);
+        for (std::size_t part = 1; part < parts; ++part) {
+            T *splitter = samples[samples.size() * part / parts];
+            cuts[shard * (parts + 1) + part] = std::lower_bound(begin, end, splitter, less) - elements.begin();
+        }
+        cuts[shard * (parts + 1) + parts] = bound(shard + 1);
+    }
+
+    // Merging and formatting the parts
+    std::vector<OutputBuffer> buffers(parts);
+    workers.run(parts, [&](std::size_t part)
+    {
+        TraceSpan span("render part");
+        std::vector<T *> merged;
+        std::vector<std::size_t> runs{0};
+        for (std::size_t shard = 0; shard < shards; ++shard) {
+            merged.insert(merged.end(), elements.begin() + cuts[shard * (parts + 1) + part],
+                          elements.begin() + cuts[shard * (parts + 1) + part + 1]);
+            runs.push_back(merged.size());
+        }
+
+        // Neighbouring runs are merged in pairs until one run is left
+        while (runs.size() > 2) {
+            std::vector<std::size_t> mergedRuns;
+            std::size_t i = 0;
+            for (; i + 2 < runs.size(); i += 2) {
+                std::inplace_merge(merged.begin() + runs[i], merged.begin() + runs[i + 1], merged.begin() + runs[i + 2], less);
+                mergedRuns.push_back(runs[i]);
+            }
+            if (i + 1 < runs.size()) {
+                mergedRuns.push_back(runs[i]);
+            }
+            mergedRuns.push_back(runs.back());
+            runs = std::move(mergedRuns);
+        }
+
+        for (T *element: merged) {
+            element->print(buffers[part]);
+        }
+    });
+
+    for (OutputBuffer &buffer: buffers) {
+        out << buffer.view();
+    }
+}
+
+/// <summary>
+/// Enumeration of the commands of the script language.
+/// </summary>
+enum class CommandKind
+{
+    CreateCharacter,
+    CreateWeapon,
+    CreatePotion,
+    CreateSpell,
+    CreateCharacters,
+    CreateWeapons,
+    CreatePotions,
+    Attack,
+    Cast,
+    Drink,
+    Dialogue,
+    ShowCharacters,
+    ShowWeapons,
+    ShowPotions,
+    ShowSpells,
+    ShowWeakest,
+    ShowStrongest,
+    ShowBelow,
+    Give,
+    ShowOwners,
+    Apply,
+    Tick,
+    Move,
+    ShowNearby,
+    Map,
+    Obstacle,
+    MoveTo,
+    Repeat,
+    Macro,
+    Call,
+    Export,
+    Stats,
+
+    // Word that is not a command, it is skipped
+    Unknown,
+
+    // Malformed command, it stops the game
+    Invalid,
+
+    // No more commands in the input
+    EndOfInput
+};
+
+/// <summary>
+/// Enumeration of the fields of a command that a parameter of a macro can stand in.
+/// </summary>
+enum class CommandField
+{
+    Word,
+    Value,
+    Count,
+    X,
+    Y
+};
+
+/// <summary>
+/// Structure to represent a field of a command in the body of a macro that takes an argument of the call.
+/// </summary>
+struct ParameterSlot
+{
+    // Field taking the argument
+    CommandField field;
+
+    // Index of the word taking the argument, zero for the number fields
+    std::size_t word;
+
+    // Index of the parameter of the macro
+    std::size_t parameter;
+};
+
+/// <summary>
+/// Structure to represent a parsed command of the script.
+/// </summary>
+struct Command
+{
+    // Kind of the command
+    CommandKind kind = CommandKind::EndOfInput;
+
+    // Words of the command after the keywords in the order of appearance:
+    // character type and name for CreateCharacter, owner and item name (then spell targets) for items,
+    // actor, receiver and item name for Attack, Cast and Drink, speaker and speech for Dialogue,
+    // character name for Show of items, giver, receiver and item name for Give, item name for Show owners,
+    // character type and name prefix for CreateCharacters, owner name prefix and item name for bulk items,
+    // effect kind and target name for Apply, character name for Move, Show nearby and MoveTo,
+    // add or remove for Obstacle, macro name and parameter names for Macro, macro name and arguments for Call
+    std::vector<std::string> words;
+
+    // Health, damage or heal value, number of characters or health threshold for Show by health,
+    // strength of an effect for Apply, number of ticks for Tick, horizontal offset for Move, radius for Show nearby,
+    // width for Map and Obstacle
+    int value = 0;
+
+    // Number of objects created by a bulk command, number of turns of an effect for Apply, vertical offset for Move,
+    // height for Map and Obstacle, number of iterations for Repeat
+    int count = 0;
+
+    // Square of the destination for MoveTo and of the corner for Obstacle
+    int x = 0;
+    int y = 0;
+
+    // Commands of the block of Repeat and Macro, parsed once and shared by the copies of the command
+    std::shared_ptr<const std::vector<Command>> body;
+
+    // Fields taking the arguments of a call, only in the body of a macro, the parameter names
+    // are kept in the words and zero in the number fields
+    std::vector<ParameterSlot> parameters;
+};
+
+/// <summary>
+/// Reads the next command from the input stream.
+/// </summary>
+/// <param name="input"> reference to the input stream </param>
+/// <returns> the parsed command </returns>
+Command parseCommand(std::istream &input);
+
+/// <summary>
+/// Reads the rest of a command whose first word was read already.
+/// </summary>
+/// <param name="first"> first word of the command </param>
+/// <param name="input"> reference to the input stream </param>
+/// <param name="parameters"> names of the parameters of the macro whose body is read, nullptr outside macros </param>
+/// <returns> the parsed command </returns>
+Command parseCommand(const std::string &first, std::istream &input, const std::vector<std::string> *parameters = nullptr);
+
+/// <summary>
+/// Function to determine whether the arguments of a call can be bound to a macro body:
+/// the arguments taken by number fields, nested Repeat blocks included, must be numbers.
+/// </summary>
+/// <param name="body"> commands of the body of the macro </param>
+/// <param name="call"> Call command naming the macro and its arguments </param>
+/// <returns> true if every argument fits its fields else false </returns>
+bool argumentsFit(const std::vector<Command> &body, const Command &call);
+
+/// <summary>
+/// Writes a command of the body of a macro with the arguments of a call in place of the parameters.
+/// The body of a nested block is shared, its commands are bound when they execute.
+/// </summary>
+/// <param name="command"> command of the body of the macro </param>
+/// <param name="call"> Call command naming the macro and its arguments, they fit the body </param>
+/// <param name="bound"> receives the command to execute, its storage is reused </param>
+void bindArguments(const Command &command, const Command &call, Command &bound);
+
+/// <summary>
+/// Structure to represent the characters whose state a command reads or changes.
+/// </summary>
+struct CommandAccess
+{
+    // Names of the characters the command reads
+    std::vector<std::string_view> reads;
+
+    // Names of the characters the command changes
+    std::vector<std::string_view> writes;
+
+    // States whether the command depends on every command before it
+    // and every command after it depends on it
+    bool isBarrier = false;
+};
+
+/// <summary>
+/// Determines the characters a command reads and changes.
+/// </summary>
+/// <param name="command"> parsed command </param>
+/// <returns> the access sets of the command </returns>
+CommandAccess analyzeCommand(const Command &command);
+
+/// <summary>
+/// Writes a command in the syntax of the script.
+/// </summary>
+/// <param name="command"> parsed command </param>
+/// <param name="parameters"> names of the parameters of the macro whose body the command is in, nullptr outside macros </param>
+/// <returns> the text of the command without the line break </returns>
+std::string formatCommand(const Command &command, const std::vector<std::string> *parameters = nullptr);
+
+/// <summary>
+/// Names a kind of command.
+/// </summary>
+/// <param name="kind"> kind of the command </param>
+/// <returns> the name, a literal </returns>
+const char *commandName(CommandKind kind);
+
+/// <summary>
+/// Finds the characters named by a command as the one acting and the one acted upon.
+/// </summary>
+/// <param name="command"> parsed command </param>
+/// <returns> the names of the actor and the target, empty when the command has none </returns>
+std::pair<std::string_view, std::string_view> commandParticipants(const Command &command);
+
+/// <summary>
+/// Class PerfCounters reads the hardware counters of the processor around every executed command
+/// and sums them per kind of command. The counters are opened with perf_event_open on Linux for
+/// every thread executing commands; where they cannot be opened nothing is counted.
+/// </summary>
+class PerfCounters
+{
+public:
+    // Number of counted events: cycles, instructions, cache misses and branch misses
+    static constexpr int events = 4;
+
+    // Values of the counters
+    using Values = std::array<std::uint64_t, events>;
+
+private:
+
+    /// <summary>
+    /// Structure to represent the sums of the counters for a kind of command.
+    /// </summary>
+    struct Totals
+    {
+        // Number of executed commands
+        std::uint64_t commands = 0;
+
+        // Sums of the counters over the commands
+        Values values{};
+    };
+
+    /// <summary>
+    /// Structure to represent the counters of one thread and their sums.
+    /// </summary>
+    struct Group
+    {
+        // Descriptor of the counter leading the group, -1 when no counter could be opened
+        int leader = -1;
+
+        // Descriptors of the opened counters in the order of the group
+        std::array<int, events> descriptors;
+
+        // Position of every event in the values read from the group, -1 when it is not counted
+        std::array<int, events> positions;
+
+        // Number of opened counters
+        int opened = 0;
+
+        // Sums per kind of command
+        std::array<Totals, std::size_t(CommandKind::EndOfInput) + 1> totals{};
+
+        Group();
+
+        ~Group();
+    };
+
+    // Names of the counted events
+    static constexpr std::array<const char *, events> eventNames{"cycles", "instructions", "cache misses", "branch misses"};
+
+    // States whether the counters are read
+    static std::atomic<bool> enabled;
+
+    // Guards the groups and the sums of finished threads
+    static std::mutex mutex;
+
+    // Groups of the running threads
+    static std::vector<Group *> groups;
+
+    // Sums of the threads that finished
+    static std::array<Totals, std::size_t(CommandKind::EndOfInput) + 1> finished;
+
+    // States which events could be counted by the first group
+    static std::array<bool, events> isCounted;
+
+    /// <summary>
+    /// Returns the counters of the calling thread, opening them on the first call.
+    /// </summary>
+    /// <returns> reference to the group </returns>
+    static Group &threadGroup()
+    {
+        static thread_local Group group;
+        return group;
+    }
+
+    /// <summary>
+    /// Opens a counter of the calling thread counting in user space.
+    /// </summary>
+    /// <param name="event"> index of the event </param>
+    /// <param name="leader"> descriptor of the group leader or -1 to lead a new group </param>
+    /// <returns> descriptor of the counter or -1 with errno set </returns>
+    static int openCounter(int event, int leader)
+    {
+#ifdef __linux__
+        static constexpr std::array<std::uint64_t, events> configs{PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                                   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = configs[event];
+        attributes.read_format = PERF_FORMAT_GROUP;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
+public:
+
+    /// <summary>
+    /// Starts reading the counters around the commands.
+    /// </summary>
+    /// <param name="reason"> set to the cause when no counter can be opened </param>
+    /// <returns> true if at least one counter is available </returns>
+    static bool open(std::string &reason)
+    {
+        Group &group = threadGroup();
+        if (group.leader < 0) {
+            reason = std::strerror(errno);
+            return false;
+        }
+        for (int event = 0; event < events; ++event) {
+            isCounted[event] = (group.positions[event] >= 0);
+        }
+        enabled.store(true);
+        return true;
+    }
+
+    /// <summary>
+    /// States whether the counters are read.
+    /// </summary>
+    /// <returns> true if the counters were opened </returns>
+    static bool isEnabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Reads the counters of the calling thread.
+    /// </summary>
+    /// <param name="values"> set to the values of the counters </param>
+    /// <returns> true if the counters of the thread could be read </returns>
+    static bool read(Values &values)
+    {
+        Group &group = threadGroup();
+        if (group.leader < 0) {
+            return false;
+        }
+
+#ifdef __linux__
+        std::array<std::uint64_t, events + 1> data;
+        ssize_t size = ::read(group.leader, data.data(), sizeof(data));
+        if (size < ssize_t(sizeof(std::uint64_t) * (group.opened + 1))) {
+            return false;
+        }
+#else
+        std::array<std::uint64_t, events + 1> data{};
+#endif
+        for (int event = 0; event < events; ++event) {
+            values[event] = (group.positions[event] >= 0) ? data[1 + group.positions[event]] : 0;
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Adds the counts since an earlier reading to the sums of a kind of command.
+    /// </summary>
+    /// <param name="kind"> kind of the executed command </param>
+    /// <param name="start"> values read before the command </param>
+    static void add(CommandKind kind, const Values &start)
+    {
+        Values end;
+        if (!read(end)) {
+            return;
+        }
+        Totals &totals = threadGroup().totals[std::size_t(kind)];
+        ++totals.commands;
+        for (int event = 0; event < events; ++event) {
+            totals.values[event] += end[event] - start[event];
+        }
+    }
+
+    /// <summary>
+    /// Writes a table of the counters per command executed, per kind of command.
+    /// The threads executing commands have to be finished or idle.
+    /// </summary>
+    /// <param name="out"> stream to write to </param>
+    static void report(std::ostream &out)
+    {
+        if (!isEnabled()) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto totals = finished;
+        for (Group *group: groups) {
+            for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+                totals[kind].commands += group->totals[kind].commands;
+                for (int event = 0; event < events; ++event) {
+                    totals[kind].values[event] += group->totals[kind].values[event];
+                }
+            }
+        }
+
+        out << std::left << std::setw(22) << "command" << std::right << std::setw(10) << "count";
+        for (const char *name: eventNames) {
+            out << std::setw(15) << name;
+        }
+        out << std::setw(8) << "IPC" << "\n";
+        for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+            const Totals &sums = totals[kind];
+            if (sums.commands == 0) {
+                continue;
+            }
+            out << std::left << std::setw(22) << commandName(CommandKind(kind)) << std::right << std::setw(10) << sums.commands;
+            for (int event = 0; event < events; ++event) {
+                if (isCounted[event]) {
+                    out << std::setw(15) << sums.values[event] / sums.commands;
+                }
+                else {
+                    out << std::setw(15) << "n/a";
+                }
+            }
+            if (isCounted[0] && isCounted[1] && sums.values[0] > 0) {
+                out << std::setw(8) << std::fixed << std::setprecision(2) << double(sums.values[1]) / sums.values[0]
+                    << std::defaultfloat;
+            }
+            else {
+                out << std::setw(8) << "n/a";
+            }
+            out << "\n";
+        }
+        out << "(per command)\n";
+    }
+};
+
+/// <summary>
+/// Class PerfSample represents the reading of the hardware counters around the execution of a command.
+/// It reads nothing while the counters are closed.
+/// </summary>
+class PerfSample
+{
+private:
+    // Kind of the executed command
+    CommandKind kind;
+
+    // Values of the counters before the command
+    PerfCounters::Values start;
+
+    // States whether the counters were read before the command
+    bool isCounting;
+
+public:
+    /// <summary>
+    /// Constructor reading the counters before a command.
+    /// </summary>
+    /// <param name="kind"> kind of the command </param>
+    explicit PerfSample(CommandKind kind)
+        : kind(kind), isCounting(PerfCounters::isEnabled() && PerfCounters::read(start))
+    {}
+
+    PerfSample(const PerfSample &) = delete;
+
+    PerfSample &operator=(const PerfSample &) = delete;
+
+    /// <summary>
+    /// Destructor adding the counts of the command to its kind.
+    /// </summary>
+    ~PerfSample()
+    {
+        if (isCounting) {
+            PerfCounters::add(kind, start);
+        }
+    }
+};
+
+std::atomic<bool> PerfCounters::enabled{false};
+
+std::mutex PerfCounters::mutex;
+
+std::vector<PerfCounters::Group *> PerfCounters::groups;
+
+std::array<PerfCounters::Totals, std::size_t(CommandKind::EndOfInput) + 1> PerfCounters::finished{};
+
+std::array<bool, PerfCounters::events> PerfCounters::isCounted{};
+
+PerfCounters::Group::Group()
+{
+    // The events the processor or the permissions do not allow are left out of the group
+    int error = 0;
+    for (int event = 0; event < events; ++event) {
+        int descriptor = openCounter(event, leader);
+        if (descriptor < 0) {
+            positions[event] = -1;
+            error = (error == 0) ? errno : error;
+            continue;
+        }
+        if (leader < 0) {
+            leader = descriptor;
+        }
+        descriptors[opened] = descriptor;
+        positions[event] = opened++;
+    }
+    errno = error;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    groups.push_back(this);
+}
+
+PerfCounters::Group::~Group()
+{
+    // The sums of a finishing thread are kept for the report
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+        finished[kind].commands += totals[kind].commands;
+        for (int event = 0; event < events; ++event) {
+            finished[kind].values[event] += totals[kind].values[event];
+        }
+    }
+    groups.erase(std::find(groups.begin(), groups.end(), this));
+
+#ifdef __linux__
+    // Closing the leader last
+    for (int i = opened - 1; i >= 0; --i) {
+        ::close(descriptors[i]);
+    }
+#endif
+}
+
+/// <summary>
+/// Class AllocationCounter counts the allocations made through the global operator new by every
+/// thread and sums them per kind of command executed.
+/// </summary>
+class AllocationCounter
+{
+public:
+
+    /// <summary>
+    /// Structure to represent a number of allocations and their size.
+    /// </summary>
+    struct Counts
+    {
+        // Number of allocations
+        std::uint64_t allocations = 0;
+
+        // Allocated bytes
+        std::uint64_t bytes = 0;
+    };
+
+    /// <summary>
+    /// Structure to represent the sums of the allocations for a kind of command.
+    /// </summary>
+    struct Totals
+    {
+        // Number of executed commands
+        std::uint64_t commands = 0;
+
+        // Allocations made by the commands
+        Counts counts;
+    };
+
+    // Sums per kind of command
+    using Table = std::array<Totals, std::size_t(CommandKind::EndOfInput) + 1>;
+
+private:
+
+    /// <summary>
+    /// Structure to represent the sums of one thread.
+    /// </summary>
+    struct ThreadTable
+    {
+        // Sums per kind of command
+        Table totals{};
+
+        ThreadTable();
+
+        ~ThreadTable();
+    };
+
+    // States whether the allocations are counted
+    static std::atomic<bool> enabled;
+
+    // Allocations of the calling thread while counted
+    static thread_local Counts threadCounts;
+
+    // Guards the tables and the sums of finished threads
+    static std::mutex mutex;
+
+    // Tables of the running threads
+    static std::vector<ThreadTable *> tables;
+
+    // Sums of the threads that finished
+    static Table finished;
+
+    /// <summary>
+    /// Returns the sums of the calling thread.
+    /// </summary>
+    /// <returns> reference to the sums </returns>
+    static ThreadTable &threadTable()
+    {
+        static thread_local ThreadTable table;
+        return table;
+    }
+
+public:
+
+    /// <summary>
+    /// Starts counting the allocations.
+    /// </summary>
+    static void open()
+    {
+        enabled.store(true);
+    }
+
+    /// <summary>
+    /// States whether the allocations are counted.
+    /// </summary>
+    /// <returns> true if counting </returns>
+    static bool isEnabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Counts an allocation of the calling thread.
+    /// </summary>
+    /// <param name="size"> number of allocated bytes </param>
+    static void count(std::size_t size)
+    {
+        if (isEnabled()) {
+            ++threadCounts.allocations;
+            threadCounts.bytes += size;
+        }
+    }
+
+    /// <summary>
+    /// Returns the allocations counted on the calling thread so far.
+    /// </summary>
+    /// <returns> the counts </returns>
+    static Counts current()
+    {
+        return threadCounts;
+    }
+
+    /// <summary>
+    /// Adds the allocations since an earlier reading to the sums of a kind of command.
+    /// </summary>
+    /// <param name="kind"> kind of the executed command </param>
+    /// <param name="start"> counts read before the command </param>
+    static void add(CommandKind kind, const Counts &start)
+    {
+        Counts end = threadCounts;
+        Totals &totals = threadTable().totals[std::size_t(kind)];
+        ++totals.commands;
+        totals.counts.allocations += end.allocations - start.allocations;
+        totals.counts.bytes += end.bytes - start.bytes;
+    }
+
+    /// <summary>
+    /// Sums the allocations of all threads per kind of command.
+    /// The threads executing commands have to be finished or idle.
+    /// </summary>
+    /// <returns> the sums </returns>
+    static Table sums()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Table totals = finished;
+        for (ThreadTable *table: tables) {
+            for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+                totals[kind].commands += table->totals[kind].commands;
+                totals[kind].counts.allocations += table->totals[kind].counts.allocations;
+                totals[kind].counts.bytes += table->totals[kind].counts.bytes;
+            }
+        }
+        return totals;
+    }
+
+    /// <summary>
+    /// Writes a table of the allocations per command executed, per kind of command.
+    /// </summary>
+    /// <param name="out"> stream to write to </param>
+    static void report(std::ostream &out)
+    {
+        if (!isEnabled()) {
+            return;
+        }
+
+        Table totals = sums();
+        out << std::left << std::setw(22) << "command" << std::right << std::setw(10) << "count" << std::setw(15)
+            << "allocations" << std::setw(15) << "bytes" << "\n";
+        for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+            const Totals &sums = totals[kind];
+            if (sums.commands == 0) {
+                continue;
+            }
+            out << std::left << std::setw(22) << commandName(CommandKind(kind)) << std::right << std::setw(10) << sums.commands
+                << std::fixed << std::setprecision(2) << std::setw(15) << double(sums.counts.allocations) / sums.commands
+                << std::setw(15) << double(sums.counts.bytes) / sums.commands << std::defaultfloat << "\n";
+        }
+        out << "(per command)\n";
+    }
+};
+
+/// <summary>
+/// Class AllocationSample represents the counting of the allocations made by a command.
+/// It counts nothing while the allocations are not counted.
+/// </summary>
+class AllocationSample
+{
+private:
+    // Kind of the executed command
+    CommandKind kind;
+
+    // Allocations of the thread before the command
+    AllocationCounter::Counts start;
+
+    // States whether the allocations were counted before the command
+    bool isCounting;
+
+public:
+    /// <summary>
+    /// Constructor reading the allocations before a command.
+    /// </summary>
+    /// <param name="kind"> kind of the command </param>
+    explicit AllocationSample(CommandKind kind)
+        : kind(kind), start(), isCounting(AllocationCounter::isEnabled())
+    {
+        // The trace buffer of the thread is made before the reading, it belongs to no command
+        if (isCounting) {
+            Tracer::prepareThread();
+        }
+        start = AllocationCounter::current();
+    }
+
+    AllocationSample(const AllocationSample &) = delete;
+
+    AllocationSample &operator=(const AllocationSample &) = delete;
+
+    /// <summary>
+    /// Destructor adding the allocations of the command to its kind.
+    /// </summary>
+    ~AllocationSample()
+    {
+        if (isCounting) {
+            AllocationCounter::add(kind, start);
+        }
+    }
+};
+
+std::atomic<bool> AllocationCounter::enabled{false};
+
+thread_local AllocationCounter::Counts AllocationCounter::threadCounts{};
+
+std::mutex AllocationCounter::mutex;
+
+std::vector<AllocationCounter::ThreadTable *> AllocationCounter::tables;
+
+AllocationCounter::Table AllocationCounter::finished{};
+
+AllocationCounter::ThreadTable::ThreadTable()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    tables.push_back(this);
+}
+
+AllocationCounter::ThreadTable::~ThreadTable()
+{
+    // The sums of a finishing thread are kept for the report
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t kind = 0; kind < totals.size(); ++kind) {
+        finished[kind].commands += totals[kind].commands;
+        finished[kind].counts.allocations += totals[kind].counts.allocations;
+        finished[kind].counts.bytes += totals[kind].counts.bytes;
+    }
+    tables.erase(std::find(tables.begin(), tables.end(), this));
+}
+
+// Replacing the global allocation functions to count the allocations,
+// the array and non-throwing forms call these ones
+
+void *operator new(std::size_t size)
+{
+    AllocationCounter::count(size);
+    while (true) {
+        void *pointer = std::malloc((size > 0) ? size : 1);
+        if (pointer != nullptr) {
+            return pointer;
+        }
+
+        // The new-handler frees some memory for another attempt, or throws
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+// The deallocation functions are kept out of line, inlined they would
+// pair a call of operator new with a call of free
+
+[[gnu::noinline]] void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+/// <summary>
+/// Class CommandJournal represents an append-only file of the commands
+/// that changed the game, written to the disk in groups.
+/// </summary>
+class CommandJournal
+{
+private:
+    // Descriptor of the journal file
+    int file;
+
+    // Records waiting for the next group commit
+    std::string pending;
+
+    // Number of commands waiting for the next group commit
+    std::size_t pendingCommands;
+
+    // Number of commands that triggers a group commit
+    std::size_t groupSize;
+
+    // Longest time a command waits for a group commit
+    std::chrono::milliseconds groupInterval;
+
+    // Guards the pending records and the flags
+    std::mutex mutex;
+
+    // Signals the committing thread about a full group or the shutdown
+    std::condition_variable groupReady;
+
+    // Signals the waiting threads about a finished group commit
+    std::condition_variable groupCommitted;
+
+    // Number of group commits started and finished so far
+    std::uint64_t startedCommits;
+    std::uint64_t finishedCommits;
+
+    // States whether the committing thread has to exit
+    bool stopping;
+
+    // First error of writing the journal, the groups after it are dropped
+    std::exception_ptr failure;
+
+    // Thread writing and synchronizing the groups
+    std::thread committer;
+
+    /// <summary>
+    /// Main loop of the committing thread.
+    /// </summary>
+    void commitLoop();
+
+    /// <summary>
+    /// Appends the records to the file and waits until they reach the disk.
+    /// </summary>
+    /// <param name="records"> text of the records </param>
+    void writeDurably(const std::string &records);
+public:
+
+    // Constructor
+    CommandJournal(const std::string &path, std::size_t groupSize, std::chrono::milliseconds groupInterval);
+
+    // Destructor
+    ~CommandJournal();
+
+    /// <summary>
+    /// Appends a command to the journal, it becomes durable with its group.
+    /// Throws the error of an earlier group that could not be written.
+    /// </summary>
+    /// <param name="command"> applied command </param>
+    void append(const Command &command);
+
+    /// <summary>
+    /// Commits every appended command and waits for the completion.
+    /// Throws the error of writing the journal if a group could not be written.
+    /// </summary>
+    void commit();
+
+    /// <summary>
+    /// Reads the commands of a journal file, dropping a record torn by a crash.
+    /// </summary>
+    /// <param name="path"> path to the journal file </param>
+    /// <returns> the commands in the order of appending </returns>
+    static std::vector<Command> recover(const std::string &path);
+};
+
+/// <summary>
+/// Structure to represent the change an item makes to its target.
+/// </summary>
+struct ItemEffect
+{
+    enum class Kind
+    {
+        Damage,
+        Heal,
+
+        // Damage equal to the health points of the target
+        Kill
+    };
+
+    // Kind of the change
+    Kind kind;
+
+    // Damage or heal value
+    int amount;
+};
+
+/// <summary>
+/// Structure to represent an effect acting on a character over turns.
+/// </summary>
+struct StatusEffect
+{
+    enum class Kind
+    {
+        // Damage at every turn
+        Poison,
+
+        // Heal at every turn
+        Regeneration,
+
+        // Damage added to the weapons of the target until the effect wears off
+        Buff
+    };
+
+    // Kind of the effect
+    Kind kind;
+
+    // Ordinal of the character the effect acts on, the character is found in the roster of the session
+    // when the effect acts, so a copy made for a forked session takes its place without a change
+    std::uint64_t target;
+
+    // Damage, heal or damage bonus value
+    int amount;
+
+    // Number of turns left for poison and regeneration
+    int remaining;
+
+    // Position of the effect in the order of application, effects due at the same tick act in this order
+    std::uint64_t sequence;
+};
+
+/// <summary>
+/// Structure to represent a command executed against the state of the game
+/// without changing it, to be applied later if the state it observed stays the same.
+/// </summary>
+struct SpeculativeResult
+{
+    // Characters found by the command together with their versions at that moment
+    std::vector<std::pair<std::shared_ptr<Character>, std::uint64_t>> observed;
+
+    // States whether the command looked for a character that did not exist
+    bool missed = false;
+
+    // Output of the command preceding its effect
+    std::string text;
+
+    // Item used by the command, nothing if the command uses no item
+    std::shared_ptr<PhysicalItem> item;
+
+    // Target of the item
+    std::shared_ptr<Character> target;
+
+    // Effect of the item on the target
+    ItemEffect effect = {ItemEffect::Kind::Damage, 0};
+};
+
+/// <summary>
+/// Enumeration of the ways to run a game session.
+/// </summary>
+enum class ExecutionMode
+{
+    // Reading, executing and writing on the calling thread
+    Sequential,
+
+    // Reading and writing on separate threads connected with ring buffers
+    Pipelined,
+
+    // Commands touching disjoint sets of characters are executed concurrently
+    Parallel,
+
+    // Commands are executed concurrently against the current state, then applied in order
+    // or executed again if an earlier command changed what they observed
+    Speculative
+};
+
+/// <summary>
+/// Singleton class Game to represent a
+/// single game session.
+/// 
+/// Further sessions can be created and made current for a thread.
+/// </summary>
+class Game: public std::enable_shared_from_this<Game>
+{
+private:
+    // Singleton instance
+    static std::shared_ptr<Game> game;
+
+    // Session made current for the calling thread, the singleton instance if not set
+    static thread_local std::shared_ptr<Game> threadGame;
+
+    // Alive characters by ordinal
+    Roster characters;
+
+    // Ordinals of the alive characters by name, characters with equal names in the order of creation,
+    // looked up by every command and changed only by creations and deaths, so the shards are large
+    ShardedMap<std::string, std::vector<std::uint64_t>, 256> charactersByName;
+
+    // Guards the container of characters and the index of names when commands are executed concurrently
+    mutable std::shared_mutex rosterMutex;
+
+    // Alive characters ordered by health points
+    HealthIndex healthIndex;
+
+    // Numbers and health points of alive characters and numbers of their items
+    RosterStatistics statistics;
+
+    // Items of alive characters by name
+    ItemIndex itemIndex;
+
+    // Alive characters by position
+    SpatialHash spatialHash;
+
+    // Map of the obstacles and the routes across it
+    PathFinder pathFinder;
+
+    // Status effects, the free ones are reused
+    SharedIndex<std::vector<StatusEffect>> effects;
+    SharedIndex<std::vector<std::uint32_t>> freeEffects;
+
+    // Number of status effects applied so far
+    std::uint64_t appliedEffects;
+
+    // Scheduler of the turns of the status effects
+    SharedIndex<TimerWheel> effectWheel;
+
+    // Macros defined by the script by name
+    SharedIndex<std::unordered_map<std::string, Command>> macros;
+
+    // Number of macro calls in progress, bounded to stop macros calling themselves without end
+    int callDepth;
+
+    // Innermost macro call in progress whose arguments the commands of the body take, nullptr outside macros
+    const Command *arguments;
+
+    // Commands of macro bodies with the arguments in place, one per nesting of the bound commands in progress,
+    // the storage is reused by the next calls
+    std::deque<Command> boundCommands;
+
+    // Number of bound commands in progress
+    std::size_t boundDepth;
+
+    // Number of macro calls in progress at which a further call fails
+    static constexpr int maxCallDepth = 64;
+
+    // Number of alive characters from which Show characters sorts and formats them on all cores
+    static constexpr int parallelShowSize = 1 << 16;
+
+    // Input stream
+    std::ifstream input;
+
+    // Buffer of the output produced by the executed commands
+    OutputBuffer output;
+
+    // Output file stream
+    std::ofstream outputFile;
+
+    // Size of the buffered output that is written to the file at once
+    static constexpr std::size_t outputChunkSize = 1 << 16;
+
+    // Number of commands handed from the parser to the game logic at once
+    static constexpr std::size_t commandBatchSize = 256;
+
+    // Number of commands analyzed together for the parallel execution
+    static constexpr std::size_t parallelWindowSize = 4096;
+
+    // Output stream of the command executed by the current thread, the session buffer if not set
+    static thread_local OutputBuffer *commandOutput;
+
+    // Number of commands in a batch of the speculative execution
+    static constexpr std::size_t speculativeBatchSize = 1024;
+
+    // Result of the command executed speculatively by the current thread, nothing if not speculating
+    static thread_local SpeculativeResult *speculation;
+
+    // Number of characters created so far
+    std::uint64_t createdCharacters;
+
+    // Number of speculatively executed commands that had to be executed again
+    std::size_t reexecutedCommands;
+
+    // Journal of the applied commands, nothing if the session is not journaled
+    std::unique_ptr<CommandJournal> journal;
+
+    // Threads running the parallel work of the session with the calling thread, made by the first such work
+    std::unique_ptr<WorkerPool> workers;
+
+    /// <summary>
+    /// Structure to make the threads of the pool forget the session at the end of a parallel run,
+    /// the session keeps its pool and would not be destroyed otherwise.
+    /// </summary>
+    struct WorkersRelease
+    {
+        // Session owning the pool
+        Game &game;
+
+        // Destructor
+        ~WorkersRelease();
+    };
+
+    // Generation of the characters the session changes in place, zero until the session is forked
+    std::uint64_t generation;
+
+    // Number of generations handed out to forked sessions so far
+    static std::atomic<std::uint64_t> generations;
+
+    /// <summary>
+    /// Function to get Character instance from the container.
+    /// </summary>
+    /// <param name="name"> name of the character </param>
+    /// <returns> pointer to the character instance </returns>
+    std::shared_ptr<Character> getCharacterByName(std::string name) const;
+
+    /// <summary>
+    /// Displays information about alive characters in the lexicographical order of names.
+    /// </summary>
+    void showCharacters();
+
+    /// <summary>
+    /// Displays information about alive characters chosen by health points.
+    /// </summary>
+    /// <param name="command"> Show weakest, Show strongest or Show below command </param>
+    void showCharactersByHealth(const Command &command);
+
+    /// <summary>
+    /// Displays the numbers of alive characters by class, their health points and the numbers of items by kind.
+    /// </summary>
+    void showStatistics();
+
+    /// <summary>
+    /// Writes the alive characters and their inventories to a file in the columnar layout
+    /// of RosterColumn with a dictionary of the names.
+    /// </summary>
+    /// <param name="path"> path to the file, an existing file is replaced </param>
+    void exportRoster(const std::string &path);
+
+    /// <summary>
+    /// Displays information about the alive characters keeping an item with the name
+    /// in the lexicographical order of names.
+    /// </summary>
+    /// <param name="itemName"> name of the item </param>
+    void showOwners(const std::string &itemName);
+
+    /// <summary>
+    /// Displays information about the alive characters within a radius of a character
+    /// in the lexicographical order of names.
+    /// </summary>
+    /// <param name="name"> name of the character in the center </param>
+    /// <param name="radius"> radius of the circle </param>
+    void showNearby(const std::string &name, int radius);
+
+    /// <summary>
+    /// Moves a character by an offset on the grid.
+    /// </summary>
+    /// <param name="name"> name of the character </param>
+    /// <param name="dx"> horizontal offset </param>
+    /// <param name="dy"> vertical offset </param>
+    void moveCharacter(const std::string &name, int dx, int dy);
+
+    /// <summary>
+    /// Moves a character to a square of the map along the shortest route around the obstacles.
+    /// </summary>
+    /// <param name="name"> name of the character </param>
+    /// <param name="x"> column of the destination </param>
+    /// <param name="y"> row of the destination </param>
+    void moveCharacterTo(const std::string &name, int x, int y);
+
+    /// <summary>
+    /// Creates a character of the given type.
+    /// </summary>
+    /// <param name="type"> fighter, archer or wizard </param>
+    /// <param name="name"> name of the character </param>
+    /// <param name="healthPoints"> initial health points </param>
+    /// <returns> pointer to the new character instance </returns>
+    static std::shared_ptr<Character> makeCharacter(const std::string &type, const std::string &name, int healthPoints);
+
+    /// <summary>
+    /// Replaces a character shared with a forked session by a copy of its own in the roster
+    /// and the indexes, the caller holds the roster lock exclusively.
+    /// </summary>
+    /// <param name="character"> pointer to the shared character instance </param>
+    void privatize(std::shared_ptr<Character> character);
+
+    /// <summary>
+    /// Replaces the shared characters a command changes by copies of their own.
+    /// </summary>
+    /// <param name="command"> parsed command </param>
+    void privatizeWrites(const Command &command);
+
+    /// <summary>
+    /// Inserts a new character into the container and the indexes,
+    /// the caller holds the roster lock exclusively.
+    /// </summary>
+    /// <param name="character"> pointer to the character instance </param>
+    void addCharacter(std::shared_ptr<Character> character);
+
+    /// <summary>
+    /// Creates a weapon or a potion and hands it to its owner.
+    /// </summary>
+    /// <param name="kind"> CreateWeapon or CreatePotion </param>
+    /// <param name="ownerName"> name of the owner </param>
+    /// <param name="itemName"> name of the item </param>
+    /// <param name="value"> damage or heal value </param>
+    void createItem(CommandKind kind, const std::string &ownerName, const std::string &itemName, int value);
+
+    /// <summary>
+    /// Puts a status effect on a character.
+    /// </summary>
+    /// <param name="command"> Apply command </param>
+    void applyEffect(const Command &command);
+
+    /// <summary>
+    /// Passes the given number of ticks, acting with the status effects that come due.
+    /// </summary>
+    /// <param name="ticks"> number of ticks </param>
+    void tick(int ticks);
+
+    /// <summary>
+    /// Acts with a status effect that came due and schedules its next turn.
+    /// </summary>
+    /// <param name="id"> number of the effect </param>
+    /// <param name="now"> current tick </param>
+    void fireEffect(std::uint32_t id, std::uint64_t now);
+
+    /// <summary>
+    /// Applies a single command to the game.
+    /// </summary>
+    /// <param name="command"> parsed command </param>
+    void executeCommand(const Command &command);
+
+    /// <summary>
+    /// Applies a single command to the game, collecting its output separately.
+    /// </summary>
+    /// <param name="command"> parsed command </param>
+    /// <param name="text"> receiver of the output of the command </param>
+    void executeCommandInto(const Command &command, std::string &text);
+
+    /// <summary>
+    /// Appends an applied command to the journal if it changes the game.
+    /// </summary>
+    /// <param name="command"> applied command </param>
+    void recordCommand(const Command &command);
+
+    /// <summary>
+    /// Moves the buffered output out of the game.
+    /// </summary>
+    /// <returns> text produced since the previous call </returns>
+    std::string takeOutput();
+
+    /// <summary>
+    /// Writes text to the output file.
+    /// </summary>
+    /// <param name="text"> text to write </param>
+    void writeOutput(const std::string &text);
+
+    /// <summary>
+    /// Reads, executes and writes the given number of commands on the calling thread.
+    /// </summary>
+    /// <param name="count"> number of commands </param>
+    void runSequential(int count);
+
+    /// <summary>
+    /// Executes the given number of commands on the calling thread while
+    /// a parser thread reads them and a writer thread writes the output.
+    /// </summary>
+    /// <param name="count"> number of commands </param>
+    void runPipelined(int count);
+
+    /// <summary>
+    /// Reads the given number of commands in windows and executes the commands of a window
+    /// that touch disjoint sets of characters concurrently, keeping the order of the output.
+    /// </summary>
+    /// <param name="count"> number of commands </param>
+    void runParallel(int count);
+
+    /// <summary>
+    /// Executes a command without changing the game, recording what it observed
+    /// and the effect it has.
+    /// </summary>
+    /// <param name="command"> parsed command </param>
+    /// <param name="result"> receiver of the speculative result </param>
+    void speculateCommand(const Command &command, SpeculativeResult &result);
+
+    /// <summary>
+    /// Reads the given number of commands in batches, executes the commands of a batch speculatively
+    /// in parallel and then applies them in order, executing again the ones whose observations changed.
+    /// </summary>
+    /// <param name="count"> number of commands </param>
+    void runSpeculative(int count);
+
+    /// <summary>
+    /// Getter for the pool of threads of the session, made on the first call with a thread per core.
+    /// </summary>
+    /// <returns> reference to the pool, the calling thread runs the jobs with its threads </returns>
+    WorkerPool &getWorkers();
+
+    // Private constructors
+    Game();
+
+    Game(const std::string &inputPath, const std::string &outputPath);
+
+    // Constructor of a forked session, the caller holds the roster lock of the base session
+    Game(const Game &base);
+public:
+
+    // Allows BattleSimulator class to play fights with the commands of a session
+    friend class BattleSimulator;
+
+    // Allows CommandIngestion class to execute the commands of the players
+    friend class CommandIngestion;
+
+    // Destructor
+    ~Game();
+
+    /// <summary>
+    /// Entry point of the game.
+    /// Deals with reading input and processing commands.
+    /// </summary>
+    /// <param name="mode"> the way to run the session </param>
+    void startNewGame(ExecutionMode mode = ExecutionMode::Pipelined);
+
+    /// <summary>
+    /// Instance getter.
+    /// </summary>
+    /// <returns> pointer to the Game instance </returns>
+    static std::shared_ptr<Game> currentGame();
+
+    /// <summary>
+    /// Replays the commands of a journal, then appends the commands applied
+    /// by this session to it.
+    /// </summary>
+    /// <param name="path"> path to the journal file </param>
+    /// <param name="groupSize"> number of commands that triggers a group commit </param>
+    /// <param name="groupInterval"> longest time a command waits for a group commit </param>
+    void enableJournal(const std::string &path, std::size_t groupSize, std::chrono::milliseconds groupInterval);
+
+    /// <summary>
+    /// Getter for the speculative result of the command executed by the current thread.
+    /// </summary>
+    /// <returns> pointer to the result if the command is executed speculatively else nullptr </returns>
+    static SpeculativeResult *currentSpeculation();
+
+    /// <summary>
+    /// Getter for the number of speculatively executed commands that had to be executed again.
+    /// </summary>
+    /// <returns> number of executed again commands </returns>
+    std::size_t getReexecutedCommands() const;
+
+    /// <summary>
+    /// Creates a session that is not bound to files and keeps its state between scripts.
+    /// </summary>
+    /// <returns> pointer to the new Game instance </returns>
+    static std::shared_ptr<Game> newSession();
+
+    /// <summary>
+    /// Creates a session that reads the script from a file and writes the output to a file.
+    /// </summary>
+    /// <param name="inputPath"> path to the script </param>
+    /// <param name="outputPath"> path to the output </param>
+    /// <returns> pointer to the new Game instance </returns>
+    static std::shared_ptr<Game> newSession(const std::string &inputPath, const std::string &outputPath);
+
+    /// <summary>
+    /// Creates a session that continues from the state of this one. The sessions share the characters,
+    /// their items, the indexes of the roster, the status effects, the macros and the map. A session copies
+    /// a shared character before a command changes it, together with the chunks of the indexes that hold it,
+    /// so a fork itself takes constant time and a session copies in proportion to the characters it changes.
+    /// Both sessions are executed with executeScript afterwards.
+    /// </summary>
+    /// <returns> pointer to the new Game instance </returns>
+    std::shared_ptr<Game> fork();
+
+    /// <summary>
+    /// Makes a session current for the calling thread.
+    /// </summary>
+    /// <param name="session"> pointer to the Game instance, nullptr to return to the singleton instance </param>
+    static void makeCurrent(const std::shared_ptr<Game> &session);
+
+    /// <summary>
+    /// Sends the output of the commands executed on the calling thread to a buffer instead of the session.
+    /// </summary>
+    /// <param name="buffer"> pointer to the buffer, nullptr to write to the session again </param>
+    static void redirectOutput(OutputBuffer *buffer);
+
+    /// <summary>
+    /// Executes a script against the session.
+    /// </summary>
+    /// <param name="script"> stream with the number of commands followed by the commands </param>
+    /// <param name="text"> receiver of the output of the script </param>
+    /// <returns> true if the script was executed completely, false if it stopped at a malformed command
+    /// or a command that failed, such as one running out of memory </returns>
+    bool executeScript(std::istream &script, std::string &text);
+
+    /// <summary>
+    /// Replaces the current game session with a new one.
+    /// </summary>
+    /// <param name="inputPath"> path to the script </param>
+    /// <param name="outputPath"> path to the output file </param>
+    /// <returns> pointer to the new Game instance </returns>
+    static std::shared_ptr<Game> resetGame(const std::string &inputPath, const std::string &outputPath);
+
+    /// <summary>
+    /// Procedure to remove a character from the game.
+    /// </summary>
+    /// <param name="ptr"> pointer to the character instance </param>
+    void destroyCharacter(std::shared_ptr<Character> ptr);
+
+    /// <summary>
+    /// Procedure to move a character to its new health points in the health index.
+    /// </summary>
+    /// <param name="character"> reference to the character instance </param>
+    /// <param name="previousHealth"> health points of the character before the change </param>
+    void reindexHealth(const Character &character, int previousHealth);
+
+    /// <summary>
+    /// Procedure to remove an item destroyed after use from the item index.
+    /// </summary>
+    /// <param name="item"> reference to the item instance </param>
+    void unindexItem(const PhysicalItem &item);
+
+    /// <summary>
+    /// Procedure to count the change of the items of a character in the statistics.
+    /// </summary>
+    /// <param name="character"> reference to the character instance </param>
+    /// <param name="before"> numbers of the items of the character before the change </param>
+    void recountItems(const Character &character, const ItemCounts &before);
+
+    /// <summary>
+    /// Getter for the output stream.
+    /// </summary>
+    /// <returns> the reference to the output stream </returns>
+    OutputBuffer &getOutput();
+};
+
+// Container for Physical Items Methods
+
+template<DerivedFromPhysicalItem T>
+Container<T>::Container()
+    : map()
+{}
+
+template<DerivedFromPhysicalItem T>
+Container<T>::~Container()
+{
+
+    // Destroying elements stored in the container
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        auto &itemPtr = it->second;
+        itemPtr.reset();
+    }
+}
+
+template<DerivedFromPhysicalItem T>
+int Container<T>::size() const
+{
+    return map.size();
+}
+
+template<DerivedFromPhysicalItem T>
+void Container<T>::addItem(std::shared_ptr<T> newItem)
+{
+    map.insert(std::make_pair(newItem->getName(), newItem));
+}
+
+template<DerivedFromPhysicalItem T>
+void Container<T>::removeItem(const std::string &itemName)
+{
+    if (map.erase(itemName) == 0) {
+        throw ElementNotFound();
+    }
+}
+
+template<DerivedFromPhysicalItem T>
+bool Container<T>::find(const std::string &itemName) const
+{
+    return map.contains(itemName);
+}
+
+template<DerivedFromPhysicalItem T>
+std::shared_ptr<T> Container<T>::get(const std::string &itemName) const
+{
+    auto result = map.find(itemName);
+    if (result == map.end()) {
+        throw ElementNotFound();
+    }
+    return result->second;
+}
+
+template<DerivedFromPhysicalItem T>
+void Container<T>::rebind(const std::shared_ptr<Character> &owner, ItemCopies &copiedItems)
+{
+    for (auto &entry: map) {
+        auto copy = std::static_pointer_cast<T>(entry.second->clone(owner));
+        copiedItems.emplace_back(entry.second, copy);
+        entry.second = std::move(copy);
+    }
+}
+
+template<DerivedFromPhysicalItem T>
+std::vector<std::shared_ptr<T>> Container<T>::getElements() const
+{
+    std::vector<std::shared_ptr<T>> result;
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        result.push_back(it->second);
+    }
+    return result;
+}
+
+template<DerivedFromPhysicalItem T>
+auto Container<T>::view() const
+{
+    return map | std::views::values | std::views::transform([](const std::shared_ptr<T> &item) -> T &
+    {
+        return *item;
+    });
+}
+
+template<DerivedFromPhysicalItem T>
+template<typename Visit>
+void Container<T>::visitSorted(Visit &&visit) const
+{
+    visitInAscendingOrder<T>(view(), visit);
+}
+
+// Container with Max Capacity Methods
+
+template<ComparableAndPrintable T>
+ContainerWithMaxCapacity<T>::ContainerWithMaxCapacity(int maxCapacity)
+    : Container<T>(), maxCapacity(maxCapacity)
+{}
+
+template<ComparableAndPrintable T>
+ContainerWithMaxCapacity<T>::~ContainerWithMaxCapacity() = default;
+
+template<ComparableAndPrintable T>
+void ContainerWithMaxCapacity<T>::addItem(std::shared_ptr<T> newItem)
+{
+
+    // Additional check for available space
+    if (this->size() == maxCapacity) {
+        throw FullContainer();
+    }
+    this->Container<T>::addItem(newItem);
+}
+
+template<ComparableAndPrintable T>
+void ContainerWithMaxCapacity<T>::show() const
+{
+
+    // Instance of the game
+    auto game = Game::currentGame();
+    OutputBuffer &out = sysout;
+
+    // Printing elements in the sorted order
+    this->visitSorted([&](const T &element)
+    {
+        element.print(out);
+    });
+    out << '\n';
+}
+
+// Character Methods
+
+void Character::takeDamage(int damage)
+{
+    int previousHealth = healthPoints;
+    healthPoints -= damage;
+
+    auto game = Game::currentGame();
+    game->reindexHealth(*this, previousHealth);
+
+    // Check whether a character is alive
+    if (healthPoints <= 0) {
+
+        // Remove dead character from the game
+        game->destroyCharacter(this->shared_from_this());
+    }
+}
+
+void Character::heal(int healValue)
+{
+    int previousHealth = healthPoints;
+    healthPoints += healValue;
+
+    Game::currentGame()->reindexHealth(*this, previousHealth);
+}
+
+Character::Character(const std::string nameString, int healthValue)
+    : name(nameString), healthPoints(healthValue), version(0), ordinal(0), isAlive(true), damageBonus(0), x(0), y(0),
+      generation(0)
+{}
+
+Character::~Character() = default;
+
+const std::string &Character::getName() const
+{
+    return name;
+}
+
+int Character::getHp() const
+{
+    return healthPoints;
+}
+
+int Character::getDamageBonus() const
+{
+    return damageBonus;
+}
+
+bool Character::operator>(const Character &other) const
+{
+    // Lexicographical comparison, characters with equal names in the order of creation
+    int order = name.compare(other.getName());
+    return (order != 0) ? (order > 0) : (ordinal > other.ordinal);
+}
+
+bool Character::operator<(const Character &other) const
+{
+    // Lexicographical comparison, characters with equal names in the order of creation
+    int order = name.compare(other.getName());
+    return (order != 0) ? (order < 0) : (ordinal < other.ordinal);
+}
+
+/// <summary>
+/// Abstract class PhysicalItem represents an item that
+/// a character can store or use during the game session.
+/// 
+/// The class enables creating shared pointers from an instance.
+/// </summary>
+class PhysicalItem: public std::enable_shared_from_this<PhysicalItem>
+{
+private:
+    // States whether an item cannot be used more than once
+    bool isUsableOnce;
+
+    // Name of an item
+    std::string name;
+protected:
+
+    // Allows ItemIndex class to access the name and the owner of an item
+    friend class ItemIndex;
+
+    // The owner of an item
+    std::shared_ptr<Character> owner;
+
+    /// <summary>
+    /// Getter for the owner.
+    /// </summary>
+    /// <returns> pointer to the character instance </returns>
+    std::shared_ptr<Character> getOwner() const
+    {
+        return owner;
+    }
+
+    /// <summary>
+    /// Determines whether two characters are the same, a character and its copies made for forked sessions are.
+    /// </summary>
+    /// <param name="first"> first character </param>
+    /// <param name="second"> second character </param>
+    /// <returns> true if the characters are the same else false </returns>
+    static bool isSameCharacter(const Character &first, const Character &second)
+    {
+        return first.ordinal == second.ordinal;
+    }
+
+    /// <summary>
+    /// Handles checks for the use of an item.
+    /// </summary>
+    /// <param name="user"> owner of the item </param>
+    /// <param name="target"> target to use item on </param>
+    void useCondition(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target)
+    {
+
+        // Owner check
+        if (user != owner) {
+            throw CharacterDoesNotOwnItem();
+        }
+
+        // Reporting the use of the item
+        ItemEffect effect = useLogic(user, target);
+
+        // Speculative execution applies the effect later, if the command turns out to be valid
+        auto speculation = Game::currentSpeculation();
+        if (speculation != nullptr) {
+            speculation->item = this->shared_from_this();
+            speculation->target = target;
+            speculation->effect = effect;
+            return;
+        }
+
+        // Applying item
+        commitUse(target, effect);
+    }
+
+    /// <summary>
+    /// Abstract function to report the use of an item of a user on a target
+    /// and determine its effect without applying it.
+    /// </summary>
+    /// <param name="user">owner of the item</param>
+    /// <param name="target">target to use item on</param>
+    /// <returns> the effect of the item on the target </returns>
+    virtual ItemEffect useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const = 0;
+
+    /// <summary>
+    /// Deals with item destruction after use.
+    /// </summary>
+    void afterUse()
+    {
+        ++owner->version;
+
+        // An owner killed by its own item already dropped its items
+        if (owner->isAlive) {
+            ItemCounts items = owner->countItems();
+            owner->loseItem(this->shared_from_this());
+            auto game = Game::currentGame();
+            game->recountItems(*owner, items);
+            game->unindexItem(*this);
+        }
+    }
+
+    /// <summary>
+    /// Deals with giving damage to a given character.
+    /// </summary>
+    /// <param name="to"> receiver of damage </param>
+    /// <param name="damage"> damage value </param>
+    void giveDamageTo(const std::shared_ptr<Character> to, int damage) const
+    {
+        to->takeDamage(damage);
+    }
+
+    /// <summary>
+    /// Deals with healing a given character.
+    /// </summary>
+    /// <param name="to"> receiver of heal</param>
+    /// <param name="heal"> heal value </param>
+    void giveHealTo(const std::shared_ptr<Character> to, int heal) const
+    {
+        to->heal(heal);
+    }
+public:
+
+    // Constructor
+    PhysicalItem(bool isUsableOnce, const std::shared_ptr<Character> owner, const std::string name)
+        : isUsableOnce(isUsableOnce), name(name), owner(owner)
+    {}
+
+    // Destructor
+    virtual ~PhysicalItem() = default;
+
+    /// <summary>
+    /// Abstract function that copies an item for a copy of its owner.
+    /// </summary>
+    /// <param name="newOwner"> pointer to the owner of the copy </param>
+    /// <returns> pointer to the copy </returns>
+    virtual std::shared_ptr<PhysicalItem> clone(std::shared_ptr<Character> newOwner) const = 0;
+
+    /// <summary>
+    /// Applies the effect of the item on a target and destroys the item if it is usable once.
+    /// </summary>
+    /// <param name="target"> target to use item on </param>
+    /// <param name="effect"> effect determined by useLogic </param>
+    void commitUse(std::shared_ptr<Character> target, const ItemEffect &effect)
+    {
+        switch (effect.kind) {
+            case ItemEffect::Kind::Damage:
+                giveDamageTo(target, effect.amount);
+                break;
+            case ItemEffect::Kind::Heal:
+                giveHealTo(target, effect.amount);
+                break;
+            case ItemEffect::Kind::Kill:
+                giveDamageTo(target, target->getHp());
+                break;
+        }
+
+        // Destroying an item after use
+        if (isUsableOnce) {
+            afterUse();
+        }
+    }
+
+    /// <summary>
+    /// Function that provides the use of an item.
+    /// </summary>
+    /// <param name="user"> owner of the item </param>
+    /// <param name="target"> target to use item on </param>
+    void use(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target)
+    {
+        TraceSpan span("use item", user->name, target->name);
+        useCondition(user, target);
+    }
+
+    /// <summary>
+    /// Getter for the name.
+    /// </summary>
+    /// <returns> name of the item </returns>
+    const std::string &getName() const
+    {
+        return name;
+    }
+
+    /// <summary>
+    /// Operator to compare two PhysicalItems.
+    /// </summary>
+    /// <param name="other">comparing item</param>
+    /// <returns> true if the compared item is bigger than the comparing item </returns>
+    bool operator>(const PhysicalItem &other) const
+    {
+        return (name.compare(other.getName()) > 0);
+    }
+
+    /// <summary>
+    /// Operator to compare two PhysicalItems.
+    /// </summary>
+    /// <param name="other">comparing item</param>
+    /// <returns> true if the compared item is less than the comparing item </returns>
+    bool operator<(const PhysicalItem &other) const
+    {
+        return (name.compare(other.getName()) < 0);
+    }
+
+    /// <summary>
+    /// Abstract function to print information about an item
+    /// to the output stream.
+    /// </summary>
+    /// <param name="out"> reference to the output stream</param>
+    virtual void print(OutputBuffer &out) const = 0;
+};
+
+/// <summary>
+/// Class Weapon inherits from PhysicalItem and
+/// represents an item that can give damage to
+/// characters.
+/// </summary>
+class Weapon: public PhysicalItem
+{
+private:
+    int damage;
+
+    /// <summary>
+    /// Implementation of the abstract function that
+    /// gives damage to target.
+    /// </summary>
+    /// <param name="user"> attacker</param>
+    /// <param name="target"> receiver of damage </param>
+    ItemEffect useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
+    {
+        auto game = Game::currentGame();
+        sysout << user->getName() << " attacks " << target->getName() << " with their " << getName() << "!\n";
+        return {ItemEffect::Kind::Damage, getDamage() + user->getDamageBonus()};
+    }
+public:
+
+    // Constructor
+    Weapon(const std::shared_ptr<Character> owner, const std::string name, int damage)
+        : PhysicalItem(false, owner, name), damage(damage)
+    {
+
+        // Check for legal damage value
+        if (damage <= 0) {
+            throw IllegalDamageValue();
+        }
+    }
+
+    // Destructor
+    ~Weapon() = default;
+
+    /// <summary>
+    /// Implementation of the abstract function that copies an item for a copy of its owner.
+    /// </summary>
+    /// <param name="newOwner"> pointer to the owner of the copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<PhysicalItem> clone(std::shared_ptr<Character> newOwner) const override
+    {
+        auto copy = std::make_shared<Weapon>(*this);
+        copy->owner = std::move(newOwner);
+        return copy;
+    }
+
+    /// <summary>
+    /// Getter for damage value.
+    /// </summary>
+    /// <returns> damage value </returns>
+    int getDamage() const
+    {
+        return damage;
+    }
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":" << getDamage() << " ";
+    }
+
+};
+
+/// <summary>
+/// Class Potion inherits from PhysicalItem and
+/// represents an item that can heal characters.
+/// </summary>
+class Potion: public PhysicalItem
+{
+private:
+    int healValue;
+
+    /// <summary>
+    /// Implementation of the abstract function that
+    /// heals target.
+    /// </summary>
+    /// <param name="user">healer</param>
+    /// <param name="target">receiver of heal</param>
+    ItemEffect useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
+    {
+        auto game = Game::currentGame();
+        sysout << target->getName() << " drinks " << getName() << " from " << user->getName() << ".\n";
+        return {ItemEffect::Kind::Heal, getHealValue()};
+    }
+public:
+
+    // Constructor
+    Potion(const std::shared_ptr<Character> owner, const std::string name, int healValue)
+        : PhysicalItem(true, owner, name), healValue(healValue)
+    {
+        if (healValue <= 0) {
+            throw IllegalHealthValue();
+        }
+    }
+
+    // Destructor
+    ~Potion() = default;
+
+    /// <summary>
+    /// Implementation of the abstract function that copies an item for a copy of its owner.
+    /// </summary>
+    /// <param name="newOwner"> pointer to the owner of the copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<PhysicalItem> clone(std::shared_ptr<Character> newOwner) const override
+    {
+        auto copy = std::make_shared<Potion>(*this);
+        copy->owner = std::move(newOwner);
+        return copy;
+    }
+
+    /// <summary>
+    /// Getter for health value.
+    /// </summary>
+    /// <returns> heal value </returns>
+    int getHealValue() const
+    {
+        return healValue;
+    }
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":" << getHealValue() << " ";
+    }
+};
+
+/// <summary>
+/// Class Spell inherits from PhysicalItem and
+/// represents an item that kill characters.
+/// </summary>
+class Spell: public PhysicalItem
+{
+private:
+
+    // List of instances that a spell can be cast on
+    std::vector<std::shared_ptr<Character>> allowedTargets;
+
+    /// <summary>
+    /// Implementation of the abstract function that
+    /// casts a spell on target.
+    /// </summary>
+    /// <param name="user"> caster </param>
+    /// <param name="target"> target to cast spell on</param>
+    ItemEffect useLogic(const std::shared_ptr<const Character> user, std::shared_ptr<Character> target) const override
+    {
+        for (auto &allowedTarget: allowedTargets) {
+            if (isSameCharacter(*allowedTarget, *target)) {
+                auto game = Game::currentGame();
+                sysout << user->getName() << " casts " << getName() << " on " << target->getName() << "!\n";
+                return {ItemEffect::Kind::Kill, 0};
+            }
+        }
+
+        throw NotAllowedTarget();
+    }
+public:
+
+    // Constructor
+    Spell(const std::shared_ptr<Character> owner,
+          const std::string name,
+          const std::vector<std::shared_ptr<Character>> &allowedTargets)
+        : PhysicalItem(true, owner, name), allowedTargets(allowedTargets)
+    {}
+
+    // Destructor
+    ~Spell() = default;
+
+    /// <summary>
+    /// Implementation of the abstract function that copies an item for a copy of its owner.
+    /// </summary>
+    /// <param name="newOwner"> pointer to the owner of the copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<PhysicalItem> clone(std::shared_ptr<Character> newOwner) const override
+    {
+        auto copy = std::make_shared<Spell>(*this);
+        copy->owner = std::move(newOwner);
+        return copy;
+    }
+
+    /// <summary>
+    /// Getter for the number of allowed targets.
+    /// </summary>
+    /// <returns> number of allowed targets </returns>
+    int getNumAllowedTargets() const
+    {
+        return allowedTargets.size();
+    }
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":" << getNumAllowedTargets() << " ";
+    }
+};
+
+// Item Index Methods
+
+ItemIndex::ItemIndex(const ItemIndex &other)
+    : items()
+{
+    std::lock_guard<std::mutex> lock(other.mutex);
+    items = other.items;
+    sharedNames = other.sharedNames;
+}
+
+void ItemIndex::insert(std::shared_ptr<PhysicalItem> item)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::uint64_t owner = item->owner->ordinal;
+    auto named = items.find(item->name);
+    auto owned = (named != nullptr) ? named->find(owner) : nullptr;
+    if (owned != nullptr) {
+        for (auto &other: *owned) {
+            if (typeid(*other) == typeid(*item)) {
+                return;
+            }
+        }
+        if (!sharedNames->contains(item->name)) {
+            sharedNames.detach();
+            sharedNames->insert(item->name);
+        }
+    }
+    items[item->name][owner].push_back(std::move(item));
+}
+
+void ItemIndex::erase(const PhysicalItem &item)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto named = items.find(item.name);
+    auto owned = (named != nullptr) ? named->find(item.owner->ordinal) : nullptr;
+    if (owned == nullptr) {
+        return;
+    }
+
+    auto other = std::find_if(owned->begin(), owned->end(), [&](const std::shared_ptr<PhysicalItem> &other)
+    {
+        return other.get() == &item;
+    });
+    if (other == owned->end()) {
+        return;
+    }
+
+    auto &writableNamed = *items.findWritable(item.name);
+    auto &writableOwned = *writableNamed.findWritable(item.owner->ordinal);
+    writableOwned.erase(writableOwned.begin() + (other - owned->begin()));
+    if (writableOwned.empty()) {
+        writableNamed.erase(item.owner->ordinal);
+        if (writableNamed.empty()) {
+            items.erase(item.name);
+        }
+    }
+}
+
+std::shared_ptr<PhysicalItem> ItemIndex::find(const std::string &itemName, const Character &owner) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto named = items.find(itemName);
+    auto owned = (named != nullptr) ? named->find(owner.ordinal) : nullptr;
+
+    // Several items with the name cannot be told apart
+    if (owned == nullptr || owned->size() != 1) {
+        return nullptr;
+    }
+    return owned->front();
+}
+
+bool ItemIndex::owns(const std::string &itemName, const Character &owner) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto named = items.find(itemName);
+    return (named != nullptr && named->find(owner.ordinal) != nullptr);
+}
+
+void ItemIndex::replaceOwner(const Character &owner, const std::shared_ptr<Character> &copy, const ItemCopies &copiedItems)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[item, itemCopy]: copiedItems) {
+        auto named = items.find(item->name);
+        auto owned = (named != nullptr) ? named->find(owner.ordinal) : nullptr;
+        if (owned == nullptr || std::find(owned->begin(), owned->end(), item) == owned->end()) {
+            continue;
+        }
+
+        auto &writableOwned = *(*items.findWritable(item->name)).findWritable(owner.ordinal);
+        *std::find(writableOwned.begin(), writableOwned.end(), item) = itemCopy;
+    }
+
+    // Items left in the index without a container can only have a shared name, they still belong to the owner
+    for (auto &name: *sharedNames) {
+        auto named = items.find(name);
+        auto owned = (named != nullptr) ? named->find(owner.ordinal) : nullptr;
+        if (owned == nullptr || std::none_of(owned->begin(), owned->end(), [&](const std::shared_ptr<PhysicalItem> &item)
+        {
+            return item->owner.get() == &owner;
+        })) {
+            continue;
+        }
+
+        for (auto &item: *(*items.findWritable(name)).findWritable(owner.ordinal)) {
+            if (item->owner.get() == &owner) {
+                item = item->clone(copy);
+            }
+        }
+    }
+}
+
+void ItemIndex::transfer(const std::shared_ptr<PhysicalItem> &item, std::shared_ptr<Character> newOwner)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &named = items[item->name];
+    auto owned = named.findWritable(item->owner->ordinal);
+    if (owned != nullptr) {
+        auto other = std::find(owned->begin(), owned->end(), item);
+        if (other != owned->end()) {
+            owned->erase(other);
+            if (owned->empty()) {
+                named.erase(item->owner->ordinal);
+            }
+        }
+    }
+
+    item->owner = std::move(newOwner);
+    named[item->owner->ordinal].push_back(item);
+}
+
+std::vector<std::shared_ptr<Character>> ItemIndex::getOwners(const std::string &itemName) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::shared_ptr<Character>> owners;
+    auto named = items.find(itemName);
+    if (named != nullptr) {
+
+        // Items of the same owner share an entry
+        named->visit([&](std::uint64_t, const std::vector<std::shared_ptr<PhysicalItem>> &owned)
+        {
+            owners.push_back(owned.front()->owner);
+        });
+    }
+    return owners;
+}
+
+// Bindings of the Containers
+
+using Arsenal = ContainerWithMaxCapacity<Weapon>;
+using MedicalBag = ContainerWithMaxCapacity<Potion>;
+using SpellBook = ContainerWithMaxCapacity<Spell>;
+
+/// <summary>
+/// Class WeaponUser represents a character that is
+/// able to use weapons.
+/// </summary>
+class WeaponUser: virtual public Character
+{
+protected:
+
+    // Arsenal of weapons
+    Arsenal arsenal;
+public:
+
+    // Constructor
+    WeaponUser(const std::string nameString, int healthValue, int capacity)
+        : Character(nameString, healthValue), arsenal(capacity)
+    {}
+
+    // Destructor
+    ~WeaponUser() = default;
+
+    /// <summary>
+    /// Abstract function to get the farthest distance of an attack.
+    /// </summary>
+    /// <returns> range of the attack </returns>
+    virtual int getAttackRange() const = 0;
+
+    /// <summary>
+    /// The function implements attack on the given character.
+    /// </summary>
+    /// <param name="target">receiver of damage</param>
+    /// <param name="weaponName">name of the weapon</param>
+    void attack(std::shared_ptr<Character> target, const std::string &weaponName)
+    {
+        try {
+            auto item = arsenal.get(weaponName);
+            item->use(this->shared_from_this(), target);
+        }
+        catch (const ElementNotFound &) {
+            throw CharacterDoesNotOwnItem();
+        }
+    }
+
+    /// <summary>
+    /// Displays all weapons in the arsenal.
+    /// </summary>
+    void showWeapons() const
+    {
+        arsenal.show();
+    }
+
+    /// <summary>
+    /// Getter for the arsenal.
+    /// </summary>
+    /// <returns> container of the weapons </returns>
+    const Arsenal &getArsenal() const
+    {
+        return arsenal;
+    }
+};
+
+/// <summary>
+/// Class PotionUser represents a character that is
+/// able to use potions.
+/// </summary>
+class PotionUser: virtual public Character
+{
+protected:
+
+    // Container of potions
+    MedicalBag medicalBag;
+public:
+
+    // Constructor
+    PotionUser(const std::string nameString, int healthValue, int capacity)
+        : Character(nameString, healthValue), medicalBag(capacity)
+    {}
+
+    // Destructor
+    ~PotionUser() = default;
+
+    /// <summary>
+    /// The function implements drinking of a potion by a target.
+    /// </summary>
+    /// <param name="target">receiver of heal</param>
+    /// <param name="potionName">name of the potion</param>
+    void drink(std::shared_ptr<Character> target, const std::string &potionName)
+    {
+        try {
+            auto item = medicalBag.get(potionName);
+            item->use(this->shared_from_this(), target);
+        }
+        catch (const ElementNotFound &) {
+            throw CharacterDoesNotOwnItem();
+        }
+    }
+
+    /// <summary>
+    /// Displays all potions in the medicalBag.
+    /// </summary>
+    void showPotions() const
+    {
+        medicalBag.show();
+    }
+
+    /// <summary>
+    /// Getter for the medicalBag.
+    /// </summary>
+    /// <returns> container of the potions </returns>
+    const MedicalBag &getMedicalBag() const
+    {
+        return medicalBag;
+    }
+};
+
+/// <summary>
+/// Class SpellUser represents a character that is
+/// able to cast spells.
+/// </summary>
+class SpellUser: virtual public Character
+{
+protected:
+
+    // Container of spells
+    SpellBook spellBook;
+public:
+
+    // Constructor
+    SpellUser(const std::string nameString, int healthValue, int capacity)
+        : Character(nameString, healthValue), spellBook(capacity)
+    {}
+
+    // Destructor
+    ~SpellUser() = default;
+
+    /// <summary>
+    /// Abstract function to get the farthest distance of a cast.
+    /// </summary>
+    /// <returns> range of the cast </returns>
+    virtual int getCastRange() const = 0;
+
+    /// <summary>
+    /// The function implements cast on a target.
+    /// </summary>
+    /// <param name="target"> target to cast spell on</param>
+    /// <param name="spellName"> name of the spell</param>
+    void cast(std::shared_ptr<Character> target, const std::string &spellName)
+    {
+        try {
+            auto item = spellBook.get(spellName);
+            item->use(this->shared_from_this(), target);
+        }
+        catch (const ElementNotFound &) {
+            throw CharacterDoesNotOwnItem();
+        }
+    }
+
+    /// <summary>
+    /// Displays all spells from the spellBook.
+    /// </summary>
+    void showSpells() const
+    {
+        spellBook.show();
+    }
+
+    /// <summary>
+    /// Getter for the spellBook.
+    /// </summary>
+    /// <returns> container of the spells </returns>
+    const SpellBook &getSpellBook() const
+    {
+        return spellBook;
+    }
+};
+
+/// <summary>
+/// Class Fighter represents a character that can
+/// use weapons and potions.
+/// </summary>
+class Fighter: public WeaponUser, public PotionUser
+{
+protected:
+
+    /// <summary>
+    /// Implementation of the abstract function that inserts the item
+    /// into either the arsenal or the medicalBag.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    void obtainItem(std::shared_ptr<PhysicalItem> item) override
+    {
+
+        // Cast of item to Weapon
+        if (dynamic_cast<Weapon *>(item.get())) {
+            auto weapon = std::dynamic_pointer_cast<Weapon>(item);
+            arsenal.addItem(weapon);
+        }
+            // Cast of item to Potion
+        else if (dynamic_cast<Potion *>(item.get())) {
+            auto potion = std::dynamic_pointer_cast<Potion>(item);
+            medicalBag.addItem(potion);
+        }
+            // Element cannot be used by a fighter
+        else {
+            throw IllegalItemType();
+        }
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that removes the item
+    /// from either the arsenal or the medicalBag.
+    /// </summary>
+    /// <param name="item"> pointer to the item</param>
+    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    {
+
+        // Find the item in the arsenal
+        if (arsenal.find(item->getName())) {
+            arsenal.removeItem(item->getName());
+        }
+            // Find the item in the medicalBag
+        else {
+            medicalBag.removeItem(item->getName());
+        }
+
+        // Release data
+        item.reset();
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that lists the items
+    /// of the arsenal and the medicalBag.
+    /// </summary>
+    /// <returns> pointers to the items </returns>
+    std::vector<std::shared_ptr<PhysicalItem>> getItems() const override
+    {
+        std::vector<std::shared_ptr<PhysicalItem>> items;
+        for (Weapon &weapon: arsenal.view()) {
+            items.push_back(weapon.shared_from_this());
+        }
+        for (Potion &potion: medicalBag.view()) {
+            items.push_back(potion.shared_from_this());
+        }
+        return items;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that counts the items
+    /// of the arsenal and the medicalBag.
+    /// </summary>
+    /// <returns> numbers of the weapons, the potions and the spells </returns>
+    ItemCounts countItems() const override
+    {
+        return {arsenal.size(), medicalBag.size(), 0};
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that tells the class of the character.
+    /// </summary>
+    /// <returns> 0 for a fighter </returns>
+    int getClass() const override
+    {
+        return 0;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that copies the character
+    /// together with the items of the arsenal and the medicalBag.
+    /// </summary>
+    /// <param name="copiedItems"> receiver of the pairs of an item and its copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<Character> clone(ItemCopies &copiedItems) const override
+    {
+        auto copy = std::make_shared<Fighter>(*this);
+        copy->arsenal.rebind(copy, copiedItems);
+        copy->medicalBag.rebind(copy, copiedItems);
+        return copy;
+    }
+public:
+
+    // Constructor
+    Fighter(const std::string nameString, int healthValue)
+        : Character(nameString, healthValue), WeaponUser(nameString, healthValue, maxAllowedWeapons),
+          PotionUser(nameString, healthValue, maxAllowedPotions)
+    {}
+
+    // Destructor
+    ~Fighter() = default;
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":fighter:" << getHp() << " ";
+    }
+
+    /// <summary>
+    /// Implementation of the getter for the range of the attack.
+    /// </summary>
+    /// <returns> range of the attack </returns>
+    int getAttackRange() const override
+    {
+        return attackRange;
+    }
+
+    // Maximum allowed number of weapons
+    static int maxAllowedWeapons;
+
+    // Maximum allowed number of potions
+    static int maxAllowedPotions;
+
+    // Farthest distance of an attack
+    static int attackRange;
+};
+
+/// <summary>
+/// Class Archer represents a character that can
+/// use weapons, potions, and spells.
+/// </summary>
+class Archer: public WeaponUser, public PotionUser, public SpellUser
+{
+protected:
+
+    /// <summary>
+    /// Implementation of the abstract function that inserts the item
+    /// into either the arsenal, the medicalBag, or the spellBook.
+    /// </summary>
+    /// <param name="item">pointer to the item </param>
+    void obtainItem(std::shared_ptr<PhysicalItem> item) override
+    {
+
+        // Cast the item to the Weapon
+        if (dynamic_cast<Weapon *>(item.get())) {
+            auto weapon = std::dynamic_pointer_cast<Weapon>(item);
+            arsenal.addItem(weapon);
+        }
+            // Cast the item to the Potion
+        else if (dynamic_cast<Potion *>(item.get())) {
+            auto potion = std::dynamic_pointer_cast<Potion>(item);
+            medicalBag.addItem(potion);
+        }
+            // Cast the item to the Spell
+        else if (dynamic_cast<Spell *>(item.get())) {
+            auto spell = std::dynamic_pointer_cast<Spell>(item);
+            spellBook.addItem(spell);
+        }
+        else {
+            throw IllegalItemType();
+        }
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that removes the item
+    /// from either the arsenal, the medicalBag, or the spellBook.
+    /// </summary>
+    /// <param name="item"> pointer to the item </param>
+    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    {
+
+        // Find the item in the arsenal
+        if (arsenal.find(item->getName())) {
+            arsenal.removeItem(item->getName());
+        }
+            // Find the item in the medicalBag
+        else if (medicalBag.find(item->getName())) {
+            medicalBag.removeItem(item->getName());
+        }
+            // Find the item in the spellBook
+        else {
+            spellBook.removeItem(item->getName());
+        }
+
+        item.reset();
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that lists the items
+    /// of the arsenal, the medicalBag, and the spellBook.
+    /// </summary>
+    /// <returns> pointers to the items </returns>
+    std::vector<std::shared_ptr<PhysicalItem>> getItems() const override
+    {
+        std::vector<std::shared_ptr<PhysicalItem>> items;
+        for (Weapon &weapon: arsenal.view()) {
+            items.push_back(weapon.shared_from_this());
+        }
+        for (Potion &potion: medicalBag.view()) {
+            items.push_back(potion.shared_from_this());
+        }
+        for (Spell &spell: spellBook.view()) {
+            items.push_back(spell.shared_from_this());
+        }
+        return items;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that counts the items
+    /// of the arsenal, the medicalBag and the spellBook.
+    /// </summary>
+    /// <returns> numbers of the weapons, the potions and the spells </returns>
+    ItemCounts countItems() const override
+    {
+        return {arsenal.size(), medicalBag.size(), spellBook.size()};
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that tells the class of the character.
+    /// </summary>
+    /// <returns> 1 for an archer </returns>
+    int getClass() const override
+    {
+        return 1;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that copies the character
+    /// together with the items of the arsenal, the medicalBag, and the spellBook.
+    /// </summary>
+    /// <param name="copiedItems"> receiver of the pairs of an item and its copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<Character> clone(ItemCopies &copiedItems) const override
+    {
+        auto copy = std::make_shared<Archer>(*this);
+        copy->arsenal.rebind(copy, copiedItems);
+        copy->medicalBag.rebind(copy, copiedItems);
+        copy->spellBook.rebind(copy, copiedItems);
+        return copy;
+    }
+public:
+
+    // Constructor
+    Archer(const std::string nameString, int healthValue)
+        : Character(nameString, healthValue), WeaponUser(nameString, healthValue, maxAllowedWeapons),
+          PotionUser(nameString, healthValue, maxAllowedPotions), SpellUser(nameString, healthValue, maxAllowedSpells)
+    {}
+
+    // Destructor
+    ~Archer() = default;
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":archer:" << getHp() << " ";
+    }
+
+    /// <summary>
+    /// Implementation of the getter for the range of the attack.
+    /// </summary>
+    /// <returns> range of the attack </returns>
+    int getAttackRange() const override
+    {
+        return attackRange;
+    }
+
+    /// <summary>
+    /// Implementation of the getter for the range of the cast.
+    /// </summary>
+    /// <returns> range of the cast </returns>
+    int getCastRange() const override
+    {
+        return castRange;
+    }
+
+    // Maximum allowed number of weapons
+    static int maxAllowedWeapons;
+
+    // Maximum allowed number of potions
+    static int maxAllowedPotions;
+
+    // Maximum allowed number of spells
+    static int maxAllowedSpells;
+
+    // Farthest distance of an attack
+    static int attackRange;
+
+    // Farthest distance of a cast
+    static int castRange;
+};
+
+/// <summary>
+/// Class Wizard represents a character that can
+/// use potions and spells.
+/// </summary>
+class Wizard: public PotionUser, public SpellUser
+{
+protected:
+
+    /// <summary>
+    /// Implementation of the abstract function that inserts the item
+    /// into either the medicalBag or the spellBook.
+    /// </summary>
+    /// <param name="item"></param>
     void obtainItem(std::shared_ptr<PhysicalItem> item) override
     {
-        // Cast to Potion
-        if (dynamic_cast<Potion *>(item.get())) {
-            auto potion = std::dynamic_pointer_cast<Potion>(item);
-            medicalBag.addItem(potion);
+        // Cast to Potion
+        if (dynamic_cast<Potion *>(item.get())) {
+            auto potion = std::dynamic_pointer_cast<Potion>(item);
+            medicalBag.addItem(potion);
+        }
+            // Cast to Spell
+        else if (dynamic_cast<Spell *>(item.get())) {
+            auto spell = std::dynamic_pointer_cast<Spell>(item);
+            spellBook.addItem(spell);
+        }
+            // Wizard cannot use such item
+        else {
+            throw IllegalItemType();
+        }
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that removes the item
+    /// from either the medicalBag or the spellBook.
+    /// </summary>
+    /// <param name="item"></param>
+    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    {
+        // Find the item in the medicalBag
+        if (medicalBag.find(item->getName())) {
+            medicalBag.removeItem(item->getName());
+        }
+            // Find the item in the spellBook
+        else {
+            spellBook.removeItem(item->getName());
+        }
+
+        // Release data
+        item.reset();
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that lists the items
+    /// of the medicalBag and the spellBook.
+    /// </summary>
+    /// <returns> pointers to the items </returns>
+    std::vector<std::shared_ptr<PhysicalItem>> getItems() const override
+    {
+        std::vector<std::shared_ptr<PhysicalItem>> items;
+        for (Potion &potion: medicalBag.view()) {
+            items.push_back(potion.shared_from_this());
+        }
+        for (Spell &spell: spellBook.view()) {
+            items.push_back(spell.shared_from_this());
+        }
+        return items;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that counts the items
+    /// of the medicalBag and the spellBook.
+    /// </summary>
+    /// <returns> numbers of the weapons, the potions and the spells </returns>
+    ItemCounts countItems() const override
+    {
+        return {0, medicalBag.size(), spellBook.size()};
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that tells the class of the character.
+    /// </summary>
+    /// <returns> 2 for a wizard </returns>
+    int getClass() const override
+    {
+        return 2;
+    }
+
+    /// <summary>
+    /// Implementation of the abstract function that copies the character
+    /// together with the items of the medicalBag and the spellBook.
+    /// </summary>
+    /// <param name="copiedItems"> receiver of the pairs of an item and its copy </param>
+    /// <returns> pointer to the copy </returns>
+    std::shared_ptr<Character> clone(ItemCopies &copiedItems) const override
+    {
+        auto copy = std::make_shared<Wizard>(*this);
+        copy->medicalBag.rebind(copy, copiedItems);
+        copy->spellBook.rebind(copy, copiedItems);
+        return copy;
+    }
+public:
+
+    // Constructor
+    Wizard(const std::string nameString, int healthValue)
+        : Character(nameString, healthValue), PotionUser(nameString, healthValue, maxAllowedPotions),
+          SpellUser(nameString, healthValue, maxAllowedSpells)
+    {}
+
+    // Destructor
+    ~Wizard() = default;
+
+    /// <summary>
+    /// Implementation of the print function.
+    /// </summary>
+    /// <param name="out"> reference to the output stream </param>
+    void print(OutputBuffer &out) const override
+    {
+        out << getName() << ":wizard:" << getHp() << " ";
+    }
+
+    /// <summary>
+    /// Implementation of the getter for the range of the cast.
+    /// </summary>
+    /// <returns> range of the cast </returns>
+    int getCastRange() const override
+    {
+        return castRange;
+    }
+
+    // Maximum allowed number of potions
+    static int maxAllowedPotions;
+
+    // Maximum allowed number of spells
+    static int maxAllowedSpells;
+
+    // Farthest distance of a cast
+    static int castRange;
+};
+
+// Command Parsing
+
+// Largest number of parameters of a macro
+constexpr int maxMacroParameters = 64;
+
+// Largest number of characters or items created by a single bulk command
+constexpr int maxBulkCount = 1 << 22;
+
+/// <summary>
+/// Class to read the fields of a command. In the body of a macro a number field may name
+/// a parameter instead, the field is then recorded as a parameter slot of the command.
+/// </summary>
+class FieldReader
+{
+private:
+    // Input stream
+    std::istream &input;
+
+    // Command whose fields are read
+    Command &command;
+
+    // Names of the parameters of the macro, nullptr outside macros
+    const std::vector<std::string> *parameters;
+public:
+
+    // Constructor
+    FieldReader(std::istream &input, Command &command, const std::vector<std::string> *parameters)
+        : input(input), command(command), parameters(parameters)
+    {}
+
+    /// <summary>
+    /// Reads a word.
+    /// </summary>
+    /// <param name="word"> receives the word </param>
+    /// <returns> reference to the reader </returns>
+    FieldReader &operator>>(std::string &word)
+    {
+        input >> word;
+        return *this;
+    }
+
+    /// <summary>
+    /// Reads a number or, in the body of a macro, the name of a parameter taking the place of a number field.
+    /// </summary>
+    /// <param name="number"> receives the number, zero for a parameter </param>
+    /// <returns> reference to the reader </returns>
+    FieldReader &operator>>(int &number)
+    {
+        if (parameters == nullptr) {
+            input >> number;
+            return *this;
+        }
+
+        std::string word;
+        if (!(input >> word)) {
+            return *this;
+        }
+
+        auto parameter = std::find(parameters->begin(), parameters->end(), word);
+        if (parameter != parameters->end()) {
+            CommandField field = (&number == &command.value) ? CommandField::Value :
+                                 (&number == &command.count) ? CommandField::Count :
+                                 (&number == &command.x) ? CommandField::X :
+                                 (&number == &command.y) ? CommandField::Y : CommandField::Word;
+
+            // Counts of words are not fields of the command and cannot take arguments
+            if (field != CommandField::Word) {
+                number = 0;
+                command.parameters.push_back({field, 0, std::size_t(parameter - parameters->begin())});
+                return *this;
+            }
+        }
+
+        auto [end, error] = std::from_chars(word.data(), word.data() + word.size(), number);
+        if (error != std::errc() || end != word.data() + word.size()) {
+            input.setstate(std::ios::failbit);
+        }
+        return *this;
+    }
+};
+
+/// <summary>
+/// Reads the commands of a block up to its closing brace. Unknown words are left out.
+/// </summary>
+/// <param name="input"> reference to the input stream after the opening brace </param>
+/// <param name="body"> receives the commands of the block </param>
+/// <param name="parameters"> names of the parameters of the macro whose body is read, nullptr outside macros </param>
+/// <returns> false if a command of the block is malformed or the block is not closed </returns>
+bool parseBlock(std::istream &input, std::vector<Command> &body, const std::vector<std::string> *parameters)
+{
+    std::string first;
+    while (input >> first) {
+        if (first == "}") {
+            return true;
+        }
+        Command command = parseCommand(first, input, parameters);
+        if (command.kind == CommandKind::Invalid) {
+            return false;
+        }
+        if (command.kind != CommandKind::Unknown) {
+            body.push_back(std::move(command));
+        }
+    }
+    return false;
+}
+
+Command parseCommand(std::istream &input)
+{
+    std::string first;
+    if (!(input >> first)) {
+        return Command();
+    }
+    return parseCommand(first, input);
+}
+
+Command parseCommand(const std::string &first, std::istream &input, const std::vector<std::string> *parameters)
+{
+    Command command;
+    FieldReader fields(input, command, parameters);
+
+    if (first == "Create") {
+        std::string second;
+        input >> second;
+        if (second == "character") {
+            command.kind = CommandKind::CreateCharacter;
+            command.words.resize(2);
+            fields >> command.words[0] >> command.words[1] >> command.value;
+
+            const std::string &type = command.words[0];
+            if (type != "fighter" && type != "archer" && type != "wizard") {
+                command.kind = CommandKind::Invalid;
+            }
+        }
+        else if (second == "characters") {
+            command.kind = CommandKind::CreateCharacters;
+            command.words.resize(2);
+            fields >> command.words[0] >> command.count >> command.words[1] >> command.value;
+
+            const std::string &type = command.words[0];
+            if ((type != "fighter" && type != "archer" && type != "wizard")
+                || command.count < 0 || command.count > maxBulkCount) {
+                command.kind = CommandKind::Invalid;
+            }
+        }
+        else if (second == "items") {
+            std::string third;
+            input >> third;
+            if (third == "weapon" || third == "potion") {
+                command.kind = (third == "weapon") ? CommandKind::CreateWeapons : CommandKind::CreatePotions;
+                command.words.resize(2);
+                fields >> command.count >> command.words[0] >> command.words[1] >> command.value;
+                if (command.count < 0 || command.count > maxBulkCount) {
+                    command.kind = CommandKind::Invalid;
+                }
+            }
+            else {
+                command.kind = CommandKind::Invalid;
+            }
+        }
+        else if (second == "item") {
+            std::string third;
+            input >> third;
+            if (third == "weapon" || third == "potion") {
+                command.kind = (third == "weapon") ? CommandKind::CreateWeapon : CommandKind::CreatePotion;
+                command.words.resize(2);
+                fields >> command.words[0] >> command.words[1] >> command.value;
+            }
+            else if (third == "spell") {
+                command.kind = CommandKind::CreateSpell;
+                command.words.resize(2);
+                input >> command.words[0] >> command.words[1];
+                int m = 0;
+                input >> m;
+
+                for (int j = 0; j < m; ++j) {
+                    std::string targetName;
+                    input >> targetName;
+                    command.words.push_back(targetName);
+                }
+            }
+            else {
+                command.kind = CommandKind::Invalid;
+            }
+        }
+        else {
+            command.kind = CommandKind::Invalid;
+        }
+    }
+    else if (first == "Attack" || first == "Cast" || first == "Drink") {
+        if (first == "Attack") {
+            command.kind = CommandKind::Attack;
+        }
+        else if (first == "Cast") {
+            command.kind = CommandKind::Cast;
+        }
+        else {
+            command.kind = CommandKind::Drink;
+        }
+        command.words.resize(3);
+        input >> command.words[0] >> command.words[1] >> command.words[2];
+    }
+    else if (first == "Apply") {
+        command.kind = CommandKind::Apply;
+        command.words.resize(2);
+        fields >> command.words[0] >> command.words[1] >> command.value >> command.count;
+
+        const std::string &kind = command.words[0];
+        if (kind != "poison" && kind != "regen" && kind != "buff") {
+            command.kind = CommandKind::Invalid;
+        }
+    }
+    else if (first == "Tick") {
+        command.kind = CommandKind::Tick;
+        fields >> command.value;
+    }
+    else if (first == "Move") {
+        command.kind = CommandKind::Move;
+        command.words.resize(1);
+        fields >> command.words[0] >> command.value >> command.count;
+    }
+    else if (first == "MoveTo") {
+        command.kind = CommandKind::MoveTo;
+        command.words.resize(1);
+        fields >> command.words[0] >> command.x >> command.y;
+    }
+    else if (first == "Map") {
+        command.kind = CommandKind::Map;
+        fields >> command.value >> command.count;
+    }
+    else if (first == "Obstacle") {
+        command.kind = CommandKind::Obstacle;
+        command.words.resize(1);
+        fields >> command.words[0] >> command.x >> command.y >> command.value >> command.count;
+
+        if (command.words[0] != "add" && command.words[0] != "remove") {
+            command.kind = CommandKind::Invalid;
+        }
+    }
+    else if (first == "Stats") {
+        command.kind = CommandKind::Stats;
+    }
+    else if (first == "Export") {
+        command.kind = CommandKind::Export;
+        command.words.resize(1);
+        input >> command.words[0];
+    }
+    else if (first == "Give") {
+        command.kind = CommandKind::Give;
+        command.words.resize(3);
+        input >> command.words[0] >> command.words[1] >> command.words[2];
+    }
+    else if (first == "Dialogue") {
+        command.kind = CommandKind::Dialogue;
+        command.words.resize(1);
+        input >> command.words[0];
+        int m = 0;
+        input >> m;
+
+        for (int j = 0; j < m; ++j) {
+            std::string word;
+            input >> word;
+            command.words.push_back(word);
+        }
+    }
+    else if (first == "Show") {
+        std::string second;
+        input >> second;
+        if (second == "characters") {
+            command.kind = CommandKind::ShowCharacters;
+        }
+        else if (second == "weakest" || second == "strongest" || second == "below") {
+            if (second == "weakest") {
+                command.kind = CommandKind::ShowWeakest;
+            }
+            else if (second == "strongest") {
+                command.kind = CommandKind::ShowStrongest;
+            }
+            else {
+                command.kind = CommandKind::ShowBelow;
+            }
+            fields >> command.value;
+        }
+        else if (second == "owners") {
+            command.kind = CommandKind::ShowOwners;
+            command.words.resize(1);
+            input >> command.words[0];
+        }
+        else if (second == "nearby") {
+            command.kind = CommandKind::ShowNearby;
+            command.words.resize(1);
+            fields >> command.words[0] >> command.value;
+        }
+        else if (second == "weapons" || second == "potions" || second == "spells") {
+            if (second == "weapons") {
+                command.kind = CommandKind::ShowWeapons;
+            }
+            else if (second == "potions") {
+                command.kind = CommandKind::ShowPotions;
+            }
+            else {
+                command.kind = CommandKind::ShowSpells;
+            }
+            command.words.resize(1);
+            input >> command.words[0];
+        }
+        else {
+            command.kind = CommandKind::Invalid;
+        }
+    }
+    else if (first == "Repeat") {
+        command.kind = CommandKind::Repeat;
+        std::string brace;
+        fields >> command.count >> brace;
+
+        auto body = std::make_shared<std::vector<Command>>();
+        if (brace != "{" || !parseBlock(input, *body, parameters)) {
+            command.kind = CommandKind::Invalid;
+        }
+        command.body = std::move(body);
+    }
+    else if (first == "Macro") {
+        command.kind = CommandKind::Macro;
+        command.words.resize(1);
+        int m = 0;
+        input >> command.words[0] >> m;
+
+        for (int j = 0; j < m && j < maxMacroParameters; ++j) {
+            std::string parameter;
+            input >> parameter;
+            command.words.push_back(parameter);
+        }
+        std::string brace;
+        input >> brace;
+
+        // The commands of the block record the fields naming the parameters, the parameters of an enclosing macro
+        // are not seen in a nested one
+        std::vector<std::string> names(command.words.begin() + 1, command.words.end());
+        auto body = std::make_shared<std::vector<Command>>();
+        if (m < 0 || m > maxMacroParameters || brace != "{" || !parseBlock(input, *body, &names)) {
+            command.kind = CommandKind::Invalid;
+        }
+        command.body = std::move(body);
+    }
+    else if (first == "Call") {
+        command.kind = CommandKind::Call;
+        command.words.resize(1);
+        int m = 0;
+        input >> command.words[0] >> m;
+
+        for (int j = 0; j < m; ++j) {
+            std::string argument;
+            input >> argument;
+            command.words.push_back(argument);
+        }
+    }
+    else {
+        command.kind = CommandKind::Unknown;
+    }
+
+    // In the body of a macro the words naming a parameter take the arguments, the names of a nested macro do not
+    if (parameters != nullptr && command.kind != CommandKind::Macro) {
+        for (std::size_t j = 0; j < command.words.size(); ++j) {
+            auto parameter = std::find(parameters->begin(), parameters->end(), command.words[j]);
+            if (parameter != parameters->end()) {
+                command.parameters.push_back({CommandField::Word, j, std::size_t(parameter - parameters->begin())});
+            }
+        }
+    }
+
+    return command;
+}
+
+bool argumentsFit(const std::vector<Command> &body, const Command &call)
+{
+    for (const Command &command: body) {
+        for (const ParameterSlot &slot: command.parameters) {
+            if (slot.field != CommandField::Word) {
+                const std::string &argument = call.words[1 + slot.parameter];
+                int number = 0;
+                auto [end, error] = std::from_chars(argument.data(), argument.data() + argument.size(), number);
+                if (error != std::errc() || end != argument.data() + argument.size()) {
+                    return false;
+                }
+            }
+        }
+
+        // The commands of a nested macro take the arguments of its own calls
+        if (command.kind == CommandKind::Repeat && !argumentsFit(*command.body, call)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bindArguments(const Command &command, const Command &call, Command &bound)
+{
+    bound.kind = command.kind;
+    bound.words = command.words;
+    bound.value = command.value;
+    bound.count = command.count;
+    bound.x = command.x;
+    bound.y = command.y;
+    bound.body = command.body;
+    bound.parameters.clear();
+
+    for (const ParameterSlot &slot: command.parameters) {
+        const std::string &argument = call.words[1 + slot.parameter];
+        int *number = (slot.field == CommandField::Value) ? &bound.value :
+                      (slot.field == CommandField::Count) ? &bound.count :
+                      (slot.field == CommandField::X) ? &bound.x :
+                      (slot.field == CommandField::Y) ? &bound.y : nullptr;
+        if (number == nullptr) {
+            bound.words[slot.word] = argument;
+        }
+        else {
+            std::from_chars(argument.data(), argument.data() + argument.size(), *number);
+        }
+    }
+}
+
+std::string formatCommand(const Command &command, const std::vector<std::string> *parameters)
+{
+    // Number fields taking the arguments of a call are written as the names of the parameters
+    auto number = [&](CommandField field, int value)
+    {
+        if (parameters != nullptr) {
+            for (const ParameterSlot &slot: command.parameters) {
+                if (slot.field == field) {
+                    return (*parameters)[slot.parameter];
+                }
+            }
+        }
+        return std::to_string(value);
+    };
+
+    std::string text;
+    switch (command.kind) {
+        case CommandKind::CreateCharacter:
+            text = "Create character " + command.words[0] + " " + command.words[1] + " "
+                + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::CreateWeapon:
+        case CommandKind::CreatePotion:
+            text = (command.kind == CommandKind::CreateWeapon) ? "Create item weapon " : "Create item potion ";
+            text += command.words[0] + " " + command.words[1] + " " + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::CreateSpell:
+            text = "Create item spell " + command.words[0] + " " + command.words[1] + " "
+                + std::to_string(command.words.size() - 2);
+            for (std::size_t j = 2; j < command.words.size(); ++j) {
+                text += " " + command.words[j];
+            }
+            break;
+        case CommandKind::CreateCharacters:
+            text = "Create characters " + command.words[0] + " " + number(CommandField::Count, command.count) + " "
+                + command.words[1] + " " + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::CreateWeapons:
+        case CommandKind::CreatePotions:
+            text = (command.kind == CommandKind::CreateWeapons) ? "Create items weapon " : "Create items potion ";
+            text += number(CommandField::Count, command.count) + " " + command.words[0] + " " + command.words[1] + " "
+                + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::Attack:
+        case CommandKind::Cast:
+        case CommandKind::Drink:
+            text = (command.kind == CommandKind::Attack) ? "Attack " : (command.kind == CommandKind::Cast) ? "Cast " : "Drink ";
+            text += command.words[0] + " " + command.words[1] + " " + command.words[2];
+            break;
+        case CommandKind::Dialogue:
+            text = "Dialogue " + command.words[0] + " " + std::to_string(command.words.size() - 1);
+            for (std::size_t j = 1; j < command.words.size(); ++j) {
+                text += " " + command.words[j];
+            }
+            break;
+        case CommandKind::ShowCharacters:
+            text = "Show characters";
+            break;
+        case CommandKind::ShowWeapons:
+        case CommandKind::ShowPotions:
+        case CommandKind::ShowSpells:
+            text = (command.kind == CommandKind::ShowWeapons) ? "Show weapons " :
+                   (command.kind == CommandKind::ShowPotions) ? "Show potions " : "Show spells ";
+            text += command.words[0];
+            break;
+        case CommandKind::ShowWeakest:
+        case CommandKind::ShowStrongest:
+        case CommandKind::ShowBelow:
+            text = (command.kind == CommandKind::ShowWeakest) ? "Show weakest " :
+                   (command.kind == CommandKind::ShowStrongest) ? "Show strongest " : "Show below ";
+            text += number(CommandField::Value, command.value);
+            break;
+        case CommandKind::Give:
+            text = "Give " + command.words[0] + " " + command.words[1] + " " + command.words[2];
+            break;
+        case CommandKind::ShowOwners:
+            text = "Show owners " + command.words[0];
+            break;
+        case CommandKind::Apply:
+            text = "Apply " + command.words[0] + " " + command.words[1] + " " + number(CommandField::Value, command.value) + " "
+                + number(CommandField::Count, command.count);
+            break;
+        case CommandKind::Tick:
+            text = "Tick " + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::Move:
+            text = "Move " + command.words[0] + " " + number(CommandField::Value, command.value) + " "
+                + number(CommandField::Count, command.count);
+            break;
+        case CommandKind::ShowNearby:
+            text = "Show nearby " + command.words[0] + " " + number(CommandField::Value, command.value);
+            break;
+        case CommandKind::MoveTo:
+            text = "MoveTo " + command.words[0] + " " + number(CommandField::X, command.x) + " "
+                + number(CommandField::Y, command.y);
+            break;
+        case CommandKind::Map:
+            text = "Map " + number(CommandField::Value, command.value) + " " + number(CommandField::Count, command.count);
+            break;
+        case CommandKind::Obstacle:
+            text = "Obstacle " + command.words[0] + " " + number(CommandField::X, command.x) + " "
+                + number(CommandField::Y, command.y) + " " + number(CommandField::Value, command.value) + " "
+                + number(CommandField::Count, command.count);
+            break;
+        case CommandKind::Repeat:
+            text = "Repeat " + number(CommandField::Count, command.count) + " {";
+            for (const Command &inner: *command.body) {
+                text += " " + formatCommand(inner, parameters);
+            }
+            text += " }";
+            break;
+        case CommandKind::Macro: {
+            text = "Macro " + command.words[0] + " " + std::to_string(command.words.size() - 1);
+            for (std::size_t j = 1; j < command.words.size(); ++j) {
+                text += " " + command.words[j];
+            }
+            text += " {";
+
+            std::vector<std::string> names(command.words.begin() + 1, command.words.end());
+            for (const Command &inner: *command.body) {
+                text += " " + formatCommand(inner, &names);
+            }
+            text += " }";
+            break;
+        }
+        case CommandKind::Call:
+            text = "Call " + command.words[0] + " " + std::to_string(command.words.size() - 1);
+            for (std::size_t j = 1; j < command.words.size(); ++j) {
+                text += " " + command.words[j];
+            }
+            break;
+        case CommandKind::Export:
+            text = "Export " + command.words[0];
+            break;
+        case CommandKind::Stats:
+            text = "Stats";
+            break;
+        default:
+            break;
+    }
+    return text;
+}
+
+const char *commandName(CommandKind kind)
+{
+    switch (kind) {
+        case CommandKind::CreateCharacter:
+            return "Create character";
+        case CommandKind::CreateWeapon:
+            return "Create item weapon";
+        case CommandKind::CreatePotion:
+            return "Create item potion";
+        case CommandKind::CreateSpell:
+            return "Create item spell";
+        case CommandKind::CreateCharacters:
+            return "Create characters";
+        case CommandKind::CreateWeapons:
+            return "Create items weapon";
+        case CommandKind::CreatePotions:
+            return "Create items potion";
+        case CommandKind::Attack:
+            return "Attack";
+        case CommandKind::Cast:
+            return "Cast";
+        case CommandKind::Drink:
+            return "Drink";
+        case CommandKind::Dialogue:
+            return "Dialogue";
+        case CommandKind::ShowCharacters:
+            return "Show characters";
+        case CommandKind::ShowWeapons:
+            return "Show weapons";
+        case CommandKind::ShowPotions:
+            return "Show potions";
+        case CommandKind::ShowSpells:
+            return "Show spells";
+        case CommandKind::ShowWeakest:
+            return "Show weakest";
+        case CommandKind::ShowStrongest:
+            return "Show strongest";
+        case CommandKind::ShowBelow:
+            return "Show below";
+        case CommandKind::Give:
+            return "Give";
+        case CommandKind::ShowOwners:
+            return "Show owners";
+        case CommandKind::Apply:
+            return "Apply";
+        case CommandKind::Tick:
+            return "Tick";
+        case CommandKind::Move:
+            return "Move";
+        case CommandKind::ShowNearby:
+            return "Show nearby";
+        case CommandKind::Map:
+            return "Map";
+        case CommandKind::Obstacle:
+            return "Obstacle";
+        case CommandKind::MoveTo:
+            return "MoveTo";
+        case CommandKind::Repeat:
+            return "Repeat";
+        case CommandKind::Macro:
+            return "Macro";
+        case CommandKind::Call:
+            return "Call";
+        case CommandKind::Export:
+            return "Export";
+        case CommandKind::Stats:
+            return "Stats";
+        case CommandKind::Unknown:
+            return "Unknown";
+        case CommandKind::Invalid:
+            return "Invalid";
+        default:
+            return "End of input";
+    }
+}
+
+std::pair<std::string_view, std::string_view> commandParticipants(const Command &command)
+{
+    switch (command.kind) {
+        case CommandKind::CreateCharacter:
+            return {command.words[1], {}};
+        case CommandKind::Apply:
+            return {{}, command.words[1]};
+        case CommandKind::CreateWeapon:
+        case CommandKind::CreatePotion:
+        case CommandKind::CreateSpell:
+        case CommandKind::Dialogue:
+        case CommandKind::ShowWeapons:
+        case CommandKind::ShowPotions:
+        case CommandKind::ShowSpells:
+        case CommandKind::Move:
+        case CommandKind::ShowNearby:
+        case CommandKind::MoveTo:
+            return {command.words[0], {}};
+        case CommandKind::Attack:
+        case CommandKind::Cast:
+        case CommandKind::Drink:
+        case CommandKind::Give:
+            return {command.words[0], command.words[1]};
+        default:
+            return {};
+    }
+}
+
+// Command Journal Methods
+
+CommandJournal::CommandJournal(const std::string &path, std::size_t groupSize, std::chrono::milliseconds groupInterval)
+    : file(-1), pending(), pendingCommands(0), groupSize(std::max<std::size_t>(groupSize, 1)),
+      groupInterval(groupInterval), startedCommits(0), finishedCommits(0), stopping(false), failure()
+{
+#ifdef _WIN32
+    file = _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    file = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+#endif
+    if (file < 0) {
+        throw std::runtime_error("Cannot open the journal " + path);
+    }
+
+    committer = std::thread(&CommandJournal::commitLoop, this);
+}
+
+CommandJournal::~CommandJournal()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    groupReady.notify_one();
+    committer.join();
+
+#ifdef _WIN32
+    _close(file);
+#else
+    close(file);
+#endif
+}
+
+void CommandJournal::writeDurably(const std::string &records)
+{
+    std::size_t written = 0;
+    while (written < records.size()) {
+#ifdef _WIN32
+        int result = _write(file, records.data() + written, static_cast<unsigned int>(records.size() - written));
+#else
+        ssize_t result = write(file, records.data() + written, records.size() - written);
+#endif
+        if (result <= 0) {
+            throw std::runtime_error("Cannot write the journal");
+        }
+        written += result;
+    }
+
+#ifdef _WIN32
+    int result = _commit(file);
+#else
+    int result = fdatasync(file);
+#endif
+    if (result != 0) {
+        throw std::runtime_error("Cannot synchronize the journal");
+    }
+}
+
+void CommandJournal::commitLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        groupReady.wait_for(lock, groupInterval, [&]()
+        {
+            return stopping || pendingCommands >= groupSize || startedCommits > finishedCommits;
+        });
+
+        // Taking the whole group and committing it without blocking the appending threads
+        std::uint64_t commitNumber = startedCommits;
+        std::string records;
+        records.swap(pending);
+        pendingCommands = 0;
+
+        // The error of a group is kept for the threads waiting for it, a later group would leave a gap in the file
+        if (!records.empty() && !failure) {
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                writeDurably(records);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            failure = error;
+        }
+
+        finishedCommits = std::max(finishedCommits, commitNumber);
+        groupCommitted.notify_all();
+
+        if (stopping && pending.empty()) {
+            return;
+        }
+    }
+}
+
+void CommandJournal::append(const Command &command)
+{
+    std::string record = formatCommand(command);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    pending += record;
+    pending += '\n';
+    if (++pendingCommands == groupSize) {
+        groupReady.notify_one();
+    }
+}
+
+void CommandJournal::commit()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::uint64_t commitNumber = ++startedCommits;
+    groupReady.notify_one();
+    groupCommitted.wait(lock, [&]()
+    {
+        return finishedCommits >= commitNumber;
+    });
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+std::vector<Command> CommandJournal::recover(const std::string &path)
+{
+    std::vector<Command> commands;
+
+    std::ifstream journalFile(path, std::ios::binary);
+    if (!journalFile) {
+        return commands;
+    }
+
+    // Only records terminated by a line break were written completely
+    std::uintmax_t validLength = 0;
+    std::string line;
+    while (std::getline(journalFile, line) && !journalFile.eof()) {
+        validLength += line.size() + 1;
+
+        std::istringstream record(line);
+        Command command = parseCommand(record);
+        if (command.kind != CommandKind::EndOfInput) {
+            commands.push_back(std::move(command));
+        }
+    }
+    journalFile.close();
+
+    // Cutting the torn record off, so the new records follow the valid ones
+    if (std::filesystem::file_size(path) != validLength) {
+        std::filesystem::resize_file(path, validLength);
+    }
+
+    return commands;
+}
+
+CommandAccess analyzeCommand(const Command &command)
+{
+    CommandAccess access;
+
+    // Creations of characters keep their relative order, because the order
+    // of the container decides which of the characters with equal names is found
+    static const std::string rosterOrder;
+
+    switch (command.kind) {
+        case CommandKind::CreateCharacter:
+            access.writes = {command.words[1], rosterOrder};
+            break;
+        case CommandKind::CreateWeapon:
+        case CommandKind::CreatePotion:
+            access.writes = {command.words[0]};
+            break;
+        case CommandKind::CreateSpell:
+            access.writes = {command.words[0]};
+            access.reads.assign(command.words.begin() + 2, command.words.end());
+            break;
+        case CommandKind::Attack:
+            access.reads = {command.words[0]};
+            access.writes = {command.words[1]};
+            break;
+        case CommandKind::Cast:
+        case CommandKind::Drink:
+        case CommandKind::Give:
+            access.writes = {command.words[0], command.words[1]};
+            break;
+        case CommandKind::Dialogue:
+
+            // Narrator speaks without a lookup
+            if (command.words[0] != "Narrator") {
+                access.reads = {command.words[0]};
+            }
+            break;
+        case CommandKind::ShowWeapons:
+        case CommandKind::ShowPotions:
+        case CommandKind::ShowSpells:
+            access.reads = {command.words[0]};
+            break;
+        case CommandKind::Move:
+        case CommandKind::MoveTo:
+            access.writes = {command.words[0]};
+            break;
+        case CommandKind::Unknown:
+            break;
+        default:
+            access.isBarrier = true;
+            break;
+    }
+
+    return access;
+}
+
+// Game Methods
+
+inline std::shared_ptr<Game> Game::game{nullptr};
+
+thread_local std::shared_ptr<Game> Game::threadGame{nullptr};
+
+thread_local OutputBuffer *Game::commandOutput{nullptr};
+
+thread_local SpeculativeResult *Game::speculation{nullptr};
+
+std::atomic<std::uint64_t> Game::generations{0};
+
+std::shared_ptr<Character> Game::getCharacterByName(std::string name) const
+{
+    TraceSpan span("lookup", name);
+    std::shared_lock<std::shared_mutex> lock(rosterMutex);
+    auto named = charactersByName.find(name);
+    if (named != nullptr) {
+
+        // The earliest created of the characters with the name is found
+        auto character = characters.find(named->front());
+
+        // Remembering the observed version for the validation of the speculative result
+        if (speculation != nullptr) {
+            speculation->observed.emplace_back(character, character->version);
+        }
+        return character;
+    }
+
+    if (speculation != nullptr) {
+        speculation->missed = true;
+    }
+    throw CharacterDoesNotExist();
+}
+
+void Game::showCharacters()
+{
+
+    // Output information of alive characters sorted by name
+    OutputBuffer &out = getOutput();
+    std::shared_lock<std::shared_mutex> lock(rosterMutex);
+    if (characters.size() >= parallelShowSize && std::thread::hardware_concurrency() > 1) {
+
+        // The shards of the sort take the characters by position
+        std::vector<Character *> alive;
+        alive.reserve(characters.size());
+        for (Character &character: characters.view()) {
+            alive.push_back(&character);
+        }
+        printInAscendingOrder<Character>(alive | std::views::transform([](Character *character) -> Character &
+        {
+            return *character;
+        }), out, getWorkers());
+    }
+    else {
+        characters.visitSorted([&](const Character &character)
+        {
+            character.print(out);
+        });
+    }
+    lock.unlock();
+
+    out << '\n';
+}
+
+void Game::showCharactersByHealth(const Command &command)
+{
+    OutputBuffer &out = getOutput();
+    auto print = [&](const Character &character)
+    {
+        character.print(out);
+    };
+
+    std::size_t count = std::max(command.value, 0);
+    if (command.kind == CommandKind::ShowWeakest) {
+        healthIndex.visitWeakest(count, print);
+    }
+    else if (command.kind == CommandKind::ShowStrongest) {
+        healthIndex.visitStrongest(count, print);
+    }
+    else {
+        healthIndex.visitBelow(command.value, print);
+    }
+
+    out << '\n';
+}
+
+void Game::showStatistics()
+{
+    OutputBuffer &out = getOutput();
+    std::int64_t count = 0;
+    std::int64_t health = 0;
+    for (int type = 0; type < 3; ++type) {
+        count += statistics.getCharacters(type);
+        health += statistics.getHealthPoints(type);
+    }
+
+    // Mean health points with two decimals
+    char mean[32];
+    auto end = std::to_chars(mean, mean + sizeof(mean), (count > 0) ? double(health) / count : 0.0,
+                             std::chars_format::fixed, 2).ptr;
+
+    out << "Characters: " << count << " (fighters " << statistics.getCharacters(0) << ", archers "
+        << statistics.getCharacters(1) << ", wizards " << statistics.getCharacters(2) << "), health points: " << health
+        << " (mean " << std::string_view(mean, end - mean) << "), items: weapons " << statistics.getItems(0)
+        << ", potions " << statistics.getItems(1) << ", spells " << statistics.getItems(2) << "\n";
+}
+
+void Game::exportRoster(const std::string &path)
+{
+    RosterExportHeader header{};
+    std::copy_n("ROSTER01", sizeof(header.magic), header.magic);
+
+    std::vector<std::uint32_t> characterNames;
+    std::vector<std::uint8_t> characterClasses;
+    std::vector<std::int32_t> healthPoints;
+    std::vector<std::uint32_t> firstItems;
+    std::vector<std::uint32_t> itemNames;
+    std::vector<std::uint8_t> itemKinds;
+    std::vector<std::int32_t> itemValues;
+    std::vector<std::uint32_t> itemOwners;
+    std::vector<std::uint64_t> stringOffsets{0};
+    std::string stringBytes;
+
+    // Names are stored once, the items of many characters share their names
+    std::unordered_map<std::string_view, std::uint32_t> dictionary;
+    auto intern = [&](const std::string &name)
+    {
+        auto [entry, isNew] = dictionary.emplace(name, std::uint32_t(dictionary.size()));
+        if (isNew) {
+            stringBytes += name;
+            stringOffsets.push_back(stringBytes.size());
+        }
+        return entry->second;
+    };
+
+    {
+        std::shared_lock<std::shared_mutex> lock(rosterMutex);
+        std::size_t count = characters.size();
+        characterNames.reserve(count);
+        characterClasses.reserve(count);
+        healthPoints.reserve(count);
+        firstItems.reserve(count + 1);
+        dictionary.reserve(count * 2);
+
+        for (const Character &character: characters.view()) {
+            auto owner = std::uint32_t(characterNames.size());
+            auto addItem = [&](const PhysicalItem &item, std::uint8_t kind, int value)
+            {
+                itemNames.push_back(intern(item.getName()));
+                itemKinds.push_back(kind);
+                itemValues.push_back(value);
+                itemOwners.push_back(owner);
+            };
+
+            // The class is found once, the containers are reached through it without more casts
+            const WeaponUser *weaponUser = nullptr;
+            const PotionUser *potionUser = nullptr;
+            const SpellUser *spellUser = nullptr;
+            std::uint8_t type = 2;
+            if (auto fighter = dynamic_cast<const Fighter *>(&character)) {
+                type = 0;
+                weaponUser = fighter;
+                potionUser = fighter;
+            }
+            else if (auto archer = dynamic_cast<const Archer *>(&character)) {
+                type = 1;
+                weaponUser = archer;
+                potionUser = archer;
+                spellUser = archer;
+            }
+            else if (auto wizard = dynamic_cast<const Wizard *>(&character)) {
+                potionUser = wizard;
+                spellUser = wizard;
+            }
+
+            characterNames.push_back(intern(character.getName()));
+            characterClasses.push_back(type);
+            healthPoints.push_back(character.getHp());
+            firstItems.push_back(itemNames.size());
+
+            // Items of a character in the order of the Show commands
+            if (weaponUser != nullptr) {
+                weaponUser->getArsenal().visitSorted([&](const Weapon &weapon)
+                {
+                    addItem(weapon, 0, weapon.getDamage());
+                });
+            }
+            if (potionUser != nullptr) {
+                potionUser->getMedicalBag().visitSorted([&](const Potion &potion)
+                {
+                    addItem(potion, 1, potion.getHealValue());
+                });
+            }
+            if (spellUser != nullptr) {
+                spellUser->getSpellBook().visitSorted([&](const Spell &spell)
+                {
+                    addItem(spell, 2, spell.getNumAllowedTargets());
+                });
+            }
+        }
+        firstItems.push_back(itemNames.size());
+    }
+
+    header.characters = characterNames.size();
+    header.items = itemNames.size();
+    header.strings = dictionary.size();
+
+    // Every column is written at once, padded to the alignment of the next one
+    std::vector<std::pair<const char *, std::size_t>> columns = {
+        {reinterpret_cast<const char *>(characterNames.data()), characterNames.size() * sizeof(std::uint32_t)},
+        {reinterpret_cast<const char *>(characterClasses.data()), characterClasses.size()},
+        {reinterpret_cast<const char *>(healthPoints.data()), healthPoints.size() * sizeof(std::int32_t)},
+        {reinterpret_cast<const char *>(firstItems.data()), firstItems.size() * sizeof(std::uint32_t)},
+        {reinterpret_cast<const char *>(itemNames.data()), itemNames.size() * sizeof(std::uint32_t)},
+        {reinterpret_cast<const char *>(itemKinds.data()), itemKinds.size()},
+        {reinterpret_cast<const char *>(itemValues.data()), itemValues.size() * sizeof(std::int32_t)},
+        {reinterpret_cast<const char *>(itemOwners.data()), itemOwners.size() * sizeof(std::uint32_t)},
+        {reinterpret_cast<const char *>(stringOffsets.data()), stringOffsets.size() * sizeof(std::uint64_t)},
+        {stringBytes.data(), stringBytes.size()}
+    };
+    const std::size_t alignment = 8;
+    auto aligned = [&](std::size_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    };
+    std::size_t offset = aligned(sizeof(header));
+    for (std::size_t column = 0; column < columns.size(); ++column) {
+        header.offsets[column] = offset;
+        header.sizes[column] = columns[column].second;
+        offset = aligned(offset + columns[column].second);
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Cannot create the export " + path);
+    }
+    const char padding[alignment] = {};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(padding, aligned(sizeof(header)) - sizeof(header));
+    for (auto [data, size]: columns) {
+        file.write(data, size);
+        file.write(padding, aligned(size) - size);
+    }
+    if (!file.flush()) {
+        throw std::runtime_error("Cannot write the export " + path);
+    }
+}
+
+std::shared_ptr<Character> Game::makeCharacter(const std::string &type, const std::string &name, int healthPoints)
+{
+    if (type == "fighter") {
+        return std::make_shared<Fighter>(name, healthPoints);
+    }
+    else if (type == "archer") {
+        return std::make_shared<Archer>(name, healthPoints);
+    }
+    else if (type == "wizard") {
+        return std::make_shared<Wizard>(name, healthPoints);
+    }
+    throw std::runtime_error("Unexpected command");
+}
+
+void Game::addCharacter(std::shared_ptr<Character> character)
+{
+    character->ordinal = createdCharacters;
+    character->generation = generation;
+    healthIndex.insert(*character);
+    statistics.insert(character->getClass(), character->healthPoints);
+    spatialHash.insert(*character);
+    charactersByName[character->name].push_back(character->ordinal);
+    characters.insert(std::move(character));
+    ++createdCharacters;
+}
+
+void Game::createItem(CommandKind kind, const std::string &ownerName, const std::string &itemName, int value)
+{
+    OutputBuffer &out = getOutput();
+
+    try {
+        auto owner = getCharacterByName(ownerName);
+
+        std::shared_ptr<PhysicalItem> newItem;
+        if (kind == CommandKind::CreateWeapon) {
+            newItem = std::make_shared<Weapon>(owner, itemName, value);
+        }
+        else {
+            newItem = std::make_shared<Potion>(owner, itemName, value);
+        }
+        ItemCounts items = owner->countItems();
+        owner->obtainItem(newItem);
+        recountItems(*owner, items);
+        itemIndex.insert(newItem);
+        ++owner->version;
+        out << ownerName << " just obtained a new " << (kind == CommandKind::CreateWeapon ? "weapon" : "potion")
+            << " called " << itemName << ".\n";
+    }
+    catch (const CharacterDoesNotExist &) {
+        out << "Error caught\n";
+    }
+    catch (const IllegalDamageValue &) {
+        out << "Error caught\n";
+    }
+    catch (const IllegalHealthValue &) {
+        out << "Error caught\n";
+    }
+    catch (const FullContainer &) {
+        out << "Error caught\n";
+    }
+    catch (const IllegalItemType &) {
+        out << "Error caught\n";
+    }
+}
+
+void Game::applyEffect(const Command &command)
+{
+    OutputBuffer &out = getOutput();
+    const std::string &kindName = command.words[0];
+    const std::string &targetName = command.words[1];
+
+    try {
+        auto target = getCharacterByName(targetName);
+        if (command.value <= 0) {
+            throw IllegalHealthValue();
+        }
+        if (command.count <= 0) {
+            throw std::invalid_argument("Non-positive number of turns");
+        }
+
+        effects.detach();
+        freeEffects.detach();
+        effectWheel.detach();
+        StatusEffect effect{StatusEffect::Kind::Poison, target->ordinal, command.value, command.count, appliedEffects++};
+        std::uint64_t firstTurn = effectWheel->now() + 1;
+        if (kindName == "poison") {
+            out << targetName << " is poisoned for " << command.count << " turns.\n";
+        }
+        else if (kindName == "regen") {
+            effect.kind = StatusEffect::Kind::Regeneration;
+            out << targetName << " starts regenerating for " << command.count << " turns.\n";
+        }
+        else {
+            effect.kind = StatusEffect::Kind::Buff;
+            firstTurn = effectWheel->now() + command.count;
+            target->damageBonus += command.value;
+            ++target->version;
+            out << targetName << " is buffed for " << command.count << " turns.\n";
+        }
+
+        std::uint32_t id;
+        if (!freeEffects->empty()) {
+            id = freeEffects->back();
+            freeEffects->pop_back();
+            (*effects)[id] = effect;
+        }
+        else {
+            id = effects->size();
+            effects->push_back(effect);
+        }
+        effectWheel->schedule(id, firstTurn);
+    }
+    catch (const CharacterDoesNotExist &) {
+        out << "Error caught\n";
+    }
+    catch (const IllegalHealthValue &) {
+        out << "Error caught\n";
+    }
+    catch (const std::invalid_argument &) {
+        out << "Error caught\n";
+    }
+}
+
+void Game::tick(int ticks)
+{
+    effects.detach();
+    freeEffects.detach();
+    effectWheel.detach();
+    effectWheel->advance(std::max(ticks, 0), [&](std::uint64_t now, std::vector<std::uint32_t> &due)
+    {
+        // Effects due at the same tick act in the order of application
+        std::sort(due.begin(), due.end(), [&](std::uint32_t first, std::uint32_t second)
+        {
+            return (*effects)[first].sequence < (*effects)[second].sequence;
+        });
+
+        for (std::uint32_t id: due) {
+            fireEffect(id, now);
+        }
+    });
+}
+
+void Game::fireEffect(std::uint32_t id, std::uint64_t now)
+{
+    OutputBuffer &out = getOutput();
+    StatusEffect &effect = (*effects)[id];
+    std::shared_lock<std::shared_mutex> lock(rosterMutex);
+    auto target = characters.find(effect.target);
+    lock.unlock();
+
+    // A forked session copies the shared target before the effect changes it
+    if (target != nullptr && target->generation != generation) {
+        std::lock_guard<std::shared_mutex> privatizeLock(rosterMutex);
+        privatize(target);
+        target = characters.find(effect.target);
+    }
+
+    // Effects of the dead characters are dropped
+    if (target != nullptr) {
+        switch (effect.kind) {
+            case StatusEffect::Kind::Poison:
+                out << target->getName() << " suffers " << effect.amount << " poison damage.\n";
+                target->takeDamage(effect.amount);
+                --effect.remaining;
+                break;
+            case StatusEffect::Kind::Regeneration:
+                out << target->getName() << " regenerates " << effect.amount << " health points.\n";
+                target->heal(effect.amount);
+                --effect.remaining;
+                break;
+            case StatusEffect::Kind::Buff:
+                out << target->getName() << "'s buff wears off.\n";
+                effect.remaining = 0;
+                break;
+        }
+    }
+    else {
+        effect.remaining = 0;
+    }
+
+    if (effect.kind == StatusEffect::Kind::Buff && target != nullptr) {
+        target->damageBonus -= effect.amount;
+        ++target->version;
+    }
+
+    if (effect.remaining > 0 && target->isAlive) {
+        effectWheel->schedule(id, now + 1);
+    }
+    else {
+        freeEffects->push_back(id);
+    }
+}
+
+void Game::showOwners(const std::string &itemName)
+{
+    auto owners = itemIndex.getOwners(itemName);
+
+    // Sort owners by name, then by the order of creation
+    std::sort(owners.begin(),
+              owners.end(),
+              [](const std::shared_ptr<Character> &first, const std::shared_ptr<Character> &second)
+              {
+                  if (*first < *second || *second < *first) {
+                      return (*first < *second);
+                  }
+                  return (first->ordinal < second->ordinal);
+              });
+
+    OutputBuffer &out = getOutput();
+    for (auto &owner: owners) {
+        owner->print(out);
+    }
+
+    out << '\n';
+}
+
+void Game::showNearby(const std::string &name, int radius)
+{
+    OutputBuffer &out = getOutput();
+
+    try {
+        auto center = getCharacterByName(name);
+
+        // The characters are found in the roster by the ordinals the spatial hash keeps
+        std::shared_lock<std::shared_mutex> lock(rosterMutex);
+        std::vector<const Character *> nearby;
+        spatialHash.visitWithin(center->x, center->y, radius, [&](std::uint64_t ordinal)
+        {
+            if (ordinal != center->ordinal) {
+                nearby.push_back(characters.find(ordinal).get());
+            }
+        });
+
+        // Sort by name, then by the order of creation
+        std::sort(nearby.begin(), nearby.end(), [](const Character *first, const Character *second)
+        {
+            if (*first < *second || *second < *first) {
+                return (*first < *second);
+            }
+            return (first->ordinal < second->ordinal);
+        });
+
+        for (const Character *character: nearby) {
+            character->print(out);
+        }
+        out << '\n';
+    }
+    catch (const CharacterDoesNotExist &) {
+        out << "Error caught\n";
+    }
+}
+
+void Game::moveCharacter(const std::string &name, int dx, int dy)
+{
+    OutputBuffer &out = getOutput();
+
+    try {
+        auto character = getCharacterByName(name);
+
+        // Positions stay within the range of the coordinates
+        int x = (int) std::clamp<long long>((long long) character->x + dx, INT_MIN, INT_MAX);
+        int y = (int) std::clamp<long long>((long long) character->y + dy, INT_MIN, INT_MAX);
+        spatialHash.move(*character, x, y);
+        ++character->version;
+        out << name << " moves to (" << x << ", " << y << ").\n";
+    }
+    catch (const CharacterDoesNotExist &) {
+        out << "Error caught\n";
+    }
+}
+
+void Game::moveCharacterTo(const std::string &name, int x, int y)
+{
+    OutputBuffer &out = getOutput();
+
+    try {
+        auto character = getCharacterByName(name);
+        if (!pathFinder.contains(character->x, character->y) || !pathFinder.contains(x, y)) {
+            throw OutsideOfMap();
+        }
+
+        int steps = pathFinder.route(character->x, character->y, x, y);
+        if (steps < 0) {
+            out << name << " cannot reach (" << x << ", " << y << ").\n";
+            return;
+        }
+
+        spatialHash.move(*character, x, y);
+        ++character->version;
+        out << name << " moves to (" << x << ", " << y << ") in " << steps << " steps.\n";
+    }
+    catch (const CharacterDoesNotExist &) {
+        out << "Error caught\n";
+    }
+    catch (const OutsideOfMap &) {
+        out << "Error caught\n";
+    }
+}
+
+Game::Game()
+    : Game("input.txt", "output.txt")
+{}
+
+Game::Game(const std::string &inputPath, const std::string &outputPath)
+    : appliedEffects(0), callDepth(0), arguments(nullptr), boundDepth(0), createdCharacters(0), reexecutedCommands(0), generation(0)
+{
+    // Sessions created with newSession are not bound to files
+    if (inputPath.empty()) {
+        return;
+    }
+
+    // Input stream
+    input.open(inputPath);
+
+    // Output stream
+    outputFile.open(outputPath);
+}
+
+Game::Game(const Game &base)
+    : std::enable_shared_from_this<Game>(), characters(base.characters), charactersByName(base.charactersByName),
+      healthIndex(base.healthIndex), statistics(base.statistics), itemIndex(base.itemIndex), spatialHash(base.spatialHash),
+      pathFinder(base.pathFinder), effects(base.effects), freeEffects(base.freeEffects), appliedEffects(base.appliedEffects), effectWheel(base.effectWheel),
+      macros(base.macros), callDepth(0), arguments(nullptr), boundCommands(), boundDepth(0), createdCharacters(base.createdCharacters), reexecutedCommands(0), generation(0)
+{}
+
+Game::~Game()
+{
+
+    // Dropping the items releases the references they keep to their owner,
+    // the characters shared with forked sessions keep their items
+    for (auto &character: characters.view()) {
+        if (character.generation == generation) {
+            for (auto &item: character.getItems()) {
+                character.loseItem(item);
+            }
+        }
+    }
+}
+
+void Game::executeCommand(const Command &command)
+{
+    // A command of a macro body runs with the arguments of the call in place of the parameters
+    if (!command.parameters.empty() && arguments != nullptr) {
+        if (boundDepth == boundCommands.size()) {
+            boundCommands.emplace_back();
+        }
+        Command &bound = boundCommands[boundDepth];
+        bindArguments(command, *arguments, bound);
+
+        ++boundDepth;
+        try {
+            executeCommand(bound);
+        }
+        catch (...) {
+            --boundDepth;
+            throw;
+        }
+        --boundDepth;
+        return;
+    }
+
+    OutputBuffer &out = getOutput();
+    auto participants = commandParticipants(command);
+    TraceSpan span(commandName(command.kind), participants.first, participants.second);
+    PerfSample sample(command.kind);
+    AllocationSample allocations(command.kind);
+
+    // A forked session copies the shared characters before the command changes them
+    if (generation != 0) {
+        privatizeWrites(command);
+    }
+
+    switch (command.kind) {
+        case CommandKind::CreateCharacter: {
+            const std::string &type = command.words[0];
+            const std::string &name = command.words[1];
+            int initHP = command.value;
+            std::shared_ptr<Character> newCharacter = makeCharacter(type, name, initHP);
+            out << "A new " << type << " came to town, " << name << ".\n";
+
+            std::lock_guard<std::shared_mutex> lock(rosterMutex);
+            addCharacter(std::move(newCharacter));
+            break;
+        }
+        case CommandKind::CreateCharacters: {
+            const std::string &type = command.words[0];
+            const std::string &prefix = command.words[1];
+
+            // The count of a macro call is bound after the parsing
+            if (command.count < 0 || command.count > maxBulkCount) {
+                throw std::runtime_error("Unexpected command");
+            }
+            std::size_t count = command.count;
+
+            // Building the characters before taking the roster lock once for all of them
+            std::vector<std::shared_ptr<Character>> created;
+            created.reserve(count);
+            std::string name = prefix;
+            for (std::size_t i = 0; i < count; ++i) {
+                name.resize(prefix.size());
+                name += std::to_string(i);
+                created.push_back(makeCharacter(type, name, command.value));
+                out << "A new " << type << " came to town, " << name << ".\n";
+            }
+
+            std::lock_guard<std::shared_mutex> lock(rosterMutex);
+            characters.reserve(createdCharacters + count);
+            charactersByName.reserve(charactersByName.size() + count);
+            for (auto &newCharacter: created) {
+                addCharacter(std::move(newCharacter));
+            }
+            break;
+        }
+        case CommandKind::CreateWeapon:
+        case CommandKind::CreatePotion: {
+            createItem(command.kind, command.words[0], command.words[1], command.value);
+            break;
+        }
+        case CommandKind::CreateWeapons:
+        case CommandKind::CreatePotions: {
+            const std::string &prefix = command.words[0];
+            CommandKind kind = (command.kind == CommandKind::CreateWeapons) ? CommandKind::CreateWeapon : CommandKind::CreatePotion;
+            if (command.count < 0 || command.count > maxBulkCount) {
+                throw std::runtime_error("Unexpected command");
+            }
+            std::size_t count = command.count;
+
+            // No more items can be created than there are owners
+            itemIndex.reserve(command.words[1], std::min<std::size_t>(count, characters.size()));
+            std::string ownerName = prefix;
+            for (std::size_t i = 0; i < count; ++i) {
+                ownerName.resize(prefix.size());
+                ownerName += std::to_string(i);
+                createItem(kind, ownerName, command.words[1], command.value);
+            }
+            break;
+        }
+        case CommandKind::CreateSpell: {
+            try {
+                const std::string &ownerName = command.words[0];
+                const std::string &spellName = command.words[1];
+
+                auto owner = getCharacterByName(ownerName);
+
+                std::vector<std::shared_ptr<Character>> allowedTargets;
+
+                for (std::size_t j = 2; j < command.words.size(); ++j) {
+                    auto target = getCharacterByName(command.words[j]);
+                    allowedTargets.push_back(target);
+                }
+
+                std::shared_ptr<Spell> newSpell = std::make_shared<Spell>(owner, spellName, allowedTargets);
+                ItemCounts items = owner->countItems();
+                owner->obtainItem(newSpell);
+                recountItems(*owner, items);
+                itemIndex.insert(newSpell);
+                ++owner->version;
+                out << ownerName << " just obtained a new spell called " << spellName << ".\n";
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const FullContainer &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Attack: {
+            try {
+                auto attacker = getCharacterByName(command.words[0]);
+                auto target = getCharacterByName(command.words[1]);
+
+                // Check whether the character can use weapons
+                if (dynamic_cast<WeaponUser *>(attacker.get())) {
+                    auto weaponUser = std::dynamic_pointer_cast<WeaponUser>(attacker);
+                    if (!SpatialHash::isWithin(*target, attacker->x, attacker->y, weaponUser->getAttackRange())) {
+                        throw TargetOutOfRange();
+                    }
+                    weaponUser->attack(target, command.words[2]);
+                }
+                else {
+                    throw IllegalItemType();
+                }
+
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            catch (const CharacterDoesNotOwnItem &) {
+                out << "Error caught\n";
+            }
+            catch (const TargetOutOfRange &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Cast: {
+            try {
+                auto caster = getCharacterByName(command.words[0]);
+                auto target = getCharacterByName(command.words[1]);
+
+                // Check whether the character can use spells
+                if (dynamic_cast<SpellUser *>(caster.get())) {
+                    auto spellUser = std::dynamic_pointer_cast<SpellUser>(caster);
+                    if (!SpatialHash::isWithin(*target, caster->x, caster->y, spellUser->getCastRange())) {
+                        throw TargetOutOfRange();
+                    }
+                    spellUser->cast(target, command.words[2]);
+                }
+                else {
+                    throw IllegalItemType();
+                }
+
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            catch (const CharacterDoesNotOwnItem &) {
+                out << "Error caught\n";
+            }
+            catch (const NotAllowedTarget &) {
+                out << "Error caught\n";
+            }
+            catch (const TargetOutOfRange &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Drink: {
+            try {
+                auto supplier = getCharacterByName(command.words[0]);
+                auto drinker = getCharacterByName(command.words[1]);
+
+                auto potionUser = std::dynamic_pointer_cast<PotionUser>(supplier);
+                potionUser->drink(drinker, command.words[2]);
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const CharacterDoesNotOwnItem &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Dialogue: {
+            try {
+                const std::string &speaker = command.words[0];
+                std::string speech;
+
+                for (std::size_t j = 1; j < command.words.size(); ++j) {
+                    speech += command.words[j] + " ";
+                }
+
+                if (speaker == "Narrator") {
+                    out << speaker << ": ";
+                }
+                else {
+                    getCharacterByName(speaker);
+                    out << speaker << ": ";
+                }
+
+                out << speech << '\n';
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::ShowCharacters: {
+            showCharacters();
+            break;
+        }
+        case CommandKind::ShowWeakest:
+        case CommandKind::ShowStrongest:
+        case CommandKind::ShowBelow: {
+            showCharactersByHealth(command);
+            break;
+        }
+        case CommandKind::Give: {
+            try {
+                auto giver = getCharacterByName(command.words[0]);
+                auto receiver = getCharacterByName(command.words[1]);
+                const std::string &itemName = command.words[2];
+
+                auto item = itemIndex.find(itemName, *giver);
+                if (item == nullptr) {
+                    throw CharacterDoesNotOwnItem();
+                }
+
+                // Containers keep a single item with a name
+                if (itemIndex.owns(itemName, *receiver)) {
+                    throw IllegalItemType();
+                }
+
+                // The receiver checks the kind and the capacity before the giver lets the item go
+                ItemCounts receiverItems = receiver->countItems();
+                ItemCounts giverItems = giver->countItems();
+                receiver->obtainItem(item);
+                giver->loseItem(item);
+                recountItems(*receiver, receiverItems);
+                if (giver != receiver) {
+                    recountItems(*giver, giverItems);
+                }
+                itemIndex.transfer(item, receiver);
+                ++giver->version;
+                ++receiver->version;
+                out << command.words[0] << " gives " << itemName << " to " << command.words[1] << ".\n";
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const CharacterDoesNotOwnItem &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            catch (const FullContainer &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::ShowOwners: {
+            showOwners(command.words[0]);
+            break;
+        }
+        case CommandKind::Apply: {
+            applyEffect(command);
+            break;
+        }
+        case CommandKind::Tick: {
+            tick(command.value);
+            break;
+        }
+        case CommandKind::Move: {
+            moveCharacter(command.words[0], command.value, command.count);
+            break;
+        }
+        case CommandKind::ShowNearby: {
+            showNearby(command.words[0], command.value);
+            break;
+        }
+        case CommandKind::MoveTo: {
+            moveCharacterTo(command.words[0], command.x, command.y);
+            break;
+        }
+        case CommandKind::Map: {
+            if (pathFinder.reset(command.value, command.count)) {
+                out << "The map is " << command.value << " by " << command.count << ".\n";
+            }
+            else {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Obstacle: {
+            bool isAdded = (command.words[0] == "add");
+            if (command.value > 0 && command.count > 0
+                && pathFinder.setBlocked(command.x, command.y, command.value, command.count, isAdded)) {
+                out << "Obstacle " << (isAdded ? "added" : "removed") << " from (" << command.x << ", " << command.y
+                    << ") to (" << (long long) command.x + command.value - 1 << ", "
+                    << (long long) command.y + command.count - 1 << ").\n";
+            }
+            else {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::ShowWeapons: {
+            try {
+                auto owner = getCharacterByName(command.words[0]);
+
+                // Check whether the character can use weapons
+                if (dynamic_cast<WeaponUser *>(owner.get())) {
+                    auto weaponUser = std::dynamic_pointer_cast<WeaponUser>(owner);
+                    weaponUser->showWeapons();
+                }
+                else {
+                    throw IllegalItemType();
+                }
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::ShowPotions: {
+            try {
+                auto owner = getCharacterByName(command.words[0]);
+
+                auto potionUser = std::dynamic_pointer_cast<PotionUser>(owner);
+                potionUser->showPotions();
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::ShowSpells: {
+            try {
+                auto owner = getCharacterByName(command.words[0]);
+
+                // Check whether the character can use spells
+                if (dynamic_cast<SpellUser *>(owner.get())) {
+                    auto spellUser = std::dynamic_pointer_cast<SpellUser>(owner);
+                    spellUser->showSpells();
+                }
+                else {
+                    throw IllegalItemType();
+                }
+            }
+            catch (const CharacterDoesNotExist &) {
+                out << "Error caught\n";
+            }
+            catch (const IllegalItemType &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Repeat: {
+            for (int i = 0; i < command.count; ++i) {
+                for (const Command &inner: *command.body) {
+                    executeCommand(inner);
+                }
+            }
+            break;
+        }
+        case CommandKind::Macro: {
+            macros.detach();
+            (*macros)[command.words[0]] = command;
+            break;
+        }
+        case CommandKind::Call: {
+            auto macro = macros->find(command.words[0]);
+            if (macro == macros->end() || macro->second.words.size() != command.words.size() || callDepth == maxCallDepth
+                || !argumentsFit(*macro->second.body, command)) {
+                out << "Error caught\n";
+                break;
+            }
+
+            // The body is held while it runs, the macro may be defined again by its own commands
+            auto body = macro->second.body;
+            const Command *caller = arguments;
+            arguments = &command;
+            ++callDepth;
+            try {
+                for (const Command &inner: *body) {
+                    executeCommand(inner);
+                }
+            }
+            catch (...) {
+                --callDepth;
+                arguments = caller;
+                throw;
+            }
+            --callDepth;
+            arguments = caller;
+            break;
+        }
+        case CommandKind::Export: {
+            try {
+                exportRoster(command.words[0]);
+            }
+            catch (const std::runtime_error &) {
+                out << "Error caught\n";
+            }
+            break;
+        }
+        case CommandKind::Stats: {
+            showStatistics();
+            break;
+        }
+        case CommandKind::Invalid: {
+            throw std::runtime_error("Unexpected command");
+        }
+        default:
+            break;
+    }
+}
+
+std::string Game::takeOutput()
+{
+    return output.take();
+}
+
+void Game::writeOutput(const std::string &text)
+{
+    TraceSpan span("output");
+    outputFile.write(text.data(), text.size());
+}
+
+void Game::runSequential(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        Command command = parseCommand(input);
+        if (command.kind == CommandKind::EndOfInput) {
+            break;
+        }
+        executeCommand(command);
+        recordCommand(command);
+
+        // Writing the output in large chunks
+        if (output.length() >= outputChunkSize) {
+            writeOutput(takeOutput());
+        }
+    }
+
+    writeOutput(takeOutput());
+}
+
+void Game::runPipelined(int count)
+{
+    // Parsed commands on their way from the parser to the game logic, in batches to amortize the hand-over,
+    // an empty batch ends the input
+    SpscRing<std::vector<Command>> commands(16);
+
+    // Output text on its way from the game logic to the writer, an empty record ends the output
+    SpscRing<std::string> records(16);
+
+    // Parser stage
+    std::thread parser([this, count, &commands]()
+    {
+        std::vector<Command> batch;
+        for (int i = 0; i < count; ++i) {
+            Command command = parseCommand(input);
+            if (command.kind == CommandKind::EndOfInput) {
+                break;
+            }
+            batch.push_back(std::move(command));
+
+            if (batch.size() == commandBatchSize) {
+                commands.push(std::move(batch));
+                batch = std::vector<Command>();
+                batch.reserve(commandBatchSize);
+            }
+        }
+
+        if (!batch.empty()) {
+            commands.push(std::move(batch));
+        }
+        commands.push(std::vector<Command>());
+    });
+
+    // Writer stage
+    std::thread writer([this, &records]()
+    {
+        for (std::string record = records.pop(); !record.empty(); record = records.pop()) {
+            writeOutput(record);
+        }
+    });
+
+    // Game logic stage, the commands after a failure are drained to let the parser finish
+    std::exception_ptr failure;
+    for (std::vector<Command> batch = commands.pop(); !batch.empty(); batch = commands.pop()) {
+        if (failure) {
+            continue;
+        }
+
+        for (const Command &command: batch) {
+            try {
+                executeCommand(command);
+                recordCommand(command);
+            }
+            catch (...) {
+                failure = std::current_exception();
+                break;
+            }
+        }
+
+        if (output.length() >= outputChunkSize) {
+            records.push(takeOutput());
+        }
+    }
+
+    std::string text = takeOutput();
+    if (!text.empty()) {
+        records.push(std::move(text));
+    }
+    records.push(std::string());
+
+    parser.join();
+    writer.join();
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+void Game::recordCommand(const Command &command)
+{
+    if (!journal) {
+        return;
+    }
+
+    switch (command.kind) {
+        case CommandKind::CreateCharacter:
+        case CommandKind::CreateWeapon:
+        case CommandKind::CreatePotion:
+        case CommandKind::CreateSpell:
+        case CommandKind::CreateCharacters:
+        case CommandKind::CreateWeapons:
+        case CommandKind::CreatePotions:
+        case CommandKind::Attack:
+        case CommandKind::Cast:
+        case CommandKind::Drink:
+        case CommandKind::Give:
+        case CommandKind::Apply:
+        case CommandKind::Tick:
+        case CommandKind::Move:
+        case CommandKind::MoveTo:
+        case CommandKind::Map:
+        case CommandKind::Obstacle:
+        case CommandKind::Repeat:
+        case CommandKind::Macro:
+        case CommandKind::Call:
+            journal->append(command);
+            break;
+        default:
+            break;
+    }
+}
+
+void Game::enableJournal(const std::string &path, std::size_t groupSize, std::chrono::milliseconds groupInterval)
+{
+    // Replaying the journal without output
+    OutputBuffer discarded(1 << 12, true);
+    commandOutput = &discarded;
+    for (const Command &command: CommandJournal::recover(path)) {
+        executeCommand(command);
+    }
+    commandOutput = nullptr;
+
+    journal = std::make_unique<CommandJournal>(path, groupSize, groupInterval);
+}
+
+void Game::executeCommandInto(const Command &command, std::string &text)
+{
+    // Buffer reused by the commands executed on the current thread
+    static thread_local OutputBuffer buffer;
+
+    commandOutput = &buffer;
+    try {
+        executeCommand(command);
+    }
+    catch (...) {
+        commandOutput = nullptr;
+        text = buffer.take();
+        throw;
+    }
+    commandOutput = nullptr;
+
+    text = buffer.take();
+}
+
+void Game::runParallel(int count)
+{
+    WorkerPool &workers = getWorkers();
+
+    // Workers execute the commands on behalf of this session,
+    // the calling thread takes part and returns to its own session afterwards
+    std::shared_ptr<Game> self = shared_from_this();
+    std::shared_ptr<Game> caller = threadGame;
+    WorkersRelease release{*this};
+
+    std::vector<Command> window;
+    std::vector<std::string> outputs;
+    std::vector<int> levels;
+    std::vector<std::vector<std::size_t>> commandsByLevel;
+
+    int remaining = count;
+    while (remaining > 0) {
+
+        // Reading the window
+        window.clear();
+        while (window.size() < parallelWindowSize && remaining > 0) {
+            Command command = parseCommand(input);
+            if (command.kind == CommandKind::EndOfInput) {
+                remaining = 0;
+                break;
+            }
+            --remaining;
+            window.push_back(std::move(command));
+        }
+
+        // Assigning levels: a command runs after every preceding command it conflicts with,
+        // the map stores the last level that changed and the last level that read a character
+        std::unordered_map<std::string_view, std::pair<int, int>> lastAccess;
+        levels.assign(window.size(), 0);
+        int floor = 0;
+        int top = 0;
+        for (std::size_t i = 0; i < window.size(); ++i) {
+            CommandAccess access = analyzeCommand(window[i]);
+            int level = floor + 1;
+
+            if (access.isBarrier) {
+                level = top + 1;
+                floor = level;
+            }
+            else {
+                for (auto name: access.reads) {
+                    auto found = lastAccess.find(name);
+                    if (found != lastAccess.end()) {
+                        level = std::max(level, found->second.first + 1);
+                    }
+                }
+                for (auto name: access.writes) {
+                    auto found = lastAccess.find(name);
+                    if (found != lastAccess.end()) {
+                        level = std::max(level, std::max(found->second.first, found->second.second) + 1);
+                    }
+                }
+
+                for (auto name: access.reads) {
+                    auto &last = lastAccess[name];
+                    last.second = std::max(last.second, level);
+                }
+                for (auto name: access.writes) {
+                    lastAccess[name].first = level;
+                }
+            }
+
+            levels[i] = level;
+            top = std::max(top, level);
+        }
+
+        commandsByLevel.assign(top + 1, std::vector<std::size_t>());
+        for (std::size_t i = 0; i < window.size(); ++i) {
+            commandsByLevel[levels[i]].push_back(i);
+        }
+
+        // Executing the levels one after another
+        outputs.assign(window.size(), std::string());
+        std::size_t executed = window.size();
+        std::exception_ptr failure;
+        for (auto &level: commandsByLevel) {
+            try {
+                if (level.size() == 1) {
+                    executeCommandInto(window[level[0]], outputs[level[0]]);
+                }
+                else if (!level.empty()) {
+                    workers.run(level.size(), [&](std::size_t j)
+                    {
+                        makeCurrent(self);
+                        executeCommandInto(window[level[j]], outputs[level[j]]);
+                    });
+                    makeCurrent(caller);
+                }
+            }
+            catch (...) {
+
+                // Only a barrier fails, it runs alone after everything preceding it
+                failure = std::current_exception();
+                executed = level[0] + 1;
+                break;
+            }
+        }
+
+        // Writing the output in the order of the commands
+        for (std::size_t i = 0; i < executed; ++i) {
+            writeOutput(outputs[i]);
+            recordCommand(window[i]);
+        }
+
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+    }
+}
+
+WorkerPool &Game::getWorkers()
+{
+    if (!workers) {
+        workers = std::make_unique<WorkerPool>(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    }
+    return *workers;
+}
+
+Game::WorkersRelease::~WorkersRelease()
+{
+    std::thread::id caller = std::this_thread::get_id();
+    game.workers->runOnEveryThread([&]()
+    {
+        if (std::this_thread::get_id() != caller) {
+            makeCurrent(nullptr);
+        }
+    });
+}
+
+void Game::speculateCommand(const Command &command, SpeculativeResult &result)
+{
+    speculation = &result;
+    try {
+        executeCommandInto(command, result.text);
+    }
+    catch (...) {
+        speculation = nullptr;
+        throw;
+    }
+    speculation = nullptr;
+}
+
+void Game::runSpeculative(int count)
+{
+    WorkerPool &workers = getWorkers();
+
+    // Workers execute the commands on behalf of this session,
+    // the calling thread takes part and returns to its own session afterwards
+    std::shared_ptr<Game> self = shared_from_this();
+    std::shared_ptr<Game> caller = threadGame;
+    WorkersRelease release{*this};
+
+    std::vector<Command> batch;
+    std::vector<SpeculativeResult> results;
+    std::vector<std::size_t> speculated;
+
+    int remaining = count;
+    while (remaining > 0) {
+
+        // Reading the batch
+        batch.clear();
+        while (batch.size() < speculativeBatchSize && remaining > 0) {
+            Command command = parseCommand(input);
+            if (command.kind == CommandKind::EndOfInput) {
+                remaining = 0;
+                break;
+            }
+            --remaining;
+            batch.push_back(std::move(command));
+        }
+
+        // Commands that change the game beyond the effects of items or read every character
+        // are not speculated, they are executed in order
+        speculated.clear();
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            switch (batch[i].kind) {
+                case CommandKind::Attack:
+                case CommandKind::Cast:
+                case CommandKind::Drink:
+                case CommandKind::Dialogue:
+                case CommandKind::ShowWeapons:
+                case CommandKind::ShowPotions:
+                case CommandKind::ShowSpells:
+                    speculated.push_back(i);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // Speculating against the state at the beginning of the batch
+        results.assign(batch.size(), SpeculativeResult());
+        std::uint64_t createdBefore = createdCharacters;
+        workers.run(speculated.size(), [&](std::size_t j)
+        {
+            makeCurrent(self);
+            speculateCommand(batch[speculated[j]], results[speculated[j]]);
+        });
+        makeCurrent(caller);
+
+        // Applying the results in order
+        std::size_t next = 0;
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            bool isSpeculated = (next < speculated.size() && speculated[next] == i);
+            if (isSpeculated) {
+                ++next;
+            }
+
+            SpeculativeResult &result = results[i];
+            bool isValid = isSpeculated && !(result.missed && createdCharacters != createdBefore);
+            for (std::size_t j = 0; isValid && j < result.observed.size(); ++j) {
+                isValid = (result.observed[j].first->version == result.observed[j].second);
+            }
+
+            if (isValid) {
+                output << result.text;
+                if (result.item) {
+                    result.item->commitUse(result.target, result.effect);
+                }
+            }
+            else {
+
+                // Rolling back: the speculative result is dropped and the command is executed again
+                if (isSpeculated) {
+                    ++reexecutedCommands;
+                }
+                executeCommand(batch[i]);
+            }
+            recordCommand(batch[i]);
+        }
+
+        // Writing the output in large chunks
+        if (output.length() >= outputChunkSize) {
+            writeOutput(takeOutput());
+        }
+    }
+
+    writeOutput(takeOutput());
+}
+
+void Game::startNewGame(ExecutionMode mode)
+{
+
+    // Processing Input
+
+    int N = 0;
+    input >> N;
+
+    if (mode == ExecutionMode::Pipelined) {
+        runPipelined(N);
+    }
+    else if (mode == ExecutionMode::Parallel) {
+        runParallel(N);
+    }
+    else if (mode == ExecutionMode::Speculative) {
+        runSpeculative(N);
+    }
+    else {
+        runSequential(N);
+    }
+
+    // Closing files
+
+    input.close();
+    outputFile.close();
+    if (journal) {
+        journal->commit();
+    }
+}
+
+std::shared_ptr<Game> Game::currentGame()
+{
+    if (threadGame != nullptr) {
+        return threadGame;
+    }
+
+    if (game == nullptr) {
+        // Single instance is created, smart pointer is used
+        game.reset(new Game());
+    }
+    return game;
+}
+
+std::shared_ptr<Game> Game::newSession()
+{
+    return std::shared_ptr<Game>(new Game("", ""));
+}
+
+std::shared_ptr<Game> Game::newSession(const std::string &inputPath, const std::string &outputPath)
+{
+    return std::shared_ptr<Game>(new Game(inputPath, outputPath));
+}
+
+std::shared_ptr<Game> Game::fork()
+{
+    std::lock_guard<std::shared_mutex> lock(rosterMutex);
+    std::shared_ptr<Game> branch(new Game(*this));
+
+    // The characters existing now belong to neither generation, so both sessions copy them before a change
+    generation = ++generations;
+    branch->generation = ++generations;
+    return branch;
+}
+
+void Game::privatize(std::shared_ptr<Character> character)
+{
+    ItemCopies copiedItems;
+    auto copy = character->clone(copiedItems);
+    copy->generation = generation;
+
+    // The index of names, the spatial hash and the status effects keep the ordinal, which the copy shares
+    healthIndex.replace(*character, *copy);
+    itemIndex.replaceOwner(*character, copy, copiedItems);
+    characters.replace(std::move(copy));
+}
+
+void Game::privatizeWrites(const Command &command)
+{
+
+    // Commands reading the roster copy nothing, the commands of a block or a macro are checked one by one,
+    // and Tick copies the targets of the status effects as they act
+    switch (command.kind) {
+        case CommandKind::Dialogue:
+        case CommandKind::ShowCharacters:
+        case CommandKind::ShowWeapons:
+        case CommandKind::ShowPotions:
+        case CommandKind::ShowSpells:
+        case CommandKind::ShowWeakest:
+        case CommandKind::ShowStrongest:
+        case CommandKind::ShowBelow:
+        case CommandKind::ShowOwners:
+        case CommandKind::ShowNearby:
+        case CommandKind::Map:
+        case CommandKind::Obstacle:
+        case CommandKind::Repeat:
+        case CommandKind::Macro:
+        case CommandKind::Call:
+        case CommandKind::Export:
+        case CommandKind::Stats:
+        case CommandKind::Tick:
+        case CommandKind::Unknown:
+            return;
+        default:
+            break;
+    }
+
+    std::lock_guard<std::shared_mutex> lock(rosterMutex);
+    auto privatizeNamed = [&](const std::string &name)
+    {
+        auto named = charactersByName.find(name);
+        if (named == nullptr) {
+            return;
+        }
+
+        // Copies take the places of the characters by ordinal, the index of names stays as it is
+        for (std::uint64_t ordinal: *named) {
+            auto character = characters.find(ordinal);
+            if (character->generation != generation) {
+                privatize(std::move(character));
+            }
+        }
+    };
+
+    switch (command.kind) {
+        case CommandKind::CreateCharacter:
+        case CommandKind::CreateCharacters:
+            break;
+        case CommandKind::CreateWeapons:
+        case CommandKind::CreatePotions: {
+            std::string ownerName = command.words[0];
+            for (int i = 0; i < command.count; ++i) {
+                ownerName.resize(command.words[0].size());
+                ownerName += std::to_string(i);
+                privatizeNamed(ownerName);
+            }
+            break;
+        }
+        case CommandKind::Apply:
+            privatizeNamed(command.words[1]);
+            break;
+        default:
+            for (std::string_view name: analyzeCommand(command).writes) {
+                privatizeNamed(std::string(name));
+            }
+            break;
+    }
+}
+
+void Game::makeCurrent(const std::shared_ptr<Game> &session)
+{
+    if (threadGame != session) {
+        threadGame = session;
+    }
+}
+
+void Game::redirectOutput(OutputBuffer *buffer)
+{
+    commandOutput = buffer;
+}
+
+bool Game::executeScript(std::istream &script, std::string &text)
+{
+    bool isComplete = true;
+
+    int N = 0;
+    script >> N;
+    try {
+        for (int i = 0; i < N; ++i) {
+            Command command = parseCommand(script);
+            if (command.kind == CommandKind::EndOfInput) {
+                break;
+            }
+            executeCommand(command);
+            recordCommand(command);
+        }
+    }
+    catch (const std::exception &) {
+        isComplete = false;
+    }
+    catch (...) {
+        isComplete = false;
+    }
+
+    text = takeOutput();
+    return isComplete;
+}
+
+std::shared_ptr<Game> Game::resetGame(const std::string &inputPath, const std::string &outputPath)
+{
+    game.reset(new Game(inputPath, outputPath));
+    return game;
+}
+
+void Game::destroyCharacter(std::shared_ptr<Character> ptr)
+{
+    TraceSpan span("death", ptr->name);
+    {
+        std::lock_guard<std::shared_mutex> lock(rosterMutex);
+        characters.erase(*ptr);
+        healthIndex.erase(*ptr);
+        statistics.erase(ptr->getClass(), ptr->healthPoints);
+        spatialHash.erase(*ptr);
+
+        auto &vec = *charactersByName.findWritable(ptr->name);
+        vec.erase(std::find(vec.begin(), vec.end(), ptr->ordinal));
+        if (vec.empty()) {
+            charactersByName.erase(ptr->name);
+        }
+    }
+    // Dropping the items releases the references they keep to their owner
+    ItemCounts items = ptr->countItems();
+    for (auto &item: ptr->getItems()) {
+        itemIndex.erase(*item);
+        ptr->loseItem(item);
+    }
+    recountItems(*ptr, items);
+    ptr->isAlive = false;
+    ++ptr->version;
+    getOutput() << ptr->getName() << " has died...\n";
+    ptr.reset();
+}
+
+void Game::reindexHealth(const Character &character, int previousHealth)
+{
+    healthIndex.update(character, previousHealth);
+    statistics.updateHealth(character.getClass(), character.healthPoints - previousHealth);
+}
+
+void Game::unindexItem(const PhysicalItem &item)
+{
+    itemIndex.erase(item);
+}
+
+void Game::recountItems(const Character &character, const ItemCounts &before)
+{
+    statistics.updateItems(before, character.countItems());
+}
+
+SpeculativeResult *Game::currentSpeculation()
+{
+    return speculation;
+}
+
+std::size_t Game::getReexecutedCommands() const
+{
+    return reexecutedCommands;
+}
+
+OutputBuffer &Game::getOutput()
+{
+    if (commandOutput != nullptr) {
+        return *commandOutput;
+    }
+    return output;
+}
+
+// Setting the static variables
+
+inline int Fighter::maxAllowedWeapons{3};
+
+inline int Fighter::maxAllowedPotions{5};
+
+inline int Archer::maxAllowedWeapons{2};
+
+inline int Archer::maxAllowedPotions{3};
+
+inline int Archer::maxAllowedSpells{2};
+
+inline int Wizard::maxAllowedPotions{10};
+
+inline int Wizard::maxAllowedSpells{10};
+
+inline int Fighter::attackRange{2};
+
+inline int Archer::attackRange{8};
+
+inline int Archer::castRange{4};
+
+inline int Wizard::castRange{6};
+
+// Server
+
+#ifndef _WIN32
+
+/// <summary>
+/// Writes the whole buffer to a socket.
+/// </summary>
+/// <param name="socket"> descriptor of the socket </param>
+/// <param name="data"> bytes to write </param>
+/// <returns> true on success else false </returns>
+bool sendAll(int socket, std::string_view data)
+{
+    while (!data.empty()) {
+        ssize_t sent = send(socket, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data.remove_prefix(sent);
+    }
+    return true;
+}
+
+/// <summary>
+/// Class SocketReader represents buffered reading of a socket.
+/// </summary>
+class SocketReader
+{
+private:
+    // Descriptor of the socket
+    int socket;
+
+    // Received bytes that were not consumed yet
+    std::string buffer;
+
+    /// <summary>
+    /// Receives the next portion of bytes into the buffer.
+    /// </summary>
+    /// <returns> true if bytes were received, false if the connection is closed </returns>
+    bool receive()
+    {
+        char chunk[1 << 16];
+        ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            return false;
+        }
+        buffer.append(chunk, received);
+        return true;
+    }
+public:
+
+    // Constructor
+    SocketReader(int socket)
+        : socket(socket), buffer()
+    {}
+
+    /// <summary>
+    /// Reads a line without its line break.
+    /// </summary>
+    /// <param name="line"> receiver of the line </param>
+    /// <param name="limit"> largest length of the line </param>
+    /// <returns> true on success, false if the connection is closed or the line is too long </returns>
+    bool readLine(std::string &line, std::size_t limit = std::string::npos)
+    {
+        std::size_t end;
+        while ((end = buffer.find('\n')) == std::string::npos) {
+            if (buffer.size() > limit || !receive()) {
+                return false;
+            }
+        }
+        if (end > limit) {
+            return false;
+        }
+        line.assign(buffer, 0, end);
+        buffer.erase(0, end + 1);
+        return true;
+    }
+
+    /// <summary>
+    /// Reads the given number of bytes.
+    /// </summary>
+    /// <param name="size"> number of bytes </param>
+    /// <param name="data"> receiver of the bytes </param>
+    /// <returns> true on success, false if the connection is closed </returns>
+    bool readExactly(std::size_t size, std::string &data)
+    {
+        while (buffer.size() < size) {
+            if (!receive()) {
+                return false;
+            }
+        }
+        data.assign(buffer, 0, size);
+        buffer.erase(0, size);
+        return true;
+    }
+};
+
+/// <summary>
+/// Class GameServer represents a daemon that keeps named sessions resident
+/// and executes scripts sent over a local Unix domain socket.
+/// 
+/// A request is a line with the session name and the size of the script followed by the script.
+/// A response is a line with the status (OK or ERROR) and the size of the output followed by the output.
+/// </summary>
+class GameServer
+{
+private:
+
+    /// <summary>
+    /// Structure to represent a resident session.
+    /// </summary>
+    struct Session
+    {
+        // State of the game
+        std::shared_ptr<Game> game;
+
+        // Serializes the scripts of the session
+        std::mutex mutex;
+    };
+
+    // Path to the socket
+    std::string socketPath;
+
+    // Descriptor of the listening socket
+    int listener;
+
+    // Largest script accepted in a request, a larger one is refused before it is received
+    static constexpr std::size_t maxRequestBytes = std::size_t(64) << 20;
+
+    // Longest header line of a request
+    static constexpr std::size_t maxHeaderBytes = 4096;
+
+    // Resident sessions by name
+    std::unordered_map<std::string, std::shared_ptr<Session>> sessions;
+
+    // Guards the sessions map
+    std::mutex sessionsMutex;
+
+    /// <summary>
+    /// Finds a session by name, creating it on first use.
+    /// </summary>
+    /// <param name="name"> name of the session </param>
+    /// <returns> pointer to the session </returns>
+    std::shared_ptr<Session> getSession(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex);
+        auto &session = sessions[name];
+        if (!session) {
+            session = std::make_shared<Session>();
+            session->game = Game::newSession();
+        }
+        return session;
+    }
+
+    /// <summary>
+    /// Serves the requests of a connected client until it disconnects.
+    /// </summary>
+    /// <param name="connection"> descriptor of the connection </param>
+    void serveClient(int connection)
+    {
+        SocketReader reader(connection);
+        std::string header;
+        std::string script;
+        std::string text;
+
+        // A connection ends on any failure of its own, such as running out of memory while receiving,
+        // the thread is detached and an escaping exception would stop the daemon
+        try {
+            while (reader.readLine(header, maxHeaderBytes)) {
+                std::istringstream fields(header);
+                std::string name;
+                std::size_t size = 0;
+                if (!(fields >> name >> size)) {
+                    break;
+                }
+
+                // The script of an oversized request is not received, the connection cannot be resumed after it
+                if (size > maxRequestBytes) {
+                    sendAll(connection, "ERROR 0\n");
+                    break;
+                }
+                if (!reader.readExactly(size, script)) {
+                    break;
+                }
+
+                // A failing request is reported to its client, it must not stop the other sessions
+                bool isComplete = false;
+                text.clear();
+                try {
+                    auto session = getSession(name);
+                    std::lock_guard<std::mutex> lock(session->mutex);
+                    Game::makeCurrent(session->game);
+                    std::istringstream scriptStream(script);
+                    isComplete = session->game->executeScript(scriptStream, text);
+                }
+                catch (...) {
+                    isComplete = false;
+                }
+                Game::makeCurrent(nullptr);
+
+                std::string response = (isComplete ? "OK " : "ERROR ") + std::to_string(text.size()) + "\n";
+                if (!sendAll(connection, response) || !sendAll(connection, text)) {
+                    break;
+                }
+            }
+        }
+        catch (const std::exception &) {
+        }
+        close(connection);
+    }
+public:
+
+    // Constructor
+    GameServer(const std::string &socketPath)
+        : socketPath(socketPath), listener(-1), sessions()
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long");
+        }
+        std::copy(socketPath.begin(), socketPath.end(), address.sun_path);
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath.c_str());
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+            || listen(listener, 128) != 0) {
+            throw std::runtime_error("Cannot listen on " + socketPath);
+        }
+    }
+
+    // Destructor
+    ~GameServer()
+    {
+        close(listener);
+        unlink(socketPath.c_str());
+    }
+
+    /// <summary>
+    /// Accepts clients forever, each client is served by its own thread.
+    /// </summary>
+    void run()
+    {
+        while (true) {
+            int connection = accept(listener, nullptr, nullptr);
+            if (connection < 0) {
+                continue;
+            }
+            std::thread(&GameServer::serveClient, this, connection).detach();
+        }
+    }
+};
+
+/// <summary>
+/// Connects to a game server.
+/// </summary>
+/// <param name="socketPath"> path to the socket </param>
+/// <returns> descriptor of the connection </returns>
+int connectToServer(const std::string &socketPath)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::copy(socketPath.begin(), socketPath.begin() + std::min(socketPath.size(), sizeof(address.sun_path) - 1),
+              address.sun_path);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        throw std::runtime_error("Cannot connect to " + socketPath);
+    }
+    return connection;
+}
+
+/// <summary>
+/// Measures the request latency and the sustained throughput of a game server
+/// under concurrent clients, each sending the script to its own session.
+/// </summary>
+/// <param name="socketPath"> path to the socket </param>
+/// <param name="clients"> number of concurrent clients </param>
+/// <param name="requests"> number of requests per client </param>
+/// <param name="scriptPath"> path to the script sent with every request </param>
+void runClientBenchmark(const std::string &socketPath, int clients, int requests, const std::string &scriptPath)
+{
+    std::ifstream scriptFile(scriptPath, std::ios::binary);
+    std::string script((std::istreambuf_iterator<char>(scriptFile)), std::istreambuf_iterator<char>());
+    int commandsPerScript = 0;
+    std::istringstream(script) >> commandsPerScript;
+
+    std::vector<std::vector<double>> latencies(clients);
+    std::atomic<int> failures(0);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c]()
+        {
+            int connection = connectToServer(socketPath);
+            SocketReader reader(connection);
+            std::string request = "client" + std::to_string(c) + " " + std::to_string(script.size()) + "\n" + script;
+            std::string header;
+            std::string text;
+
+            for (int r = 0; r < requests; ++r) {
+                auto sentAt = std::chrono::steady_clock::now();
+                std::size_t size = 0;
+                if (!sendAll(connection, request) || !reader.readLine(header)
+                    || !(std::istringstream(header.substr(header.find(' ') + 1)) >> size)
+                    || !reader.readExactly(size, text)) {
+                    ++failures;
+                    break;
+                }
+                if (header.rfind("OK", 0) != 0) {
+                    ++failures;
+                }
+                std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - sentAt;
+                latencies[c].push_back(latency.count());
+            }
+            close(connection);
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::vector<double> all;
+    for (auto &clientLatencies: latencies) {
+        all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    if (all.empty()) {
+        std::cout << "no successful requests\n";
+        return;
+    }
+
+    std::cout << all.size() << " requests from " << clients << " clients in " << elapsed.count() * 1000 << " ms\n"
+              << "latency p50 " << all[all.size() / 2] << " us, p99 " << all[all.size() * 99 / 100]
+              << " us, max " << all.back() << " us\n"
+              << "throughput " << all.size() / elapsed.count() << " requests/s, "
+              << all.size() * commandsPerScript / elapsed.count() << " commands/s\n";
+    if (failures > 0) {
+        std::cout << failures << " failed requests\n";
+    }
+}
+
+#endif
+
+// Ingestion
+
+/// <summary>
+/// Structure to represent a command submitted by a player.
+/// </summary>
+struct PlayerCommand
+{
+    // Tag of the player who submitted the command
+    std::uint32_t player = 0;
+
+    // Parsed command, EndOfInput stops the game-logic thread
+    Command command;
+};
+
+/// <summary>
+/// Class CommandIngestion represents the front end that accepts the commands of many players
+/// from their own threads and executes them against a session on a single game-logic thread.
+/// Commands of a player are executed in the order the player submitted them.
+/// </summary>
+class CommandIngestion
+{
+private:
+    // Session the commands are executed against
+    std::shared_ptr<Game> session;
+
+    // Commands waiting for the game-logic thread
+    MpscQueue<PlayerCommand> queue;
+
+    // Receiver of the output of every command, called on the game-logic thread
+    std::function<void(std::uint32_t, std::string &)> deliver;
+
+    // Game-logic thread
+    std::thread logic;
+
+    /// <summary>
+    /// Main loop of the game-logic thread.
+    /// </summary>
+    void run()
+    {
+        Game::makeCurrent(session);
+        std::string text;
+        while (true) {
+            PlayerCommand submitted = queue.pop();
+            if (submitted.command.kind == CommandKind::EndOfInput) {
+                break;
+            }
+
+            // A malformed command of a player produces no output and does not stop the others
+            try {
+                session->executeCommandInto(submitted.command, text);
+                session->recordCommand(submitted.command);
+            }
+            catch (const std::runtime_error &) {
+            }
+            deliver(submitted.player, text);
+        }
+        Game::makeCurrent(nullptr);
+    }
+public:
+
+    // Constructor
+    CommandIngestion(std::shared_ptr<Game> session,
+                     std::size_t capacity,
+                     std::function<void(std::uint32_t, std::string &)> deliver)
+        : session(std::move(session)), queue(capacity), deliver(std::move(deliver))
+    {
+        logic = std::thread(&CommandIngestion::run, this);
+    }
+
+    // Destructor
+    ~CommandIngestion()
+    {
+        close();
+    }
+
+    /// <summary>
+    /// Submits a command of a player, waiting while the queue is full. Safe to call from many threads.
+    /// </summary>
+    /// <param name="player"> tag of the player </param>
+    /// <param name="command"> parsed command </param>
+    void submit(std::uint32_t player, Command command)
+    {
+        queue.push({player, std::move(command)});
+    }
+
+    /// <summary>
+    /// Waits until the commands submitted so far are executed and stops the game-logic thread.
+    /// </summary>
+    void close()
+    {
+        if (logic.joinable()) {
+            queue.push({});
+            logic.join();
+        }
+    }
+};
+
+/// <summary>
+/// Plays the scripts of many players against one session, every script read by its own thread.
+/// The output of a player is written next to the script with the ".out" extension.
+/// </summary>
+/// <param name="scripts"> paths to the scripts of the players </param>
+void runPlayers(const std::vector<std::string> &scripts)
+{
+    std::vector<std::string> outputs(scripts.size());
+    {
+        CommandIngestion ingestion(Game::newSession(), 1 << 16, [&](std::uint32_t player, std::string &text)
+        {
+            outputs[player] += text;
+        });
+
+        std::vector<std::thread> players;
+        for (std::uint32_t player = 0; player < scripts.size(); ++player) {
+            players.emplace_back([&, player]()
+            {
+                std::ifstream script(scripts[player]);
+                int N = 0;
+                script >> N;
+                for (int i = 0; i < N; ++i) {
+                    Command command = parseCommand(script);
+
+                    // A script stops at its end or at a malformed command, as in a single-player game
+                    if (command.kind == CommandKind::EndOfInput || command.kind == CommandKind::Invalid) {
+                        break;
+                    }
+                    ingestion.submit(player, std::move(command));
+                }
+            });
+        }
+        for (auto &player: players) {
+            player.join();
+        }
+    }
+
+    for (std::size_t player = 0; player < scripts.size(); ++player) {
+        std::filesystem::path outputPath = scripts[player];
+        outputPath.replace_extension(".out");
+        std::ofstream output(outputPath, std::ios::binary);
+        output << outputs[player];
+    }
+}
+
+// Batch
+
+/// <summary>
+/// Collects the input/output pairs of a batch. A directory contributes every ".in" file
+/// with the output written next to it as ".out", any other file is a manifest
+/// with an input path and an output path per line.
+/// </summary>
+/// <param name="source"> path to the directory or the manifest </param>
+/// <returns> input/output pairs </returns>
+std::vector<std::pair<std::string, std::string>> collectBatch(const std::string &source)
+{
+    std::vector<std::pair<std::string, std::string>> scripts;
+    if (std::filesystem::is_directory(source)) {
+        for (const auto &entry: std::filesystem::directory_iterator(source)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".in") {
+                std::filesystem::path outputPath = entry.path();
+                outputPath.replace_extension(".out");
+                scripts.emplace_back(entry.path().string(), outputPath.string());
+            }
+        }
+        std::sort(scripts.begin(), scripts.end());
+        return scripts;
+    }
+
+    std::ifstream manifest(source);
+    if (!manifest) {
+        throw std::runtime_error("Cannot open " + source);
+    }
+    std::string inputPath;
+    std::string outputPath;
+    while (manifest >> inputPath >> outputPath) {
+        scripts.emplace_back(inputPath, outputPath);
+    }
+    return scripts;
+}
+
+/// <summary>
+/// Runs many scripts in one process on a thread pool, every script in its own session.
+/// </summary>
+/// <param name="source"> path to the directory or the manifest </param>
+/// <param name="threads"> number of threads, zero to use every core </param>
+/// <returns> number of scripts that failed </returns>
+std::size_t runBatch(const std::string &source, unsigned int threads)
+{
+    std::vector<std::pair<std::string, std::string>> scripts = collectBatch(source);
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::atomic<std::size_t> failures(0);
+    auto start = std::chrono::steady_clock::now();
+    {
+        WorkerPool workers(threads - 1);
+        workers.run(scripts.size(), [&](std::size_t i)
+        {
+            auto session = Game::newSession(scripts[i].first, scripts[i].second);
+            Game::makeCurrent(session);
+            try {
+                session->startNewGame(ExecutionMode::Sequential);
+            }
+            catch (const std::exception &error) {
+                ++failures;
+                std::cerr << scripts[i].first << ": " << error.what() << "\n";
+            }
+            Game::makeCurrent(nullptr);
+        });
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << scripts.size() << " scripts on " << threads << " threads in " << elapsed.count() * 1000 << " ms, "
+              << scripts.size() / elapsed.count() << " scripts/s";
+    if (failures > 0) {
+        std::cout << ", " << failures << " failed";
+    }
+    std::cout << "\n";
+    return failures;
+}
+
+// Auto-battle
+
+/// <summary>
+/// Structure to represent the ranges the loadouts of the simulated fights are drawn from.
+/// The capacities of the containers are the ones of the character classes.
+/// </summary>
+struct BattleRules
+{
+    // Range of the initial health points
+    int minHealth = 50;
+    int maxHealth = 150;
+
+    // Range of the damage of a weapon
+    int minDamage = 5;
+    int maxDamage = 25;
+
+    // Range of the heal value of a potion
+    int minHeal = 10;
+    int maxHeal = 40;
+
+    // Chance that a spell may be cast on the opponent, otherwise it may be cast only on its owner
+    double spellReach = 0.125;
+
+    // Number of turns after which a fight is a draw
+    int maxTurns = 200;
+};
+
+// Character classes taking part in the fights
+constexpr std::array<const char *, 3> battleClasses{"fighter", "archer", "wizard"};
+
+/// <summary>
+/// Structure to represent the outcomes of the fights by class matchup,
+/// every fight counts once for each of its sides from the point of view of that side.
+/// </summary>
+struct BattleTable
+{
+    // Fights, wins and draws of the class of the row against the class of the column
+    std::array<std::array<std::uint64_t, battleClasses.size()>, battleClasses.size()> fights{};
+    std::array<std::array<std::uint64_t, battleClasses.size()>, battleClasses.size()> wins{};
+    std::array<std::array<std::uint64_t, battleClasses.size()>, battleClasses.size()> draws{};
+};
+
+/// <summary>
+/// Class BattleSimulator plays randomized fights of two characters in its own session,
+/// so the fights follow the rules of the weapons, potions and spells of the game.
+/// </summary>
+class BattleSimulator
+{
+private:
+
+    /// <summary>
+    /// Structure to represent a side of a fight and the items it has left.
+    /// </summary>
+    struct Side
+    {
+        // Name of the character
+        std::string name;
+
+        // Health points at the start of the fight
+        int initialHealth = 0;
+
+        // Character instance, nothing between fights
+        std::shared_ptr<Character> character;
+
+        // Names of the weapons, the potions left and the spells left that may be cast on the opponent
+        std::vector<std::string> weapons;
+        std::vector<std::string> potions;
+        std::vector<std::string> spells;
+    };
+
+    // Ranges of the loadouts
+    const BattleRules &rules;
+
+    // Session the fights are played in, it is empty between fights
+    std::shared_ptr<Game> session;
+
+    // Receiver of the output of the fights, it discards everything
+    OutputBuffer discard;
+
+    // Sides of the current fight
+    std::array<Side, 2> sides;
+
+    // Command reused for every action
+    Command command;
+
+    // Names of the items, reused between fights
+    std::vector<std::string> itemNames;
+
+    /// <summary>
+    /// Executes the reused command against the session.
+    /// </summary>
+    /// <param name="kind"> kind of the command </param>
+    /// <param name="value"> value of the command </param>
+    void execute(CommandKind kind, int value = 0)
+    {
+        command.kind = kind;
+        command.value = value;
+        session->executeCommand(command);
+    }
+
+    /// <summary>
+    /// Getter for the name of the i-th item, the names are the same in every fight.
+    /// </summary>
+    /// <param name="i"> number of the item </param>
+    /// <returns> name of the item </returns>
+    const std::string &itemName(std::size_t i)
+    {
+        while (itemNames.size() <= i) {
+            itemNames.push_back("item" + std::to_string(itemNames.size()));
+        }
+        return itemNames[i];
+    }
+
+    /// <summary>
+    /// Hands a random loadout within the capacities of its class to a side.
+    /// </summary>
+    /// <param name="side"> side to equip </param>
+    /// <param name="opponent"> other side of the fight </param>
+    /// <param name="type"> number of the class in battleClasses </param>
+    /// <param name="random"> generator of the fight </param>
+    void equip(Side &side, const Side &opponent, std::size_t type, std::mt19937_64 &random)
+    {
+        int maxWeapons = 0;
+        int maxPotions = 0;
+        int maxSpells = 0;
+        if (type == 0) {
+            maxWeapons = Fighter::maxAllowedWeapons;
+            maxPotions = Fighter::maxAllowedPotions;
         }
-            // Cast to Spell
-        else if (dynamic_cast<Spell *>(item.get())) {
-            auto spell = std::dynamic_pointer_cast<Spell>(item);
-            spellBook.addItem(spell);
+        else if (type == 1) {
+            maxWeapons = Archer::maxAllowedWeapons;
+            maxPotions = Archer::maxAllowedPotions;
+            maxSpells = Archer::maxAllowedSpells;
         }
-            // Wizard cannot use such item
         else {
-            throw IllegalItemType();
+            maxPotions = Wizard::maxAllowedPotions;
+            maxSpells = Wizard::maxAllowedSpells;
+        }
+
+        std::uniform_int_distribution<int> damage(rules.minDamage, rules.maxDamage);
+        std::uniform_int_distribution<int> heal(rules.minHeal, rules.maxHeal);
+        std::bernoulli_distribution reaches(rules.spellReach);
+
+        // Weapon users carry at least one weapon
+        std::size_t next = 0;
+        int weapons = (maxWeapons > 0) ? std::uniform_int_distribution<int>(1, maxWeapons)(random) : 0;
+        for (int i = 0; i < weapons; ++i) {
+            command.words.assign({side.name, itemName(next++)});
+            execute(CommandKind::CreateWeapon, damage(random));
+            side.weapons.push_back(command.words[1]);
+        }
+
+        int potions = std::uniform_int_distribution<int>(0, std::max(maxPotions, 0))(random);
+        for (int i = 0; i < potions; ++i) {
+            command.words.assign({side.name, itemName(next++)});
+            execute(CommandKind::CreatePotion, heal(random));
+            side.potions.push_back(command.words[1]);
+        }
+
+        // Spells that may be cast only on their owner are kept, they take space in the spell book
+        int spells = std::uniform_int_distribution<int>(0, std::max(maxSpells, 0))(random);
+        for (int i = 0; i < spells; ++i) {
+            bool lethal = reaches(random);
+            command.words.assign({side.name, itemName(next++), lethal ? opponent.name : side.name});
+            execute(CommandKind::CreateSpell);
+            if (lethal) {
+                side.spells.push_back(command.words[1]);
+            }
         }
     }
 
     /// <summary>
-    /// Implementation of the abstract function that removes the item
-    /// from either the medicalBag or the spellBook.
+    /// Plays a turn of a side: a spell on the opponent if there is one, a potion when the health
+    /// dropped below a half, an attack with a random weapon otherwise.
     /// </summary>
-    /// <param name="item"></param>
-    void loseItem(std::shared_ptr<PhysicalItem> item) override
+    /// <param name="actor"> side making the turn </param>
+    /// <param name="opponent"> other side of the fight </param>
+    /// <param name="random"> generator of the fight </param>
+    void playTurn(Side &actor, Side &opponent, std::mt19937_64 &random)
     {
-        // Find the item in the medicalBag
-        if (medicalBag.find(item->getName())) {
-            medicalBag.removeItem(item->getName());
+        int health = actor.character->getHp();
+        if (!actor.spells.empty()) {
+            command.words.assign({actor.name, opponent.name, actor.spells.back()});
+            actor.spells.pop_back();
+            execute(CommandKind::Cast);
         }
-            // Find the item in the spellBook
-        else {
-            spellBook.removeItem(item->getName());
+        else if (!actor.potions.empty() && (2 * health < actor.initialHealth || actor.weapons.empty())) {
+            command.words.assign({actor.name, actor.name, actor.potions.back()});
+            actor.potions.pop_back();
+            execute(CommandKind::Drink);
+        }
+        else if (!actor.weapons.empty()) {
+            std::size_t weapon = std::uniform_int_distribution<std::size_t>(0, actor.weapons.size() - 1)(random);
+            command.words.assign({actor.name, opponent.name, actor.weapons[weapon]});
+            execute(CommandKind::Attack);
         }
-
-        // Release data
-        item.reset();
     }
 public:
 
     // Constructor
-    Wizard(const std::string nameString, int healthValue)
-        : Character(nameString, healthValue), PotionUser(nameString, healthValue, maxAllowedPotions),
-          SpellUser(nameString, healthValue, maxAllowedSpells)
-    {}
+    BattleSimulator(const BattleRules &rules)
+        : rules(rules), session(Game::newSession()), discard(1 << 12, true)
+    {
+        sides[0].name = "first";
+        sides[1].name = "second";
+        Game::makeCurrent(session);
+        Game::commandOutput = &discard;
+    }
 
     // Destructor
-    ~Wizard() = default;
+    ~BattleSimulator()
+    {
+        Game::commandOutput = nullptr;
+        Game::makeCurrent(nullptr);
+    }
 
     /// <summary>
-    /// Implementation of the print function.
+    /// Plays a fight of two characters with random health points and loadouts.
     /// </summary>
-    /// <param name="out"> reference to the output stream </param>
-    void print(std::ostream &out) const override
+    /// <param name="firstType"> number of the class of the first side in battleClasses </param>
+    /// <param name="secondType"> number of the class of the second side in battleClasses </param>
+    /// <param name="random"> generator of the fight </param>
+    /// <returns> number of the winning side, -1 for a draw </returns>
+    int play(std::size_t firstType, std::size_t secondType, std::mt19937_64 &random)
     {
-        out << getName() << ":wizard:" << getHp() << " ";
-    }
+        std::uniform_int_distribution<int> health(rules.minHealth, rules.maxHealth);
+        std::size_t types[2] = {firstType, secondType};
+        for (std::size_t i = 0; i < 2; ++i) {
+            Side &side = sides[i];
+            side.initialHealth = health(random);
+            command.words.assign({battleClasses[types[i]], side.name});
+            execute(CommandKind::CreateCharacter, side.initialHealth);
+            side.character = session->getCharacterByName(side.name);
+        }
+        for (std::size_t i = 0; i < 2; ++i) {
+            equip(sides[i], sides[1 - i], types[i], random);
+        }
 
-    // Maximum allowed number of potions
-    static int maxAllowedPotions;
+        // A coin decides who moves first
+        int winner = -1;
+        std::size_t actor = std::bernoulli_distribution(0.5)(random) ? 1 : 0;
+        for (int turn = 0; turn < rules.maxTurns && winner < 0; ++turn, actor = 1 - actor) {
+            playTurn(sides[actor], sides[1 - actor], random);
+            if (sides[1 - actor].character->getHp() <= 0) {
+                winner = actor;
+            }
+        }
 
-    // Maximum allowed number of spells
-    static int maxAllowedSpells;
+        // Removing the survivors leaves the session empty for the next fight
+        for (Side &side: sides) {
+            if (side.character->getHp() > 0) {
+                session->destroyCharacter(side.character);
+            }
+            side.character.reset();
+            side.weapons.clear();
+            side.potions.clear();
+            side.spells.clear();
+        }
+        return winner;
+    }
 };
 
-// Game Methods
+/// <summary>
+/// Plays fights for every class matchup in turn on a thread pool and aggregates the outcomes.
+/// The fights are cut into fixed blocks, each block seeds its own generator from the seed and its number,
+/// so the outcomes depend on the seed only and not on the number of threads.
+/// </summary>
+/// <param name="fights"> number of fights </param>
+/// <param name="seed"> seed of the simulation </param>
+/// <param name="threads"> number of threads, zero to use every core </param>
+/// <param name="rules"> ranges of the loadouts </param>
+/// <returns> the outcomes by class matchup </returns>
+BattleTable runBattles(std::uint64_t fights, std::uint64_t seed, unsigned int threads, const BattleRules &rules = {})
+{
+    constexpr std::uint64_t blockSize = 1024;
+    constexpr std::size_t classes = battleClasses.size();
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-inline std::shared_ptr<Game> Game::game{nullptr};
+    // Blocks add their counts once they are done, in any order
+    std::array<std::atomic<std::uint64_t>, classes * classes> fought{};
+    std::array<std::atomic<std::uint64_t>, classes * classes> won{};
+    std::array<std::atomic<std::uint64_t>, classes * classes> drawn{};
 
-std::shared_ptr<Character> Game::getCharacterByName(std::string name) const
+    WorkerPool workers(threads - 1);
+    workers.run((fights + blockSize - 1) / blockSize, [&](std::size_t block)
+    {
+        std::seed_seq sequence{std::uint32_t(seed), std::uint32_t(seed >> 32), std::uint32_t(block), std::uint32_t(block >> 32)};
+        std::mt19937_64 random(sequence);
+        BattleSimulator simulator(rules);
+
+        BattleTable counts;
+        std::uint64_t end = std::min(fights, (block + 1) * blockSize);
+        for (std::uint64_t fight = block * blockSize; fight < end; ++fight) {
+            std::size_t first = fight % (classes * classes) / classes;
+            std::size_t second = fight % classes;
+            int winner = simulator.play(first, second, random);
+
+            ++counts.fights[first][second];
+            ++counts.fights[second][first];
+            if (winner < 0) {
+                ++counts.draws[first][second];
+                ++counts.draws[second][first];
+            }
+            else if (winner == 0) {
+                ++counts.wins[first][second];
+            }
+            else {
+                ++counts.wins[second][first];
+            }
+        }
+
+        for (std::size_t i = 0; i < classes; ++i) {
+            for (std::size_t j = 0; j < classes; ++j) {
+                fought[i * classes + j].fetch_add(counts.fights[i][j], std::memory_order_relaxed);
+                won[i * classes + j].fetch_add(counts.wins[i][j], std::memory_order_relaxed);
+                drawn[i * classes + j].fetch_add(counts.draws[i][j], std::memory_order_relaxed);
+            }
+        }
+    });
+
+    BattleTable table;
+    for (std::size_t i = 0; i < classes; ++i) {
+        for (std::size_t j = 0; j < classes; ++j) {
+            table.fights[i][j] = fought[i * classes + j].load();
+            table.wins[i][j] = won[i * classes + j].load();
+            table.draws[i][j] = drawn[i * classes + j].load();
+        }
+    }
+    return table;
+}
+
+/// <summary>
+/// Writes the win rates and the draw rates of the class matchups, followed by the counts.
+/// </summary>
+/// <param name="out"> reference to the output stream </param>
+/// <param name="table"> outcomes by class matchup </param>
+/// <param name="fights"> number of fights </param>
+/// <param name="seed"> seed of the simulation </param>
+void writeBattleTable(std::ostream &out, const BattleTable &table, std::uint64_t fights, std::uint64_t seed)
+{
+    auto writeRates = [&](const char *title, const auto &counts)
+    {
+        out << title << "\n" << std::setw(10) << "";
+        for (const char *column: battleClasses) {
+            out << std::setw(10) << column;
+        }
+        out << "\n";
+        for (std::size_t i = 0; i < battleClasses.size(); ++i) {
+            out << std::setw(10) << std::left << battleClasses[i] << std::right;
+            for (std::size_t j = 0; j < battleClasses.size(); ++j) {
+                double rate = (table.fights[i][j] > 0) ? 100.0 * counts[i][j] / table.fights[i][j] : 0.0;
+                out << std::setw(9) << std::fixed << std::setprecision(2) << rate << "%";
+            }
+            out << "\n";
+        }
+        out << "\n";
+    };
+
+    out << fights << " fights, seed " << seed << "\n\n";
+    writeRates("Win rate of the row against the column", table.wins);
+    writeRates("Draw rate", table.draws);
+
+    for (std::size_t i = 0; i < battleClasses.size(); ++i) {
+        for (std::size_t j = 0; j < battleClasses.size(); ++j) {
+            out << battleClasses[i] << " vs " << battleClasses[j] << ": " << table.fights[i][j] << " fights, "
+                << table.wins[i][j] << " wins, " << table.fights[i][j] - table.wins[i][j] - table.draws[i][j]
+                << " losses, " << table.draws[i][j] << " draws\n";
+        }
+    }
+}
+
+// Benchmarks
+
+/// <summary>
+/// Writes a script where a crowd of characters exchanges attacks and dialogues.
+/// </summary>
+/// <param name="path"> path to the script </param>
+/// <param name="commands"> number of commands after the setup </param>
+void writeBenchmarkScript(const std::string &path, int commands)
+{
+    const int crowd = 64;
+    std::mt19937 random(2024);
+    std::ofstream script(path);
+
+    script << 2 * crowd + commands << "\n";
+    for (int i = 0; i < crowd; ++i) {
+        script << "Create character " << (i % 2 == 0 ? "fighter" : "archer") << " hero" << i << " 1000000000\n";
+        script << "Create item weapon hero" << i << " sword" << i << " " << 1 + i % 9 << "\n";
+    }
+
+    for (int i = 0; i < commands; ++i) {
+        int attacker = random() % crowd;
+        int target = random() % crowd;
+        switch (random() % 8) {
+            case 0:
+                script << "Show weapons hero" << attacker << "\n";
+                break;
+            case 1:
+                script << "Dialogue hero" << attacker << " 6 we shall meet again at dawn\n";
+                break;
+            default:
+                script << "Attack hero" << attacker << " hero" << target << " sword" << attacker << "\n";
+                break;
+        }
+    }
+}
+
+/// <summary>
+/// Writes a script where a crowd of traders keeps handing weapons to each other.
+/// Every transfer is valid: the script follows the owners and the free space of the arsenals.
+/// </summary>
+/// <param name="path"> path to the script </param>
+/// <param name="commands"> number of commands after the setup </param>
+void writeTradingScript(const std::string &path, int commands)
+{
+    const int crowd = 256;
+    std::mt19937 random(2024);
+    std::ofstream script(path);
+
+    // Owner of every weapon and the number of weapons of every trader
+    std::vector<int> owners(crowd);
+    std::vector<int> carried(crowd, 1);
+
+    script << 2 * crowd + commands << "\n";
+    for (int i = 0; i < crowd; ++i) {
+        script << "Create character fighter trader" << i << " 1000000000\n";
+        script << "Create item weapon trader" << i << " blade" << i << " " << 1 + i % 9 << "\n";
+        owners[i] = i;
+    }
+
+    for (int i = 0; i < commands; ++i) {
+        int weapon = random() % crowd;
+        int owner = owners[weapon];
+        switch (random() % 16) {
+            case 0:
+                script << "Show owners blade" << weapon << "\n";
+                break;
+            case 1:
+                script << "Attack trader" << owner << " trader" << random() % crowd << " blade" << weapon << "\n";
+                break;
+            default: {
+                int receiver = random() % crowd;
+                while (receiver == owner || carried[receiver] == Fighter::maxAllowedWeapons) {
+                    receiver = random() % crowd;
+                }
+                script << "Give trader" << owner << " trader" << receiver << " blade" << weapon << "\n";
+                --carried[owner];
+                ++carried[receiver];
+                owners[weapon] = receiver;
+                break;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Gives the name of an execution mode.
+/// </summary>
+/// <param name="mode"> execution mode </param>
+/// <returns> the name of the mode </returns>
+const char *modeName(ExecutionMode mode)
+{
+    switch (mode) {
+        case ExecutionMode::Sequential:
+            return "sequential";
+        case ExecutionMode::Pipelined:
+            return "pipelined";
+        case ExecutionMode::Parallel:
+            return "parallel";
+        default:
+            return "speculative";
+    }
+}
+
+/// <summary>
+/// Measures a script run in the given execution modes and checks that the outputs are equal.
+/// </summary>
+/// <param name="commands"> number of commands in the script </param>
+/// <param name="modes"> execution modes to compare </param>
+/// <param name="writeScript"> procedure writing the script </param>
+void runExecutionBenchmark(int commands,
+                           std::initializer_list<ExecutionMode> modes,
+                           void (*writeScript)(const std::string &, int) = writeBenchmarkScript)
+{
+    writeScript("bench_input.txt", commands);
+
+    // The multithreaded runs go first: the standard library switches to atomic reference counting
+    // once the process starts threads, so all runs are measured under the same conditions
+    std::string expected;
+    for (ExecutionMode mode: modes) {
+        auto game = Game::resetGame("bench_input.txt", "bench_output.txt");
+
+        auto start = std::chrono::steady_clock::now();
+        game->startNewGame(mode);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::ifstream result("bench_output.txt", std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(result)), std::istreambuf_iterator<char>());
+        if (expected.empty()) {
+            expected = text;
+        }
+
+        std::cout << modeName(mode) << ": " << elapsed.count() * 1000 << " ms, "
+                  << commands / elapsed.count() << " commands/s";
+        if (mode == ExecutionMode::Speculative) {
+            std::cout << ", " << game->getReexecutedCommands() << " executed again";
+        }
+        std::cout << (text == expected ? "" : ", output differs") << "\n";
+    }
+}
+
+/// <summary>
+/// Measures the cost of journaling a script run with group commits.
+/// </summary>
+/// <param name="commands"> number of commands in the script </param>
+void runJournalBenchmark(int commands)
+{
+    writeBenchmarkScript("bench_input.txt", commands);
+
+    // The journaled run goes first: the standard library switches to atomic reference counting
+    // once the process starts threads, so both runs are measured under the same conditions
+    double journaled = 0;
+    for (bool isJournaled: {true, false}) {
+        auto game = Game::resetGame("bench_input.txt", "bench_output.txt");
+        std::remove("bench_journal.log");
+
+        auto start = std::chrono::steady_clock::now();
+        if (isJournaled) {
+            game->enableJournal("bench_journal.log", 1024, std::chrono::milliseconds(10));
+        }
+        game->startNewGame(ExecutionMode::Sequential);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << (isJournaled ? "journaled: " : "plain: ") << elapsed.count() * 1000 << " ms, "
+                  << commands / elapsed.count() << " commands/s";
+        if (isJournaled) {
+            journaled = elapsed.count();
+        }
+        else {
+            std::cout << ", journal overhead " << (journaled / elapsed.count() - 1) * 100 << "%";
+        }
+        std::cout << "\n";
+    }
+}
+
+/// <summary>
+/// Measures the setup of a world with separate creation commands and with bulk creation commands,
+/// and checks that the outputs are equal.
+/// </summary>
+/// <param name="characters"> number of characters in the world </param>
+void runSetupBenchmark(int characters)
+{
+    {
+        std::ofstream script("bench_input.txt");
+        script << 3 * characters << "\n";
+        for (int i = 0; i < characters; ++i) {
+            script << "Create character fighter unit" << i << " 100\n";
+        }
+        for (int i = 0; i < characters; ++i) {
+            script << "Create item weapon unit" << i << " pike 5\n";
+        }
+        for (int i = 0; i < characters; ++i) {
+            script << "Create item potion unit" << i << " tonic 7\n";
+        }
+    }
+    {
+        std::ofstream script("bench_bulk_input.txt");
+        script << 3 << "\n"
+               << "Create characters fighter " << characters << " unit 100\n"
+               << "Create items weapon " << characters << " unit pike 5\n"
+               << "Create items potion " << characters << " unit tonic 7\n";
+    }
+
+    std::string expected;
+    double separate = 0;
+    for (bool isBulk: {false, true}) {
+        auto game = Game::resetGame(isBulk ? "bench_bulk_input.txt" : "bench_input.txt", "bench_output.txt");
+
+        auto start = std::chrono::steady_clock::now();
+        game->startNewGame(ExecutionMode::Sequential);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::ifstream result("bench_output.txt", std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(result)), std::istreambuf_iterator<char>());
+
+        std::cout << (isBulk ? "bulk: " : "separate: ") << elapsed.count() * 1000 << " ms, "
+                  << characters / elapsed.count() << " characters/s";
+        if (isBulk) {
+            std::cout << ", " << separate / elapsed.count() << "x faster" << (text == expected ? "" : ", output differs");
+        }
+        else {
+            separate = elapsed.count();
+            expected = std::move(text);
+        }
+        std::cout << "\n";
+    }
+}
+
+/// <summary>
+/// Executes a script against a session and reports the time per line of the output.
+/// </summary>
+/// <param name="session"> pointer to the Game instance </param>
+/// <param name="name"> name of the phase </param>
+/// <param name="script"> number of commands followed by the commands </param>
+void runScriptPhase(const std::shared_ptr<Game> &session, const std::string &name, const std::string &script)
+{
+    std::istringstream stream(script);
+    std::string text;
+
+    auto start = std::chrono::steady_clock::now();
+    session->executeScript(stream, text);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::size_t events = std::count(text.begin(), text.end(), '\n');
+    std::cout << name << ": " << elapsed.count() * 1000 << " ms, " << events << " events";
+    if (events > 0) {
+        std::cout << ", " << elapsed.count() * 1e9 / events << " ns/event, " << events / elapsed.count() << " events/s";
+    }
+    std::cout << "\n";
+}
+
+/// <summary>
+/// Measures the status effects: applying them, then passing ticks while they act and wear off.
+/// </summary>
+/// <param name="effects"> number of effects active at once </param>
+void runEffectsBenchmark(int effects)
+{
+    const int crowd = 1000;
+    std::mt19937 random(2024);
+
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    auto runPhase = [&](const std::string &name, const std::string &script)
+    {
+        runScriptPhase(session, name, script);
+    };
+
+    runPhase("setup", "1\nCreate characters fighter " + std::to_string(crowd) + " hero 1000000000\n");
+
+    // Short poisons and regenerations, long buffs
+    std::string script = std::to_string(effects) + "\n";
+    for (int i = 0; i < effects; ++i) {
+        int target = random() % crowd;
+        switch (random() % 3) {
+            case 0:
+                script += "Apply poison hero" + std::to_string(target) + " 1 " + std::to_string(1 + random() % 8) + "\n";
+                break;
+            case 1:
+                script += "Apply regen hero" + std::to_string(target) + " 1 " + std::to_string(1 + random() % 8) + "\n";
+                break;
+            default:
+                script += "Apply buff hero" + std::to_string(target) + " 1 " + std::to_string(1 + random() % 1000000) + "\n";
+                break;
+        }
+    }
+    runPhase("apply", script);
+
+    runPhase("Tick 1", "1\nTick 1\n");
+    runPhase("Tick 7", "1\nTick 7\n");
+    runPhase("Tick 1000000", "1\nTick 1000000\n");
+    runPhase("Tick 1000000 without effects", "1\nTick 1000000\n");
+
+    Game::makeCurrent(nullptr);
+}
+
+/// <summary>
+/// Measures the spatial layer: scattering a crowd over the grid, moving everybody around
+/// and asking who is near.
+/// </summary>
+/// <param name="characters"> number of characters </param>
+void runSpatialBenchmark(int characters)
+{
+    const int queries = 100000;
+    const int radius = 20;
+    std::mt19937 random(2024);
+
+    // One character per hundred squares of the grid
+    int side = std::max(1, (int) std::sqrt(100.0 * characters));
+
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    auto runPhase = [&](const std::string &name, const std::string &script)
+    {
+        runScriptPhase(session, name, script);
+    };
+
+    runPhase("setup", "1\nCreate characters archer " + std::to_string(characters) + " hero 100\n");
+
+    std::string script = std::to_string(characters) + "\n";
+    for (int i = 0; i < characters; ++i) {
+        script += "Move hero" + std::to_string(i) + " " + std::to_string(random() % side) + " "
+            + std::to_string(random() % side) + "\n";
+    }
+    runPhase("scatter", script);
+
+    // Short steps, a quarter of them cross into another cell
+    script = std::to_string(characters) + "\n";
+    for (int i = 0; i < characters; ++i) {
+        script += "Move hero" + std::to_string(random() % characters) + " " + std::to_string(int(random() % 7) - 3) + " "
+            + std::to_string(int(random() % 7) - 3) + "\n";
+    }
+    runPhase("churn", script);
+
+    script = std::to_string(queries) + "\n";
+    for (int i = 0; i < queries; ++i) {
+        script += "Show nearby hero" + std::to_string(random() % characters) + " " + std::to_string(radius) + "\n";
+    }
+    runPhase("Show nearby " + std::to_string(radius), script);
+
+    script = std::to_string(queries) + "\n";
+    for (int i = 0; i < queries; ++i) {
+        script += "Attack hero" + std::to_string(random() % characters) + " hero" + std::to_string(random() % characters)
+            + " bow\n";
+    }
+    runPhase("Attack with range checks", script);
+
+    Game::makeCurrent(nullptr);
+}
+
+/// <summary>
+/// Measures the routes of MoveTo on a large map crossed by walls: routes between random squares,
+/// routes between squares that recur, and changes of the obstacles that drop the cached routes.
+/// </summary>
+/// <param name="queries"> number of routes of the random phase </param>
+void runPathBenchmark(int queries)
+{
+    const int side = 1024;
+    const int walls = 4000;
+    const int walkers = 1000;
+    std::mt19937 random(2024);
+
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    auto runPhase = [&](const std::string &name, const std::string &script)
+    {
+        runScriptPhase(session, name, script);
+    };
+
+    // Walls of random length in both directions, the script keeps its own copy to place walkers on free squares
+    std::vector<std::uint8_t> blocked(side * side, 0);
+    std::string script = std::to_string(walls + 2) + "\nMap " + std::to_string(side) + " " + std::to_string(side)
+        + "\nCreate characters archer " + std::to_string(walkers) + " walker 100\n";
+    for (int i = 0; i < walls; ++i) {
+        int x = random() % side;
+        int y = random() % side;
+        int length = 10 + random() % 90;
+        int width = (random() % 2 == 0) ? length : 1;
+        int height = (width == 1) ? length : 1;
+        script += "Obstacle add " + std::to_string(x) + " " + std::to_string(y) + " " + std::to_string(width) + " "
+            + std::to_string(height) + "\n";
+        for (int row = y; row < std::min(y + height, side); ++row) {
+            for (int column = x; column < std::min(x + width, side); ++column) {
+                blocked[row * side + column] = 1;
+            }
+        }
+    }
+    runPhase("setup", script);
+
+    auto freeSquare = [&]()
+    {
+        int square = random() % (side * side);
+        while (blocked[square]) {
+            square = random() % (side * side);
+        }
+        return std::to_string(square % side) + " " + std::to_string(square / side);
+    };
+
+    script = std::to_string(walkers) + "\n";
+    for (int i = 0; i < walkers; ++i) {
+        script += "Move walker" + std::to_string(i) + " " + freeSquare() + "\n";
+    }
+    runPhase("placement", script);
+
+    script = std::to_string(queries) + "\n";
+    for (int i = 0; i < queries; ++i) {
+        script += "MoveTo walker" + std::to_string(random() % walkers) + " " + freeSquare() + "\n";
+    }
+    runPhase("random routes", script);
+
+    // Every walker shuttles between its square and one more square
+    script = std::to_string(2 * walkers + queries) + "\n";
+    std::vector<std::string> ends;
+    for (int i = 0; i < walkers; ++i) {
+        ends.push_back(freeSquare());
+        ends.push_back(freeSquare());
+        script += "MoveTo walker" + std::to_string(i) + " " + ends[2 * i] + "\n";
+        script += "MoveTo walker" + std::to_string(i) + " " + ends[2 * i + 1] + "\n";
+    }
+    std::vector<int> legs(walkers, 1);
+    for (int i = 0; i < queries; ++i) {
+        int walker = random() % walkers;
+        legs[walker] = 1 - legs[walker];
+        script += "MoveTo walker" + std::to_string(walker) + " " + ends[2 * walker + legs[walker]] + "\n";
+    }
+    runPhase("recurring routes", script);
+
+    // A door opens and closes between routes, dropping the cache each time
+    script = std::to_string(3 * (queries / 10)) + "\n";
+    for (int i = 0; i < queries / 10; ++i) {
+        int walker = random() % walkers;
+        legs[walker] = 1 - legs[walker];
+        script += "Obstacle remove 500 500 1 1\n";
+        script += "MoveTo walker" + std::to_string(walker) + " " + ends[2 * walker + legs[walker]] + "\n";
+        script += "Obstacle add 500 500 1 1\n";
+    }
+    runPhase("routes with obstacle changes", script);
+
+    Game::makeCurrent(nullptr);
+}
+
+/// <summary>
+/// Returns the number of bytes allocated on the heap, 0 where the allocator does not report it.
+/// </summary>
+/// <returns> number of bytes in use </returns>
+std::size_t heapBytes()
+{
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/// <summary>
+/// Measures the forks of a session: the time and the memory of a fork, the continuation of the
+/// branches compared with replaying the whole history, and checks that a branch prints what the
+/// replay prints.
+/// </summary>
+/// <param name="branches"> number of branches forked from the same world </param>
+void runForkBenchmark(int branches)
 {
-    auto vec = characters.getElements();
-    for (auto &character: vec) {
-        if (character->getName() == name) {
-            return character;
+    const int characters = 100000;
+    const int history = 1000000;
+    const int continuation = 1000;
+    const int replays = 3;
+    using Clock = std::chrono::steady_clock;
+    std::mt19937 random(2024);
+
+    auto attacks = [&](int count)
+    {
+        std::string script;
+        for (int i = 0; i < count; ++i) {
+            script += "Attack unit" + std::to_string(random() % characters) + " unit" + std::to_string(random() % characters)
+                + " pike\n";
+        }
+        return script;
+    };
+
+    std::string prefix = std::to_string(history + 3) + "\nCreate characters fighter " + std::to_string(characters)
+        + " unit 1000000\nCreate items weapon " + std::to_string(characters) + " unit pike 5\n"
+        + "Create items potion " + std::to_string(characters) + " unit tonic 7\n" + attacks(history);
+
+    auto base = Game::newSession();
+    Game::makeCurrent(base);
+    runScriptPhase(base, "history", prefix);
+
+    std::size_t heapBefore = heapBytes();
+    auto start = Clock::now();
+    std::vector<std::shared_ptr<Game>> forks;
+    for (int i = 0; i < branches; ++i) {
+        forks.push_back(base->fork());
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::size_t heapForked = heapBytes();
+    std::cout << "fork: " << elapsed.count() * 1e6 / branches << " us/branch, "
+              << (heapForked - heapBefore) / branches / 1024 << " KiB/branch\n";
+
+    // Every branch goes on with its own attacks
+    std::vector<std::string> scripts;
+    std::vector<std::string> outputs(branches);
+    for (int i = 0; i < branches; ++i) {
+        scripts.push_back(std::to_string(continuation) + "\n" + attacks(continuation));
+    }
+    start = Clock::now();
+    for (int i = 0; i < branches; ++i) {
+        std::istringstream stream(scripts[i]);
+        Game::makeCurrent(forks[i]);
+        forks[i]->executeScript(stream, outputs[i]);
+    }
+    elapsed = Clock::now() - start;
+    std::cout << "continuation: " << elapsed.count() * 1000 / branches << " ms/branch, "
+              << (heapBytes() - heapBefore) / branches / 1024 << " KiB/branch with the copied characters\n";
+
+    // The same continuations from a replay of the history
+    bool isSame = true;
+    start = Clock::now();
+    for (int i = 0; i < std::min(replays, branches); ++i) {
+        auto replay = Game::newSession();
+        Game::makeCurrent(replay);
+        std::string text;
+        std::istringstream history(prefix);
+        replay->executeScript(history, text);
+        text.clear();
+        std::istringstream stream(scripts[i]);
+        replay->executeScript(stream, text);
+        isSame = isSame && (text == outputs[i]);
+        Game::makeCurrent(nullptr);
+    }
+    elapsed = Clock::now() - start;
+    std::cout << "replay: " << elapsed.count() * 1000 / std::min(replays, branches) << " ms/branch, output "
+              << (isSame ? "identical" : "DIFFERENT") << "\n";
+
+    forks.clear();
+    std::cout << "after dropping the branches: " << ((long long) heapBytes() - (long long) heapBefore) / 1024
+              << " KiB\n";
+    Game::makeCurrent(nullptr);
+}
+
+/// <summary>
+/// Measures the formatting of the lines of the Show commands: the same characters and weapons
+/// written through an output string stream, as the game wrote them before, and through the output
+/// buffer, checking that both give the same bytes.
+/// </summary>
+/// <param name="lines"> number of formatted entries per phase </param>
+void runFormatBenchmark(int lines)
+{
+    const int crowd = 1000;
+    using Clock = std::chrono::steady_clock;
+    std::mt19937 random(2024);
+
+    std::vector<std::pair<std::shared_ptr<Character>, const char *>> characters;
+    std::vector<std::shared_ptr<Weapon>> weapons;
+    for (int i = 0; i < crowd; ++i) {
+        std::string name = "character" + std::to_string(i);
+        int healthPoints = 1 + random() % 1000000;
+        switch (i % 3) {
+            case 0:
+                characters.emplace_back(std::make_shared<Fighter>(name, healthPoints), ":fighter:");
+                break;
+            case 1:
+                characters.emplace_back(std::make_shared<Archer>(name, healthPoints), ":archer:");
+                break;
+            default:
+                characters.emplace_back(std::make_shared<Wizard>(name, healthPoints), ":wizard:");
+                break;
+        }
+        weapons.push_back(std::make_shared<Weapon>(characters.back().first, "weapon" + std::to_string(i), 1 + random() % 100));
+    }
+
+    // Both phases hand their text over in chunks, as the game does
+    auto runPhase = [&](const std::string &name, const std::function<void(int)> &format,
+                        const std::function<std::size_t()> &take)
+    {
+        std::size_t bytes = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < lines; ++i) {
+            format(i % crowd);
+            if (i % 1024 == 1023) {
+                bytes += take();
+            }
+        }
+        bytes += take();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        std::cout << name << ": " << elapsed.count() * 1000 << " ms, " << elapsed.count() * 1e9 / lines << " ns/entry, "
+                  << bytes / elapsed.count() / (1 << 20) << " MiB/s\n";
+    };
+
+    std::ostringstream stream;
+    auto takeStream = [&]()
+    {
+        std::string text = std::move(stream).str();
+        stream.str(std::string());
+        return text.size();
+    };
+    OutputBuffer buffer;
+    auto takeBuffer = [&]()
+    {
+        return buffer.take().size();
+    };
+
+    runPhase("characters, stream", [&](int i)
+    {
+        auto &[character, type] = characters[i];
+        stream << character->getName() << type << character->getHp() << " ";
+    }, takeStream);
+    runPhase("characters, buffer", [&](int i)
+    {
+        characters[i].first->print(buffer);
+    }, takeBuffer);
+    runPhase("weapons, stream", [&](int i)
+    {
+        stream << weapons[i]->getName() << ":" << weapons[i]->getDamage() << " ";
+    }, takeStream);
+    runPhase("weapons, buffer", [&](int i)
+    {
+        weapons[i]->print(buffer);
+    }, takeBuffer);
+
+    for (int i = 0; i < crowd; ++i) {
+        auto &[character, type] = characters[i];
+        stream << character->getName() << type << character->getHp() << " ";
+        stream << weapons[i]->getName() << ":" << weapons[i]->getDamage() << " ";
+        character->print(buffer);
+        weapons[i]->print(buffer);
+    }
+    std::cout << "output " << (std::move(stream).str() == buffer.take() ? "identical" : "DIFFERENT") << "\n";
+}
+
+/// <summary>
+/// Measures the export of a large world: every character keeps a weapon or a spell and a potion, the export
+/// is read back by casting its columns in place, as a program mapping the file would, and checked
+/// against the session.
+/// </summary>
+/// <param name="characters"> number of characters in the world </param>
+void runExportBenchmark(int characters)
+{
+    using Clock = std::chrono::steady_clock;
+    const std::string path = "bench.roster";
+    int perClass = std::max(characters / 3, 1);
+
+    std::ostringstream script;
+    script << 3 + 2 * 3 * perClass << "\n";
+    for (const char *type: {"fighter", "archer", "wizard"}) {
+        script << "Create characters " << type << " " << perClass << " " << type << " " << 100 << "\n";
+    }
+    for (const char *type: {"fighter", "archer", "wizard"}) {
+        for (int i = 0; i < perClass; ++i) {
+            if (type[0] == 'w') {
+                script << "Create item spell " << type << i << " curse 1 " << type << i << "\n";
+            }
+            else {
+                script << "Create item weapon " << type << i << " sword " << 1 + i % 50 << "\n";
+            }
+            script << "Create item potion " << type << i << " tonic " << 1 + i % 20 << "\n";
         }
     }
-
-    throw CharacterDoesNotExist();
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    std::istringstream stream(script.str());
+    std::string text;
+    session->executeScript(stream, text);
+
+    std::istringstream exportScript("1\nExport " + path + "\n");
+    auto start = Clock::now();
+    session->executeScript(exportScript, text);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    Game::makeCurrent(nullptr);
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::vector<char> bytes(file.tellg());
+    file.seekg(0);
+    file.read(bytes.data(), bytes.size());
+    std::cout << 3 * perClass << " characters: " << elapsed.count() * 1000 << " ms, " << bytes.size() / double(1 << 20)
+              << " MiB, " << bytes.size() / elapsed.count() / (1 << 20) << " MiB/s\n";
+
+    // Reading the columns in place
+    RosterExportHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    auto column = [&]<typename Value>(RosterColumn kind, Value)
+    {
+        std::size_t index = std::size_t(kind);
+        return std::span<const Value>(reinterpret_cast<const Value *>(bytes.data() + header.offsets[index]),
+                                      header.sizes[index] / sizeof(Value));
+    };
+    auto names = column(RosterColumn::CharacterName, std::uint32_t());
+    auto health = column(RosterColumn::HealthPoints, std::int32_t());
+    auto firstItems = column(RosterColumn::FirstItem, std::uint32_t());
+    auto values = column(RosterColumn::ItemValue, std::int32_t());
+    auto offsets = column(RosterColumn::StringOffsets, std::uint64_t());
+    auto strings = column(RosterColumn::StringBytes, char());
+
+    bool isConsistent = std::equal(header.magic, header.magic + 8, "ROSTER01")
+        && header.characters == std::size_t(3 * perClass) && header.items == std::size_t(6 * perClass)
+        && header.strings == std::size_t(3 * perClass + 3) && firstItems.back() == header.items;
+    long long healthSum = 0;
+    long long valueSum = 0;
+    for (std::size_t i = 0; i < header.characters; ++i) {
+        healthSum += health[i];
+    }
+    for (std::size_t i = 0; i < header.items; ++i) {
+        valueSum += values[i];
+    }
+    long long expectedValues = 0;
+    for (int i = 0; i < perClass; ++i) {
+        expectedValues += 2 * (1 + i % 50) + 3 * (1 + i % 20) + 1;
+    }
+    std::size_t last = header.characters - 1;
+    std::string_view lastName(strings.data() + offsets[names[last]], offsets[names[last] + 1] - offsets[names[last]]);
+    isConsistent = isConsistent && healthSum == 100LL * 3 * perClass && valueSum == expectedValues
+        && lastName == "wizard" + std::to_string(perClass - 1);
+    std::cout << "export " << (isConsistent ? "consistent" : "INCONSISTENT") << "\n";
+    std::remove(path.c_str());
 }
 
-void Game::showCharacters()
+/// <summary>
+/// Checks the statistics kept by the game against a scan of the exported roster after a battle with deaths,
+/// used up items, gifts and items sharing a name, then measures a Stats query on the remaining world.
+/// </summary>
+/// <param name="characters"> number of characters created </param>
+void runStatisticsBenchmark(int characters)
 {
+    using Clock = std::chrono::steady_clock;
+    const std::string path = "bench.stats.roster";
+    const int queries = 100000;
+    std::mt19937 random(2024);
+    characters = std::max(characters, 2);
+
+    std::vector<std::string> lines;
+    const char *types[] = {"fighter", "archer", "wizard"};
+    for (int i = 0; i < characters; ++i) {
+        lines.push_back("Create character " + std::string(types[i % 3]) + " c" + std::to_string(i) + " " +
+                        std::to_string(1 + random() % 200));
+    }
+    for (int i = 0; i < characters; ++i) {
+        std::string owner = " c" + std::to_string(i) + " ";
+        if (i % 3 != 2) {
+            lines.push_back("Create item weapon" + owner + "blade " + std::to_string(1 + random() % 50));
+        }
+        lines.push_back("Create item potion" + owner + "tonic " + std::to_string(1 + random() % 30));
+        if (i % 3 == 0) {
 
-    // Get the vector of alive characters
-    auto vec = characters.getElements();
-
-    // Sort characters by name
-    std::sort(vec.begin(),
-              vec.end(),
-              [](const std::shared_ptr<Character> first, const std::shared_ptr<Character> second)
-              {
-                  return (*first < *second);
-              });
-
-    // Output characters information
-    for (auto &character: vec) {
-        character->print(output);
+            // A potion named as the weapon of its owner, losing one of them may take the other
+            lines.push_back("Create item potion" + owner + "blade 5");
+        }
+        if (i % 3 != 0) {
+            lines.push_back("Create item spell" + owner + "hex 1 c" + std::to_string(random() % characters));
+        }
+    }
+    for (int i = 0; i < 2 * characters; ++i) {
+        std::string pair = " c" + std::to_string(random() % characters) + " c" + std::to_string(random() % characters) + " ";
+        switch (random() % 4) {
+            case 0:
+                lines.push_back("Attack" + pair + "blade");
+                break;
+            case 1:
+                lines.push_back("Drink" + pair + ((random() % 2 == 0) ? "tonic" : "blade"));
+                break;
+            case 2:
+                lines.push_back("Cast" + pair + "hex");
+                break;
+            default:
+                lines.push_back("Give" + pair + "tonic");
+                break;
+        }
     }
+    lines.push_back("Stats");
+    lines.push_back("Export " + path);
 
-    output << std::endl;
+    std::string script = std::to_string(lines.size()) + "\n";
+    for (const std::string &line: lines) {
+        script += line + "\n";
+    }
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    std::istringstream stream(script);
+    std::string text;
+    session->executeScript(stream, text);
+    std::string reported = text.substr(text.rfind("Characters: "));
+
+    // Scanning the exported roster
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::vector<char> bytes(file.tellg());
+    file.seekg(0);
+    file.read(bytes.data(), bytes.size());
+    std::remove(path.c_str());
+    RosterExportHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    auto column = [&](RosterColumn kind)
+    {
+        return bytes.data() + header.offsets[std::size_t(kind)];
+    };
+
+    auto start = Clock::now();
+    std::int64_t counts[3] = {};
+    std::int64_t items[3] = {};
+    std::int64_t health = 0;
+    for (std::size_t i = 0; i < header.characters; ++i) {
+        std::int32_t healthPoints;
+        std::memcpy(&healthPoints, column(RosterColumn::HealthPoints) + i * sizeof(std::int32_t), sizeof(healthPoints));
+        ++counts[std::uint8_t(column(RosterColumn::CharacterClass)[i])];
+        health += healthPoints;
+    }
+    for (std::size_t i = 0; i < header.items; ++i) {
+        ++items[std::uint8_t(column(RosterColumn::ItemKind)[i])];
+    }
+    std::chrono::duration<double> scan = Clock::now() - start;
+
+    std::int64_t count = counts[0] + counts[1] + counts[2];
+    char mean[32];
+    auto end = std::to_chars(mean, mean + sizeof(mean), (count > 0) ? double(health) / count : 0.0,
+                             std::chars_format::fixed, 2).ptr;
+    std::ostringstream expected;
+    expected << "Characters: " << count << " (fighters " << counts[0] << ", archers " << counts[1] << ", wizards "
+             << counts[2] << "), health points: " << health << " (mean " << std::string_view(mean, end - mean)
+             << "), items: weapons " << items[0] << ", potions " << items[1] << ", spells " << items[2] << "\n";
+    std::cout << reported;
+
+    // Queries on the remaining world
+    std::istringstream polls("1\nRepeat " + std::to_string(queries) + " { Stats }\n");
+    start = Clock::now();
+    session->executeScript(polls, text);
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    Game::makeCurrent(nullptr);
+
+    std::cout << count << " alive characters: Stats " << elapsed.count() * 1e9 / queries << " ns/query, scan of the columns "
+              << scan.count() * 1e9 << " ns\n";
+    std::cout << "statistics " << (reported == expected.str() ? "consistent" : "INCONSISTENT") << "\n";
 }
 
-Game::Game()
+/// <summary>
+/// Measures Show characters on a large roster: the sort and the formatting on one thread, as the game does for
+/// small rosters, and on pools of a growing number of threads, checking that all of them give the same bytes.
+/// </summary>
+/// <param name="characters"> number of characters in the roster </param>
+void runShowBenchmark(int characters)
 {
-    // Input stream
-    input.open("input.txt");
+    using Clock = std::chrono::steady_clock;
+    std::mt19937 random(2024);
+    Container<Character> roster;
+    roster.reserve(characters);
+    for (int i = 0; i < characters; ++i) {
+        std::string name = "character" + std::to_string(random() % 1000000000) + "_" + std::to_string(i);
+        roster.addItem(std::make_shared<Fighter>(name, 1 + random() % 1000000));
+    }
 
-    // Output stream
-    output.open("output.txt");
+    auto measure = [&](const std::string &name, const std::function<void(OutputBuffer &)> &show)
+    {
+        OutputBuffer buffer;
+        auto start = Clock::now();
+        show(buffer);
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        std::cout << name << ": " << elapsed.count() * 1000 << " ms, " << elapsed.count() * 1e9 / characters
+                  << " ns/character\n";
+        return buffer.take();
+    };
+
+    std::string expected = measure("one thread", [&](OutputBuffer &out)
+    {
+        roster.visitSorted([&](const Character &character)
+        {
+            character.print(out);
+        });
+    });
+    bool isIdentical = true;
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int threads = 1; ; threads = std::min(threads * 2, cores)) {
+        WorkerPool workers(threads - 1);
+        std::string text = measure(std::to_string(threads) + " threads", [&](OutputBuffer &out)
+        {
+            printInAscendingOrder<Character>(roster.view(), out, workers);
+        });
+        isIdentical = isIdentical && (text == expected);
+        if (threads == cores) {
+            break;
+        }
+    }
+    std::cout << "output " << (isIdentical ? "identical" : "DIFFERENT") << "\n";
 }
 
-void Game::startNewGame()
+/// <summary>
+/// Measures the same rounds of a duel written three ways: unrolled, as a Repeat block and as calls of a macro
+/// inside a Repeat block, checking that the scripts give the same output.
+/// </summary>
+/// <param name="rounds"> number of rounds of the duel </param>
+void runRepeatBenchmark(int rounds)
 {
-
-    // Processing Input
-
-    int N;
-    input >> N;
-    for (int i = 0; i < N; ++i) {
-        std::string first;
-        input >> first;
-        if (first == "Create") {
-            std::string second;
-            input >> second;
-            if (second == "character") {
-                std::string type, name;
-                int initHP;
-                std::shared_ptr<Character> newCharacter;
-
-                input >> type >> name >> initHP;
-
-                if (type == "fighter") {
-                    newCharacter = std::make_shared<Fighter>(name, initHP);
-                    output << "A new fighter came to town, " << name << ".\n";
-                }
-                else if (type == "archer") {
-                    newCharacter = std::make_shared<Archer>(name, initHP);
-                    output << "A new archer came to town, " << name << ".\n";
-                }
-                else if (type == "wizard") {
-                    newCharacter = std::make_shared<Wizard>(name, initHP);
-                    output << "A new wizard came to town, " << name << ".\n";
-                }
-                else {
-                    throw std::runtime_error("Unexpected command");
-                }
-
-                characters.addItem(newCharacter);
-            }
-            else if (second == "item") {
-                std::string third;
-                input >> third;
-                if (third == "weapon") {
-                    try {
-                        std::string ownerName;
-                        input >> ownerName;
-                        std::string weaponName;
-                        input >> weaponName;
-                        int damageValue;
-                        input >> damageValue;
-                        auto owner = getCharacterByName(ownerName);
-
-                        std::shared_ptr<Weapon> newWeapon = std::make_shared<Weapon>(owner, weaponName, damageValue);
-                        owner->obtainItem(newWeapon);
-                        output << ownerName << " just obtained a new weapon called " << weaponName << ".\n";
-                    }
-                    catch (const CharacterDoesNotExist &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const IllegalDamageValue &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const FullContainer &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const IllegalItemType &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                }
-                else if (third == "potion") {
-                    try {
-                        std::string ownerName;
-                        input >> ownerName;
-                        std::string potionName;
-                        input >> potionName;
-                        int healValue;
-                        input >> healValue;
-                        auto owner = getCharacterByName(ownerName);
-
-                        std::shared_ptr<Potion> newPotion = std::make_shared<Potion>(owner, potionName, healValue);
-                        owner->obtainItem(newPotion);
-                        output << ownerName << " just obtained a new potion called " << potionName << ".\n";
-                    }
-                    catch (const CharacterDoesNotExist &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const IllegalHealthValue &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const FullContainer &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const IllegalItemType &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                }
-                else if (third == "spell") {
-                    try {
-                        std::string ownerName;
-                        input >> ownerName;
-                        std::string spellName;
-                        input >> spellName;
-                        int m;
-                        input >> m;
-
-                        std::vector<std::string> targetNames;
-
-                        for (int j = 0; j < m; ++j) {
-                            std::string targetName;
-                            input >> targetName;
-                            targetNames.push_back(targetName);
-                        }
-
-                        auto owner = getCharacterByName(ownerName);
-
-                        std::vector<std::shared_ptr<Character>> allowedTargets;
-
-                        for (int j = 0; j < m; ++j) {
-                            std::string targetName = targetNames[j];
-                            auto target = getCharacterByName(targetName);
-                            allowedTargets.push_back(target);
-                        }
-
-                        std::shared_ptr<Spell> newSpell = std::make_shared<Spell>(owner, spellName, allowedTargets);
-                        owner->obtainItem(newSpell);
-                        output << ownerName << " just obtained a new spell called " << spellName << ".\n";
-                    }
-                    catch (const CharacterDoesNotExist &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const FullContainer &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                    catch (const IllegalItemType &) {
-                        output << "Error caught\n";
-                        continue;
-                    }
-                }
-                else {
-                    throw std::runtime_error("Unexpected command");
-                }
-            }
-            else {
-                throw std::runtime_error("Unexpected command");
-            }
+    using Clock = std::chrono::steady_clock;
+    const std::string setup = "Create character fighter alice 100000000\n"
+                              "Create character archer bob 100000000\n"
+                              "Create item weapon alice sword 1\n"
+                              "Create item weapon bob bow 1\n";
+    const std::string round = "Attack alice bob sword\n"
+                              "Attack bob alice bow\n"
+                              "Dialogue alice 2 hold on\n";
+
+    std::string unrolled = std::to_string(4 + 3 * rounds + 1) + "\n" + setup;
+    for (int i = 0; i < rounds; ++i) {
+        unrolled += round;
+    }
+    unrolled += "Show characters\n";
+    std::string repeated = "6\n" + setup + "Repeat " + std::to_string(rounds) + " {\n" + round + "}\nShow characters\n";
+    std::string called = "7\n" + setup +
+                         "Macro duel 4 $x $y $w $v {\n"
+                         "Attack $x $y $w\n"
+                         "Attack $y $x $v\n"
+                         "Dialogue $x 2 hold on\n"
+                         "}\n"
+                         "Repeat " + std::to_string(rounds) + " { Call duel 4 alice bob sword bow }\n"
+                         "Show characters\n";
+
+    std::string expected;
+    bool isIdentical = true;
+    for (auto [name, script]: {std::pair<const char *, const std::string *>("unrolled", &unrolled),
+                               {"repeat", &repeated}, {"macro", &called}}) {
+        auto session = Game::newSession();
+        Game::makeCurrent(session);
+        std::istringstream stream(*script);
+        std::string text;
+        auto start = Clock::now();
+        session->executeScript(stream, text);
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        Game::makeCurrent(nullptr);
+
+        std::cout << name << ": " << script->size() << " bytes, " << elapsed.count() * 1000 << " ms, "
+                  << elapsed.count() * 1e9 / (3.0 * rounds) << " ns/command\n";
+        if (expected.empty()) {
+            expected = std::move(text);
         }
-        else if (first == "Attack") {
-            try {
-                std::string attackerName;
-                input >> attackerName;
-                std::string targetName;
-                input >> targetName;
-                std::string weaponName;
-                input >> weaponName;
-
-                auto attacker = getCharacterByName(attackerName);
-                auto target = getCharacterByName(targetName);
-
-                // Check whether the character can use weapons
-                if (dynamic_cast<WeaponUser *>(attacker.get())) {
-                    auto weaponUser = std::dynamic_pointer_cast<WeaponUser>(attacker);
-                    weaponUser->attack(target, weaponName);
-                }
-                else {
-                    throw IllegalItemType();
-                }
-
-            }
-            catch (const CharacterDoesNotExist &) {
-                output << "Error caught\n";
-                continue;
-            }
-            catch (const IllegalItemType &) {
-                output << "Error caught\n";
-                continue;
-            }
-            catch (const CharacterDoesNotOwnItem &) {
-                output << "Error caught\n";
-                continue;
-            }
+        else {
+            isIdentical = isIdentical && (text == expected);
         }
-        else if (first == "Cast") {
-            try {
-                std::string casterName;
-                input >> casterName;
-                std::string targetName;
-                input >> targetName;
-                std::string spellName;
-                input >> spellName;
-
-                auto caster = getCharacterByName(casterName);
-                auto target = getCharacterByName(targetName);
-
-                // Check whether the character can use spells
-                if (dynamic_cast<SpellUser *>(caster.get())) {
-                    auto spellUser = std::dynamic_pointer_cast<SpellUser>(caster);
-                    spellUser->cast(target, spellName);
-                }
-                else {
-                    throw IllegalItemType();
-                }
+    }
+    std::cout << "output " << (isIdentical ? "identical" : "DIFFERENT") << "\n";
+}
 
+/// <summary>
+/// Checks the allocations of the commands in steady state against their budgets: every kind of command
+/// is warmed up, then executed many times on a settled world, and its allocations per command are
+/// compared with the budget. The output is dropped, so only the work of the commands is counted.
+/// </summary>
+/// <param name="commands"> number of counted commands per kind </param>
+/// <returns> true if every kind stays within its budget </returns>
+bool runAllocationBudgets(int commands)
+{
+    const int crowd = 1000;
+    std::mt19937 random(2024);
+    auto unit = [&]()
+    {
+        return "unit" + std::to_string(random() % crowd);
+    };
+
+    // Scripts executing the checked commands
+    int victims = 0;
+    std::vector<std::function<std::string(int)>> phases{
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                script += "Attack " + unit() + " " + unit() + " pike\n";
             }
-            catch (const CharacterDoesNotExist &) {
-                output << "Error caught\n";
-                continue;
-            }
-            catch (const IllegalItemType &) {
-                output << "Error caught\n";
-                continue;
-            }
-            catch (const CharacterDoesNotOwnItem &) {
-                output << "Error caught\n";
-                continue;
+            return script;
+        },
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                script += "Move " + unit() + " " + std::to_string(int(random() % 3) - 1) + " "
+                    + std::to_string(int(random() % 3) - 1) + "\n";
             }
-            catch (const NotAllowedTarget &) {
-                output << "Error caught\n";
-                continue;
+            return script;
+        },
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                script += "Dialogue " + unit() + " 3 hold the line\n";
             }
-        }
-        else if (first == "Drink") {
-            try {
-                std::string supplierName;
-                input >> supplierName;
-                std::string drinkerName;
-                input >> drinkerName;
-                std::string potionName;
-                input >> potionName;
-
-                auto supplier = getCharacterByName(supplierName);
-                auto drinker = getCharacterByName(drinkerName);
-
-                auto potionUser = std::dynamic_pointer_cast<PotionUser>(supplier);
-                potionUser->drink(drinker, potionName);
+            return script;
+        },
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                script += "Show weapons " + unit() + "\n";
             }
-            catch (const CharacterDoesNotExist &) {
-                output << "Error caught\n";
-                continue;
+            return script;
+        },
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                std::string name = unit();
+                script += "Create item potion " + name + " tonic 1\nDrink " + name + " " + name + " tonic\n";
             }
-            catch (const CharacterDoesNotOwnItem &) {
-                output << "Error caught\n";
-                continue;
+            return script;
+        },
+        [&](int count)
+        {
+            std::string script;
+            for (int i = 0; i < count; ++i) {
+                std::string mage = "mage" + std::to_string(random() % crowd);
+                std::string victim = "victim" + std::to_string(victims++);
+                script += "Create character fighter " + victim + " 10\nCreate item spell " + mage + " bolt 1 " + victim
+                    + "\nCast " + mage + " " + victim + " bolt\n";
             }
+            return script;
+        },
+    };
+
+    // Allocations per command allowed to every checked kind, the creations pay for the new objects and
+    // a share of the growth of the indexes, the moves for new cells of the spatial hash
+    const std::vector<std::pair<CommandKind, double>> budgets{
+        {CommandKind::Attack, 0}, {CommandKind::Move, 0.01}, {CommandKind::Dialogue, 0}, {CommandKind::ShowWeapons, 0},
+        {CommandKind::Drink, 0}, {CommandKind::Cast, 0}, {CommandKind::CreateCharacter, 4.5},
+        {CommandKind::CreatePotion, 5.5}, {CommandKind::CreateSpell, 7.5},
+    };
+
+    AllocationCounter::open();
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    OutputBuffer discarded(1 << 12, true);
+    Game::redirectOutput(&discarded);
+
+    std::string text;
+    auto execute = [&](const std::string &script)
+    {
+        std::string lines = std::to_string(std::count(script.begin(), script.end(), '\n')) + "\n" + script;
+        std::istringstream stream(lines);
+        session->executeScript(stream, text);
+    };
+    execute("Create characters fighter " + std::to_string(crowd) + " unit 1000000000\nCreate items weapon "
+        + std::to_string(crowd) + " unit pike 1\nCreate characters wizard " + std::to_string(crowd) + " mage 100\n");
+
+    // Counting every phase after it warmed up
+    AllocationCounter::Table measured{};
+    for (const auto &phase: phases) {
+        execute(phase(std::max(commands / 10, 10 * crowd)));
+        auto before = AllocationCounter::sums();
+        execute(phase(commands));
+        auto after = AllocationCounter::sums();
+        for (std::size_t kind = 0; kind < measured.size(); ++kind) {
+            measured[kind].commands += after[kind].commands - before[kind].commands;
+            measured[kind].counts.allocations += after[kind].counts.allocations - before[kind].counts.allocations;
+            measured[kind].counts.bytes += after[kind].counts.bytes - before[kind].counts.bytes;
         }
-        else if (first == "Dialogue") {
-            try {
-                std::string speaker;
-                input >> speaker;
-                int m;
-                input >> m;
-                std::string speech;
+    }
 
-                for (int j = 0; j < m; ++j) {
-                    std::string word;
-                    input >> word;
-                    speech += word + " ";
-                }
+    bool isWithinBudgets = true;
+    std::cout << std::left << std::setw(22) << "command" << std::right << std::setw(15) << "allocations" << std::setw(15)
+              << "bytes" << std::setw(10) << "budget" << "\n";
+    for (const auto &[kind, budget]: budgets) {
+        const AllocationCounter::Totals &sums = measured[std::size_t(kind)];
+        double allocations = double(sums.counts.allocations) / std::max<std::uint64_t>(sums.commands, 1);
+        double bytes = double(sums.counts.bytes) / std::max<std::uint64_t>(sums.commands, 1);
+        bool isWithinBudget = (sums.commands > 0 && allocations <= budget);
+        isWithinBudgets = isWithinBudgets && isWithinBudget;
+        std::cout << std::left << std::setw(22) << commandName(kind) << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(15) << allocations << std::setw(15) << bytes << std::setw(10) << budget << std::defaultfloat
+                  << (isWithinBudget ? "" : "  OVER BUDGET") << "\n";
+    }
+    std::cout << "(per command)\n";
 
-                if (speaker == "Narrator") {
-                    output << speaker << ": ";
-                }
-                else {
-                    getCharacterByName(speaker);
-                    output << speaker << ": ";
-                }
+    Game::redirectOutput(nullptr);
+    Game::makeCurrent(nullptr);
+    return isWithinBudgets;
+}
 
-                output << speech << std::endl;
-            }
-            catch (const CharacterDoesNotExist &) {
-                output << "Error caught\n";
-                continue;
-            }
-        }
-        else if (first == "Show") {
-            std::string second;
-            input >> second;
-            if (second == "characters") {
-                showCharacters();
-            }
-            else if (second == "weapons") {
-                try {
-                    std::string characterName;
-                    input >> characterName;
-                    auto owner = getCharacterByName(characterName);
-
-                    // Check whether the character can use weapons
-                    if (dynamic_cast<WeaponUser *>(owner.get())) {
-                        auto weaponUser = std::dynamic_pointer_cast<WeaponUser>(owner);
-                        weaponUser->showWeapons();
-                    }
-                    else {
-                        throw IllegalItemType();
-                    }
-                }
-                catch (const CharacterDoesNotExist &) {
-                    output << "Error caught\n";
-                    continue;
-                }
-                catch (const IllegalItemType &) {
-                    output << "Error caught\n";
-                    continue;
-                }
-            }
-            else if (second == "potions") {
-                try {
-                    std::string characterName;
-                    input >> characterName;
-                    auto owner = getCharacterByName(characterName);
+/// <summary>
+/// Measures the multi-producer queue alone and the ingestion of tagged commands into a session,
+/// checking that the elements of every producer arrive in order.
+/// </summary>
+/// <param name="commands"> number of elements pushed by all producers together </param>
+void runIngestionBenchmark(int commands)
+{
+    const std::uint32_t producers = 4;
+    using Clock = std::chrono::steady_clock;
 
-                    auto potionUser = std::dynamic_pointer_cast<PotionUser>(owner);
-                    potionUser->showPotions();
-                }
-                catch (const CharacterDoesNotExist &) {
-                    output << "Error caught\n";
-                    continue;
-                }
-            }
-            else if (second == "spells") {
-                try {
-                    std::string characterName;
-                    input >> characterName;
-                    auto owner = getCharacterByName(characterName);
-
-                    // Check whether the character can use spells
-                    if (dynamic_cast<SpellUser *>(owner.get())) {
-                        auto spellUser = std::dynamic_pointer_cast<SpellUser>(owner);
-                        spellUser->showSpells();
-                    }
-                    else {
-                        throw IllegalItemType();
-                    }
-                }
-                catch (const CharacterDoesNotExist &) {
-                    output << "Error caught\n";
-                    continue;
-                }
-                catch (const IllegalItemType &) {
-                    output << "Error caught\n";
-                    continue;
+    // Queue alone: producers push their sequence numbers with the time of the push,
+    // the time an element waits is bounded by the capacity over the rate of the consumer
+    struct Stamp
+    {
+        std::uint32_t producer = 0;
+        std::uint32_t sequence = 0;
+        Clock::time_point pushed;
+    };
+    std::vector<std::thread> threads;
+    bool isOrdered = true;
+    for (std::size_t capacity: {std::size_t(1) << 16, std::size_t(1) << 10}) {
+        MpscQueue<Stamp> queue(capacity);
+        std::vector<double> latencies;
+        latencies.reserve(commands);
+
+        auto start = Clock::now();
+        threads.clear();
+        for (std::uint32_t producer = 0; producer < producers; ++producer) {
+            threads.emplace_back([&, producer]()
+            {
+                for (std::uint32_t i = producer; i < std::uint32_t(commands); i += producers) {
+                    queue.push({producer, i / producers, Clock::now()});
                 }
-            }
-            else {
-                throw std::runtime_error("Unexpected command");
-            }
+            });
+        }
+        std::vector<std::uint32_t> expected(producers, 0);
+        for (int i = 0; i < commands; ++i) {
+            Stamp stamp = queue.pop();
+            latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - stamp.pushed).count());
+            isOrdered = isOrdered && (stamp.sequence == expected[stamp.producer]++);
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        for (auto &thread: threads) {
+            thread.join();
         }
-    }
-
-    // Closing files
 
-    input.close();
-    output.close();
-}
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double share)
+        {
+            return latencies.empty() ? 0.0 : latencies[std::size_t(share * (latencies.size() - 1))];
+        };
+        std::cout << "queue of " << capacity << ": " << producers << " producers, " << elapsed.count() * 1000 << " ms, "
+                  << commands / elapsed.count() << " elements/s, latency p50 " << percentile(0.5) << " us, p99 "
+                  << percentile(0.99) << " us, max " << percentile(1.0) << " us"
+                  << (isOrdered ? "" : ", order of a producer broken") << "\n";
+    }
 
-std::shared_ptr<Game> Game::currentGame()
-{
-    if (game == nullptr) {
-        // Single instance is created, smart pointer is used
-        game.reset(new Game());
+    // Ingestion: every player moves its own character and tags its commands
+    auto session = Game::newSession();
+    Game::makeCurrent(session);
+    std::string text;
+    std::istringstream setup("1\nCreate characters fighter " + std::to_string(producers) + " player 100\n");
+    session->executeScript(setup, text);
+    Game::makeCurrent(nullptr);
+
+    std::vector<std::uint32_t> delivered(producers, 0);
+    isOrdered = true;
+    auto start = Clock::now();
+    {
+        CommandIngestion ingestion(session, 1 << 16, [&](std::uint32_t player, std::string &output)
+        {
+            // Player p moves to (sequence + 1, p) with its sequence-th command
+            std::string position = "(" + std::to_string(++delivered[player]) + ", " + std::to_string(player) + ")";
+            isOrdered = isOrdered && (output.find(position) != std::string::npos);
+        });
+
+        threads.clear();
+        for (std::uint32_t producer = 0; producer < producers; ++producer) {
+            threads.emplace_back([&, producer]()
+            {
+                Command command;
+                command.kind = CommandKind::Move;
+                command.words = {"player" + std::to_string(producer)};
+                command.value = 1;
+                command.count = 0;
+                for (std::uint32_t i = producer; i < std::uint32_t(commands); i += producers) {
+
+                    // The first move also lifts the player onto its own row
+                    command.count = (i < producers) ? int(producer) : 0;
+                    ingestion.submit(producer, command);
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
     }
-    return game;
-}
+    std::chrono::duration<double> elapsed = Clock::now() - start;
 
-void Game::destroyCharacter(std::shared_ptr<Character> ptr)
-{
-    characters.removeItem(ptr);
-    output << ptr->getName() << " has died...\n";
-    ptr.reset();
+    std::cout << "ingestion: " << producers << " players, " << elapsed.count() * 1000 << " ms, "
+              << commands / elapsed.count() << " commands/s" << (isOrdered ? "" : ", order of a player broken") << "\n";
 }
 
-std::ofstream &Game::getOutput()
+int main(int argc, char *argv[])
 {
-    return output;
-}
 
-// Setting the static variables
+    // Command line options
+    std::vector<std::string> options(argv + 1, argv + argc);
 
-inline int Fighter::maxAllowedWeapons{3};
+#ifndef _WIN32
+    // Server mode and its load generator
+    if (options.size() >= 2 && options[0] == "--serve") {
+        GameServer server(options[1]);
+        server.run();
+        return 0;
+    }
+    if (options.size() >= 5 && options[0] == "--client") {
+        runClientBenchmark(options[1], std::stoi(options[2]), std::stoi(options[3]), options[4]);
+        return 0;
+    }
+#endif
 
-inline int Fighter::maxAllowedPotions{5};
+    // Concurrent players
+    if (options.size() >= 2 && options[0] == "--players") {
+        runPlayers(std::vector<std::string>(options.begin() + 1, options.end()));
+        return 0;
+    }
 
-inline int Archer::maxAllowedWeapons{2};
+    // Batch mode
+    if (options.size() >= 2 && options[0] == "--batch") {
+        unsigned int threads = (options.size() >= 3) ? std::stoul(options[2]) : 0;
+        return (runBatch(options[1], threads) == 0) ? 0 : 1;
+    }
 
-inline int Archer::maxAllowedPotions{3};
+    // Auto-battle mode
+    if (options.size() >= 2 && options[0] == "--battle") {
+        std::uint64_t fights = std::stoull(options[1]);
+        std::uint64_t seed = (options.size() >= 3) ? std::stoull(options[2]) : 1;
+        unsigned int threads = (options.size() >= 4) ? std::stoul(options[3]) : 0;
 
-inline int Archer::maxAllowedSpells{2};
+        auto start = std::chrono::steady_clock::now();
+        BattleTable table = runBattles(fights, seed, threads);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-inline int Wizard::maxAllowedPotions{10};
+        if (options.size() >= 5) {
+            std::ofstream report(options[4]);
+            writeBattleTable(report, table, fights, seed);
+        }
+        else {
+            writeBattleTable(std::cout, table, fights, seed);
+        }
+        std::cerr << fights << " fights in " << elapsed.count() * 1000 << " ms, " << fights / elapsed.count() << " fights/s\n";
+        return 0;
+    }
 
-inline int Wizard::maxAllowedSpells{10};
+    // Benchmarks
+    if (options.size() >= 2 && options[0] == "--bench") {
+        int size = (options.size() >= 3) ? std::stoi(options[2]) : 1000000;
+        if (options[1] == "pipeline") {
+            runExecutionBenchmark(size, {ExecutionMode::Pipelined, ExecutionMode::Sequential});
+        }
+        else if (options[1] == "parallel") {
+            runExecutionBenchmark(size, {ExecutionMode::Parallel, ExecutionMode::Sequential});
+        }
+        else if (options[1] == "speculative") {
+            runExecutionBenchmark(size, {ExecutionMode::Speculative, ExecutionMode::Parallel, ExecutionMode::Sequential});
+        }
+        else if (options[1] == "journal") {
+            runJournalBenchmark(size);
+        }
+        else if (options[1] == "effects") {
+            runEffectsBenchmark(size);
+        }
+        else if (options[1] == "spatial") {
+            runSpatialBenchmark(size);
+        }
+        else if (options[1] == "ingest") {
+            runIngestionBenchmark(size);
+        }
+        else if (options[1] == "paths") {
+            runPathBenchmark((options.size() >= 3) ? size : 10000);
+        }
+        else if (options[1] == "setup") {
+            runSetupBenchmark(size);
+        }
+        else if (options[1] == "format") {
+            runFormatBenchmark((options.size() >= 3) ? size : 10000000);
+        }
+        else if (options[1] == "export") {
+            runExportBenchmark(size);
+        }
+        else if (options[1] == "stats") {
+            runStatisticsBenchmark((options.size() >= 3) ? size : 100000);
+        }
+        else if (options[1] == "show") {
+            runShowBenchmark((options.size() >= 3) ? size : 2000000);
+        }
+        else if (options[1] == "repeat") {
+            runRepeatBenchmark((options.size() >= 3) ? size : 100000);
+        }
+        else if (options[1] == "allocations") {
+            return runAllocationBudgets((options.size() >= 3) ? size : 100000) ? 0 : 1;
+        }
+        else if (options[1] == "fork") {
+            runForkBenchmark((options.size() >= 3) ? size : 100);
+        }
+        else if (options[1] == "trading") {
+            runExecutionBenchmark(size, {ExecutionMode::Parallel, ExecutionMode::Sequential}, writeTradingScript);
+        }
+        else {
+            std::cerr << "Unknown benchmark " << options[1] << "\n";
+            return 1;
+        }
+        return 0;
+    }
 
-int main()
-{
+    ExecutionMode mode = ExecutionMode::Pipelined;
+    std::string journalPath;
+    std::string tracePath;
+    bool isCounting = false;
+    bool isCountingAllocations = false;
+    std::size_t groupSize = 1024;
+    std::chrono::milliseconds groupInterval(10);
+    for (std::size_t i = 0; i < options.size(); ++i) {
+        const std::string &option = options[i];
+        bool hasValue = (i + 1 < options.size());
+        if (option == "--sequential") {
+            mode = ExecutionMode::Sequential;
+        }
+        else if (option == "--parallel") {
+            mode = ExecutionMode::Parallel;
+        }
+        else if (option == "--speculative") {
+            mode = ExecutionMode::Speculative;
+        }
+        else if (option == "--journal" && hasValue) {
+            journalPath = options[++i];
+        }
+        else if (option == "--trace" && hasValue) {
+            tracePath = options[++i];
+        }
+        else if (option == "--counters") {
+            isCounting = true;
+        }
+        else if (option == "--allocations") {
+            isCountingAllocations = true;
+        }
+        else if (option == "--group-commit" && hasValue) {
+            groupSize = std::stoul(options[++i]);
+        }
+        else if (option == "--group-commit-ms" && hasValue) {
+            groupInterval = std::chrono::milliseconds(std::stol(options[++i]));
+        }
+    }
 
     // Start of game session
     auto game = Game::currentGame();
-    game->startNewGame();
+    if (!journalPath.empty()) {
+        game->enableJournal(journalPath, groupSize, groupInterval);
+    }
+    if (!tracePath.empty() && !Tracer::open(tracePath)) {
+        std::cerr << "Cannot create the trace file " << tracePath << "\n";
+        return 1;
+    }
+    if (isCounting) {
+        std::string reason;
+        if (!PerfCounters::open(reason)) {
+            std::cerr << "Performance counters unavailable (" << reason << "), running without them\n";
+        }
+    }
+    if (isCountingAllocations) {
+        AllocationCounter::open();
+    }
+    game->startNewGame(mode);
+    Tracer::close();
+    PerfCounters::report(std::cerr);
+    AllocationCounter::report(std::cerr);
     return 0;
 }